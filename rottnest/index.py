@@ -31,13 +31,16 @@ def compact_indices(index_name, num_groups, split):
     def run_index(index_name, num_groups):
         index = ctypes.CDLL(os.path.dirname(__file__) + "/libindex.cpython-3{}-x86_64-linux-gnu.so".format(sys.version_info.minor))
         index.index_python.argtypes = [ctypes.c_char_p, ctypes.c_size_t]
-        index.index_python.restype = None
-        index.index_python(index_name.encode('utf-8'), num_groups)
+        index.index_python.restype = ctypes.c_int
+        if index.index_python(index_name.encode('utf-8'), num_groups) != 0:
+            raise RuntimeError("indexing {} failed, see the log".format(index_name))
 
     # Create and start a separate process
     p = multiprocessing.Process(target=run_index, args=(index_name, num_groups))
     p.start()
     p.join()  # Wait for the process to complete
+    if p.exitcode != 0:
+        raise RuntimeError("indexing {} failed".format(index_name))
     
     # this will produce index_name.kauai, index_name.oahu, index_name.hawaii in the current directory, move them to the split directory
     [os.rename(index_name + k, index_name + "/indices/split_{}{}".format(split, k)) for k in [".kauai", ".oahu", ".hawaii"]]
@@ -8,6 +8,7 @@ import sys
 import argparse
 import boto3
 import time
+import json
 
 ROW_GROUPS_IN_FILE = 10
 
@@ -15,9 +16,37 @@ class Vector(ctypes.Structure):
     _fields_ = [("data", ctypes.POINTER(ctypes.c_size_t)),
                 ("size", ctypes.c_size_t)]
 
+class Bytes(ctypes.Structure):
+    _fields_ = [("data", ctypes.POINTER(ctypes.c_char)),
+                ("size", ctypes.c_size_t)]
+
+# row_groups holds results as a portable roaring bitmap, e.g. for
+# pyroaring.BitMap.deserialize, and is empty when results is [EMPTY]. stats and
+# error are C strings, kept as plain pointers so that they can be freed with
+# free_search_result_python once read with ctypes.string_at
+class SearchResult(ctypes.Structure):
+    _fields_ = [("results", Vector),
+                ("stats", ctypes.c_void_p),
+                ("error", ctypes.c_void_p),
+                ("row_groups", Bytes)]
+
 
 EMPTY = 18446744073709551615
 
+# split index prefix -> open SearchSession handle, so that repeated searches in
+# this process reuse clients and parsed footers
+sessions = {}
+
+def get_session(lib, split_index_prefix):
+    if split_index_prefix not in sessions:
+        lib.open_session_python.argtypes = [c_char_p]
+        lib.open_session_python.restype = c_void_p
+        session = lib.open_session_python(split_index_prefix.encode('utf-8'))
+        if session is None:
+            raise IOError("could not open index split {}".format(split_index_prefix))
+        sessions[split_index_prefix] = session
+    return sessions[split_index_prefix]
+
 def row_group_search(filenames, row_groups, query, limit, batch_size = 100):
 
     row_group_keys = {}
@@ -111,24 +140,44 @@ def search(index_path, query, limit):
     all_dfs = []
 
     index_time = 0
+    index_requests = {}
+    index_bytes = 0
 
     for split_prefix in split_prefixes[::-1]:
         number_of_files = len(daft.daft.io_glob("{}/parquets/{}/**".format(index_path, split_prefix)))
         filenames = ["{}/parquets/{}/{}.parquet".format(index_path, split_prefix,i) for i in range(number_of_files)]
 
-        lib.search_python.argtypes = [c_char_p, c_char_p, c_size_t]
-        lib.search_python.restype = Vector
+        lib.search_session_python.argtypes = [c_void_p, c_char_p, c_size_t]
+        lib.search_session_python.restype = SearchResult
+        lib.free_search_result_python.argtypes = [SearchResult]
+        lib.free_search_result_python.restype = None
 
         split_index_prefix = index_path + "/indices/" + split_prefix
 
         start = time.time()
 
         # the c bindings expect s3://bucket/index_name/split_i as the argument or path/split_i as the argument
-        result = lib.search_python(split_index_prefix.encode('utf-8'), query.encode('utf-8'), limit)
+        session = get_session(lib, split_index_prefix)
+        result = lib.search_session_python(session, query.encode('utf-8'), limit)
 
         index_time += time.time() - start
 
-        row_groups = [result.data[i] for i in range(result.size)]
+        # copy everything out of the result, then hand it back to be freed
+        try:
+            error = ctypes.string_at(result.error).decode('utf-8') if result.error is not None else None
+            stats = json.loads(ctypes.string_at(result.stats))
+            row_groups = [result.results.data[i] for i in range(result.results.size)]
+        finally:
+            lib.free_search_result_python(result)
+
+        if error is not None:
+            raise IOError("index search failed on {}: {}".format(split_index_prefix, error))
+
+        # per split I/O of the index lookup, see IOStats
+        for file, counter in stats["requests"].items():
+            index_requests[file] = index_requests.get(file, 0) + counter["count"]
+            index_bytes += counter["bytes"]
+
         row_groups = sorted(list(set(row_groups)))
 
         if row_groups != [EMPTY]:
@@ -143,6 +192,7 @@ def search(index_path, query, limit):
             break
 
     print("INDEX TIME: {}".format(index_time))
+    print("INDEX REQUESTS: {} BYTES: {}".format(index_requests, index_bytes))
     
     if len(all_dfs) == 0 or sum([len(i) for i in all_dfs]) == 0:
         return None 
@@ -6,9 +6,9 @@ os.environ['CXX'] = 'g++'
 
 ext_module = Extension(
     'rottnest.libindex',  # Change 'yourpackage' to your package name
-    sources=['src/index.cc', 'src/compactor.cc', 'src/fm_index.cc', 'src/vfr.cc', 'src/kauai.cc', 'src/plist.cc'],
+    sources=['src/index.cc', 'src/compactor.cc', 'src/fm_index.cc', 'src/vfr.cc', 'src/uring.cc', 'src/kauai.cc', 'src/plist.cc', 'src/roaring.cc', 'src/wavelet_tree.cc'],
     language = "c++",
-    include_dirs=['src'],
+    include_dirs=['src', 'vendored/roaring'],
     library_dirs=[],
     libraries=['glog','divsufsort', 'aws-cpp-sdk-s3', 'aws-cpp-sdk-core', 'lz4', 'snappy', 'zstd'],
     extra_compile_args=['-O3', '-g', '-fPIC','-Wno-sign-compare', '-Wno-strict-prototypes', '-fopenmp', '-std=c++17'], 
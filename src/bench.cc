@@ -0,0 +1,149 @@
+#include "index.h"
+#include <chrono>
+
+/*
+Benchmarks searches against a simulated object store, so that round trips can
+be tuned without S3. Build an index locally first (e.g. from example-logs with
+./index index), then
+
+./bench <split_index_prefix> <queries_file> [latency_ms] [MB/s] [jitter_ms]
+		[limit] [warm]
+
+queries_file has one query per line. Each of .kauai, .hawaii and .oahu gets
+its own SimulatedRemoteVirtualFileRegion and trace, so per file numbers are
+per query stage. Unless warm is 1, every query starts with an empty cache like
+a fresh search_all would.
+*/
+
+struct StageStats {
+	size_t requests = 0;
+	size_t bytes = 0;
+	long serial_us = 0; // sum of request durations
+	long span_us = 0;	// first request issued to last one done
+};
+
+StageStats summarize(RequestTrace &trace) {
+	StageStats stats;
+	long first = -1, last = 0;
+	for (const SimulatedRequest &request : trace.requests()) {
+		stats.requests++;
+		stats.bytes += request.length;
+		stats.serial_us += request.duration_us;
+		if (first < 0 || request.start_us < first) {
+			first = request.start_us;
+		}
+		last = std::max(last, request.start_us + request.duration_us);
+	}
+	stats.span_us = first < 0 ? 0 : last - first;
+	return stats;
+}
+
+void print_stage(std::string query, std::string stage, StageStats stats) {
+	printf("%-24s %-8s %8zu %12zu %10.1f %10.1f\n", query.substr(0, 24).c_str(),
+		   stage.c_str(), stats.requests, stats.bytes, stats.span_us / 1000.0,
+		   stats.serial_us / 1000.0);
+}
+
+int main(int argc, char *argv[]) {
+
+	google::InitGoogleLogging("rottnest-bench");
+
+	if (argc < 3) {
+		std::cout << "Usage: " << argv[0]
+				  << " <split_index_prefix> <queries_file> [latency_ms] [MB/s] "
+					 "[jitter_ms] [limit] [warm]"
+				  << std::endl;
+		return 1;
+	}
+
+	std::string split_index_prefix = argv[1];
+	SimulatedRemoteConfig config;
+	if (argc > 3) {
+		config.latency_us = std::stod(argv[3]) * 1000;
+	}
+	if (argc > 4) {
+		config.bytes_per_second = std::stod(argv[4]) * 1e6;
+	}
+	if (argc > 5) {
+		config.jitter_us = std::stod(argv[5]) * 1000;
+	}
+	size_t limit = argc > 6 ? std::stoul(argv[6]) : 1000;
+	bool warm = argc > 7 && std::string(argv[7]) == "1";
+
+	std::vector<std::string> queries;
+	std::ifstream queries_file(argv[2]);
+	std::string line;
+	while (std::getline(queries_file, line)) {
+		if (!line.empty()) {
+			queries.push_back(line);
+		}
+	}
+
+	auto kauai_trace = std::make_shared<RequestTrace>();
+	auto hawaii_trace = std::make_shared<RequestTrace>();
+	auto oahu_trace = std::make_shared<RequestTrace>();
+	BlockCache cache(BLOCK_CACHE_BYTES);
+	auto open = [&](std::string suffix, std::shared_ptr<RequestTrace> trace) {
+		return std::unique_ptr<VirtualFileRegion>(new CachingVirtualFileRegion(
+			new SimulatedRemoteVirtualFileRegion(split_index_prefix + suffix,
+												 config, trace),
+			CACHE_RAW | CACHE_DECODED, &cache));
+	};
+
+	printf("%-24s %-8s %8s %12s %10s %10s\n", "query", "stage", "requests",
+		   "bytes", "wall_ms", "serial_ms");
+
+	StageStats totals[4];
+	for (const std::string &query : queries) {
+		if (!warm) {
+			cache.clear();
+		}
+		kauai_trace->clear();
+		hawaii_trace->clear();
+		oahu_trace->clear();
+		auto vfr_kauai = open(".kauai", kauai_trace);
+		auto vfr_hawaii = open(".hawaii", hawaii_trace);
+		auto vfr_oahu = open(".oahu", oahu_trace);
+
+		auto start = std::chrono::steady_clock::now();
+		std::pair<int, std::vector<plist_size_t>> result =
+			search_kauai(vfr_kauai.get(), query, 1, limit);
+		auto kauai_done = std::chrono::steady_clock::now();
+		if (result.first == 2) {
+			search_hawaii_oahu(vfr_hawaii.get(), vfr_oahu.get(), query, limit);
+		}
+		auto done = std::chrono::steady_clock::now();
+
+		StageStats kauai = summarize(*kauai_trace);
+		kauai.span_us = std::chrono::duration_cast<std::chrono::microseconds>(
+							kauai_done - start)
+							.count();
+		StageStats hawaii = summarize(*hawaii_trace);
+		StageStats oahu = summarize(*oahu_trace);
+		StageStats total;
+		total.requests = kauai.requests + hawaii.requests + oahu.requests;
+		total.bytes = kauai.bytes + hawaii.bytes + oahu.bytes;
+		total.serial_us = kauai.serial_us + hawaii.serial_us + oahu.serial_us;
+		total.span_us =
+			std::chrono::duration_cast<std::chrono::microseconds>(done - start)
+				.count();
+
+		StageStats stages[4] = {kauai, hawaii, oahu, total};
+		const char *names[4] = {"kauai", "hawaii", "oahu", "total"};
+		for (int i = 0; i < 4; i++) {
+			print_stage(query, names[i], stages[i]);
+			totals[i].requests += stages[i].requests;
+			totals[i].bytes += stages[i].bytes;
+			totals[i].serial_us += stages[i].serial_us;
+			totals[i].span_us += stages[i].span_us;
+		}
+	}
+
+	const char *names[4] = {"kauai", "hawaii", "oahu", "total"};
+	for (int i = 0; i < 4; i++) {
+		print_stage("ALL", names[i], totals[i]);
+	}
+
+	google::ShutdownGoogleLogging();
+	return 0;
+}
@@ -0,0 +1,113 @@
+#pragma once
+#include <omp.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/*
+Appends independently encoded blocks to a file in the order they were handed
+in, while the encoding, usually compression, runs on a pool of worker threads.
+The workers are kept for the life of the writer so their per-thread zstd
+contexts get reused. The caller does the writing: once twice as many blocks as
+there are workers are in flight, write() first waits for the oldest one and
+appends it, which also bounds how much is held in memory.
+
+Callbacks run on the caller's thread in file order with the number of bytes
+written, e.g. to record block offsets. An exception from an encode function
+comes out of the write() or finish() that reaches its block.
+*/
+class BlockWriter {
+  public:
+	explicit BlockWriter(FILE *fp, size_t threads = omp_get_max_threads())
+		: fp_(fp), max_in_flight_(2 * std::max<size_t>(threads, 1)) {
+		for (size_t i = 0; i < std::max<size_t>(threads, 1); i++) {
+			workers_.emplace_back([this] { work(); });
+		}
+	}
+
+	~BlockWriter() {
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			stopping_ = true;
+			jobs_.clear();
+		}
+		cv_.notify_all();
+		for (std::thread &worker : workers_) {
+			worker.join();
+		}
+	}
+
+	BlockWriter(const BlockWriter &) = delete;
+	BlockWriter &operator=(const BlockWriter &) = delete;
+
+	void write(std::function<std::string()> encode,
+			   std::function<void(size_t)> written = nullptr) {
+		while (pending_.size() >= max_in_flight_) {
+			write_front();
+		}
+		std::packaged_task<std::string()> job(std::move(encode));
+		pending_.push_back({job.get_future(), std::move(written)});
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			jobs_.push_back(std::move(job));
+		}
+		cv_.notify_one();
+	}
+
+	// write out every block handed in so far
+	void finish() {
+		while (!pending_.empty()) {
+			write_front();
+		}
+	}
+
+  private:
+	struct Pending {
+		std::future<std::string> block;
+		std::function<void(size_t)> written;
+	};
+
+	FILE *fp_;
+	size_t max_in_flight_;
+	std::deque<Pending> pending_;
+
+	std::mutex mutex_;
+	std::condition_variable cv_;
+	std::deque<std::packaged_task<std::string()>> jobs_;
+	bool stopping_ = false;
+	std::vector<std::thread> workers_;
+
+	void write_front() {
+		Pending pending = std::move(pending_.front());
+		pending_.pop_front();
+		std::string block = pending.block.get();
+		fwrite(block.data(), 1, block.size(), fp_);
+		if (pending.written) {
+			pending.written(block.size());
+		}
+	}
+
+	void work() {
+		while (true) {
+			std::packaged_task<std::string()> job;
+			{
+				std::unique_lock<std::mutex> lock(mutex_);
+				cv_.wait(lock, [this] { return stopping_ || !jobs_.empty(); });
+				if (stopping_) {
+					return;
+				}
+				job = std::move(jobs_.front());
+				jobs_.pop_front();
+			}
+			job();
+		}
+	}
+};
@@ -12,9 +12,12 @@ int main(int argc, char *argv[]) {
 	if (mode == "index") {
 		std::string index_name = argv[2];
 		size_t num_groups = std::stoul(argv[3]);
+		bool train_dictionaries =
+			argc > 4 && std::string(argv[4]) == "--dictionaries";
 		compact(num_groups);
 		write_kauai(index_name, num_groups);
-		auto type_uncompressed_lines_in_block = write_oahu(index_name);
+		auto type_uncompressed_lines_in_block =
+			write_oahu(index_name, train_dictionaries);
 
         std::map<int, std::string> type_input_files = {};
         for (auto type : type_uncompressed_lines_in_block)
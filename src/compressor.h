@@ -1,20 +1,102 @@
 #pragma once
+#include <cstdint>
+#include <cstring>
 #include <iostream>
 #include <lz4.h>
+#include <lz4frame.h>
+#include <memory>
 #include <snappy.h>
 #include <stdexcept>
 #include <string>
+#include <vector>
+#include <zdict.h>
 #include <zstd.h>
 
-enum class CompressionAlgorithm { ZSTD, SNAPPY, LZ4 };
+#define ZSTD_DICTIONARY_BYTES 65536 // capacity of a trained dictionary
+
+// the values are written into index files as codec ids, don't renumber
+// NONE stores data as is, for data that is already packed
+enum class CompressionAlgorithm : uint8_t {
+	ZSTD = 0,
+	SNAPPY = 1,
+	LZ4 = 2,
+	NONE = 3
+};
+
+// How a structure gets compressed. Only the algorithm is recorded in the
+// file, the level just trades write time for size, e.g. LZ4 for FM chunks a
+// query decodes over and over, zstd 19 for cold sections. LZ4 levels above 2
+// are LZ4HC.
+struct Codec {
+	CompressionAlgorithm algorithm = CompressionAlgorithm::ZSTD;
+	int level = 5;
+};
+
+// A zstd dictionary trained on samples of one kind of frame, e.g. the posting
+// lists of an Oahu file, and stored next to them. Small frames compress much
+// better against it. The digested form for decompression is built once.
+class ZstdDictionary {
+  public:
+	explicit ZstdDictionary(std::string bytes)
+		: bytes_(std::move(bytes)),
+		  ddict_(ZSTD_createDDict(bytes_.data(), bytes_.size()),
+				 ZSTD_freeDDict) {
+		if (!ddict_) {
+			throw std::runtime_error("Invalid zstd dictionary.");
+		}
+	}
+
+	// nullptr if there are too few samples to train on
+	static std::shared_ptr<const ZstdDictionary>
+	train(const std::vector<std::string> &samples,
+		  size_t capacity = ZSTD_DICTIONARY_BYTES) {
+		std::string concatenated;
+		std::vector<size_t> sizes;
+		for (const std::string &sample : samples) {
+			if (!sample.empty()) {
+				concatenated += sample;
+				sizes.push_back(sample.size());
+			}
+		}
+		std::string bytes(capacity, '\0');
+		size_t size =
+			ZDICT_trainFromBuffer(bytes.data(), capacity, concatenated.data(),
+								  sizes.data(), sizes.size());
+		if (ZDICT_isError(size)) {
+			return nullptr;
+		}
+		bytes.resize(size);
+		return std::make_shared<const ZstdDictionary>(std::move(bytes));
+	}
+
+	const std::string &bytes() const { return bytes_; }
+	const ZSTD_DDict *ddict() const { return ddict_.get(); }
+
+  private:
+	std::string bytes_;
+	std::unique_ptr<ZSTD_DDict, size_t (*)(ZSTD_DDict *)> ddict_;
+};
 
 class Compressor {
   public:
-	explicit Compressor(CompressionAlgorithm algorithm)
-		: algorithm_(algorithm) {}
+	// a dictionary only applies to ZSTD and must outlive the compressor
+	explicit Compressor(CompressionAlgorithm algorithm,
+						const ZstdDictionary *dictionary = nullptr)
+		: algorithm_(algorithm), dictionary_(dictionary) {}
+
+	explicit Compressor(Codec codec, const ZstdDictionary *dictionary = nullptr)
+		: algorithm_(codec.algorithm), level_(codec.level),
+		  dictionary_(dictionary) {}
+
+	CompressionAlgorithm algorithm() const { return algorithm_; }
+
+	// at the level of the codec the compressor was made with
+	std::string compress(const char *data, size_t size) const {
+		return compress(data, size, level_);
+	}
 
 	std::string compress(const char *data, size_t size,
-						 int compression_level = 5) {
+						 int compression_level) const {
 		if (size == 0) {
 			return "";
 		}
@@ -24,20 +106,129 @@ class Compressor {
 		case CompressionAlgorithm::SNAPPY:
 			return compressSnappy(data, size);
 		case CompressionAlgorithm::LZ4:
-			return compressLZ4(data, size);
+			return compressLZ4(data, size, compression_level);
+		case CompressionAlgorithm::NONE:
+			return std::string(data, size);
+		default:
+			throw std::runtime_error("Unsupported compression algorithm.");
+		}
+	}
+
+	std::string decompress(const std::string &compressedData) const {
+		return decompress(compressedData.data(), compressedData.size());
+	}
+
+	// How many bytes data decompresses to, as recorded in the frame header
+	size_t decompressed_size(const char *data, size_t size) const {
+		switch (algorithm_) {
+		case CompressionAlgorithm::ZSTD: {
+			unsigned long long content_size =
+				ZSTD_getFrameContentSize(data, size);
+			if (content_size == ZSTD_CONTENTSIZE_ERROR) {
+				throw std::runtime_error("Decompression failed.");
+			}
+			return content_size == ZSTD_CONTENTSIZE_UNKNOWN ? 0 : content_size;
+		}
+		case CompressionAlgorithm::SNAPPY: {
+			size_t length;
+			if (!snappy::GetUncompressedLength(data, size, &length)) {
+				throw std::runtime_error(
+					"Failed to decompress data using Snappy.");
+			}
+			return length;
+		}
+		case CompressionAlgorithm::NONE:
+			return size;
+		case CompressionAlgorithm::LZ4: {
+			// reading the header advances the context, start from scratch
+			// before and after
+			LZ4F_frameInfo_t info;
+			size_t header_size = size;
+			LZ4F_resetDecompressionContext(lz4_dctx());
+			size_t result =
+				LZ4F_getFrameInfo(lz4_dctx(), &info, data, &header_size);
+			LZ4F_resetDecompressionContext(lz4_dctx());
+			if (LZ4F_isError(result)) {
+				throw std::runtime_error("Failed to decompress data using LZ4.");
+			}
+			return info.contentSize;
+		}
+		default:
+			throw std::runtime_error("Unsupported compression algorithm.");
+		}
+	}
+
+	// Decompress into a caller's buffer of capacity bytes, e.g. a reused
+	// scratch buffer or the final vector, and return how many bytes were
+	// written. Throws if they do not fit.
+	size_t decompress_into(const char *data, size_t size, char *dst,
+						   size_t capacity) const {
+		switch (algorithm_) {
+		case CompressionAlgorithm::ZSTD: {
+			size_t written =
+				dictionary_
+					? ZSTD_decompress_usingDDict(zstd_dctx(), dst, capacity,
+												 data, size,
+												 dictionary_->ddict())
+					: ZSTD_decompressDCtx(zstd_dctx(), dst, capacity, data,
+										  size);
+			if (ZSTD_isError(written)) {
+				throw std::runtime_error("Decompression failed.");
+			}
+			return written;
+		}
+		case CompressionAlgorithm::SNAPPY: {
+			size_t length = decompressed_size(data, size);
+			if (length > capacity || !snappy::RawUncompress(data, size, dst)) {
+				throw std::runtime_error(
+					"Failed to decompress data using Snappy.");
+			}
+			return length;
+		}
+		case CompressionAlgorithm::NONE:
+			if (size > capacity) {
+				throw std::runtime_error("Decompression failed.");
+			}
+			memcpy(dst, data, size);
+			return size;
+		case CompressionAlgorithm::LZ4: {
+			LZ4F_dctx *dctx = lz4_dctx();
+			LZ4F_resetDecompressionContext(dctx);
+			size_t written = 0;
+			size_t consumed = 0;
+			size_t hint = 1;
+			while (hint != 0) {
+				size_t dst_size = capacity - written;
+				size_t src_size = size - consumed;
+				hint = LZ4F_decompress(dctx, dst + written, &dst_size,
+									   data + consumed, &src_size, nullptr);
+				// no progress means the output is full or the frame is cut
+				if (LZ4F_isError(hint) || (dst_size == 0 && src_size == 0)) {
+					LZ4F_resetDecompressionContext(dctx);
+					throw std::runtime_error(
+						"Failed to decompress data using LZ4.");
+				}
+				written += dst_size;
+				consumed += src_size;
+			}
+			return written;
+		}
 		default:
 			throw std::runtime_error("Unsupported compression algorithm.");
 		}
 	}
 
-	std::string decompress(const std::string &compressedData) {
+	// decompress straight out of a caller's buffer, e.g. an mmap'd file
+	std::string decompress(const char *data, size_t size) const {
 		switch (algorithm_) {
 		case CompressionAlgorithm::ZSTD:
-			return decompressZstd(compressedData);
+			return decompressZstd(data, size);
 		case CompressionAlgorithm::SNAPPY:
-			return decompressSnappy(compressedData);
+			return decompressSnappy(data, size);
 		case CompressionAlgorithm::LZ4:
-			return decompressLZ4(compressedData);
+			return decompressLZ4(data, size);
+		case CompressionAlgorithm::NONE:
+			return std::string(data, size);
 		default:
 			throw std::runtime_error("Unsupported compression algorithm.");
 		}
@@ -45,82 +236,113 @@ class Compressor {
 
   private:
 	CompressionAlgorithm algorithm_;
+	int level_ = 5;
+	const ZstdDictionary *dictionary_;
+
+	// contexts are expensive to set up, every thread keeps one of each
+	static ZSTD_CCtx *zstd_cctx() {
+		static thread_local std::unique_ptr<ZSTD_CCtx, size_t (*)(ZSTD_CCtx *)>
+			cctx(ZSTD_createCCtx(), ZSTD_freeCCtx);
+		return cctx.get();
+	}
+
+	static ZSTD_DCtx *zstd_dctx() {
+		static thread_local std::unique_ptr<ZSTD_DCtx, size_t (*)(ZSTD_DCtx *)>
+			dctx(ZSTD_createDCtx(), ZSTD_freeDCtx);
+		return dctx.get();
+	}
+
+	static LZ4F_dctx *lz4_dctx() {
+		static thread_local std::unique_ptr<LZ4F_dctx,
+											LZ4F_errorCode_t (*)(LZ4F_dctx *)>
+			dctx(
+				[] {
+					LZ4F_dctx *dctx = nullptr;
+					LZ4F_createDecompressionContext(&dctx, LZ4F_VERSION);
+					return dctx;
+				}(),
+				LZ4F_freeDecompressionContext);
+		return dctx.get();
+	}
 
 	std::string compressZstd(const char *data, size_t size,
-							 int compression_level = 1) {
+							 int compression_level = 1) const {
 		size_t compressedSize = ZSTD_compressBound(size);
-		// ZSTD_CCtx* cctx = ZSTD_createCCtx();
-		// if(cctx == NULL) {
-		//     std::cerr << "Failed to create ZSTD_CCtx\n";
-		//     exit(1);
-		// }
-		// if (ZSTD_isError(ZSTD_CCtx_setParameter(cctx, ZSTD_c_nbWorkers, 8)))
-		// {
-		//     std::cout << "Failed to set worker threads\n";
-		//     exit(1);
-		// }
 		std::string compressed(compressedSize, '\0');
-		compressedSize = ZSTD_compress(compressed.data(), compressedSize, data,
-									   size, compression_level);
-		// compressedSize = ZSTD_compressCCtx(cctx, compressed.data(),
-		// compressedSize, data, size, compression_level); ZSTD_freeCCtx(cctx);
-		return std::string(compressed.data(), compressedSize);
+		// writers only, so the dictionary is loaded per frame rather than
+		// kept digested for every level
+		compressedSize =
+			dictionary_
+				? ZSTD_compress_usingDict(
+					  zstd_cctx(), compressed.data(), compressedSize, data,
+					  size, dictionary_->bytes().data(),
+					  dictionary_->bytes().size(), compression_level)
+				: ZSTD_compressCCtx(zstd_cctx(), compressed.data(),
+									compressedSize, data, size,
+									compression_level);
+		if (ZSTD_isError(compressedSize)) {
+			throw std::runtime_error("Compression failed.");
+		}
+		compressed.resize(compressedSize);
+		return compressed;
 	}
 
-	std::string decompressZstd(const std::string &compressedData) {
-		size_t decompressedSize = ZSTD_getDecompressedSize(
-			compressedData.c_str(), compressedData.size());
-		if (decompressedSize == -1) {
+	std::string decompressZstd(const char *data, size_t size) const {
+		// compress gives "" for empty input
+		if (size == 0) {
+			return "";
+		}
+		unsigned long long decompressedSize =
+			ZSTD_getFrameContentSize(data, size);
+		if (decompressedSize == ZSTD_CONTENTSIZE_ERROR ||
+			decompressedSize == ZSTD_CONTENTSIZE_UNKNOWN) {
 			throw std::runtime_error("Decompression failed.");
 		}
 		std::string decompressed(decompressedSize, '\0');
-		decompressedSize =
-			ZSTD_decompress(decompressed.data(), decompressedSize,
-							compressedData.c_str(), compressedData.size());
-		return std::string(decompressed.data(), decompressedSize);
+		decompressed.resize(
+			decompress_into(data, size, decompressed.data(), decompressedSize));
+		return decompressed;
 	}
 
-	std::string compressSnappy(const char *data, size_t size) {
+	std::string compressSnappy(const char *data, size_t size) const {
 		std::string compressed;
 		snappy::Compress(data, size, &compressed);
 		return compressed;
 	}
 
-	std::string decompressSnappy(const std::string &compressedData) {
+	std::string decompressSnappy(const char *data, size_t size) const {
 		std::string decompressed;
-		if (!snappy::Uncompress(compressedData.data(), compressedData.size(),
-								&decompressed)) {
+		if (!snappy::Uncompress(data, size, &decompressed)) {
 			throw std::runtime_error("Failed to decompress data using Snappy.");
 		}
 		return decompressed;
 	}
 
-	std::string compressLZ4(const char *data, size_t size) {
-		int compressedSize = LZ4_compressBound(size);
+	// LZ4 frames rather than raw blocks, so that the header records the
+	// content size like zstd and snappy do
+	std::string compressLZ4(const char *data, size_t size,
+							int compression_level) const {
+		LZ4F_preferences_t preferences = LZ4F_INIT_PREFERENCES;
+		preferences.frameInfo.contentSize = size;
+		preferences.compressionLevel = compression_level;
+		size_t compressedSize = LZ4F_compressFrameBound(size, &preferences);
 		std::string compressed(compressedSize, '\0');
-		int actualSize =
-			LZ4_compress_default(data, compressed.data(), size, compressedSize);
-		return std::string(compressed.data(), actualSize);
+		compressedSize = LZ4F_compressFrame(compressed.data(), compressedSize,
+											data, size, &preferences);
+		if (LZ4F_isError(compressedSize)) {
+			throw std::runtime_error("Failed to compress data using LZ4.");
+		}
+		compressed.resize(compressedSize);
+		return compressed;
 	}
 
-	std::string decompressLZ4(const std::string &compressedData) {
-		// Get the decompressed size as an upper bound (assumption: decompressed
-		// size <= compressed size * 4)
-		int decompressedSize = compressedData.size() * 4;
-		std::string decompressed(decompressedSize, '\0');
-
-		// Perform the decompression
-		int actualSize =
-			LZ4_decompress_safe(compressedData.c_str(), decompressed.data(),
-								compressedData.size(), decompressedSize);
-
-		if (actualSize < 0) {
-			throw std::runtime_error("Failed to decompress data using LZ4.");
+	std::string decompressLZ4(const char *data, size_t size) const {
+		if (size == 0) {
+			return "";
 		}
-
-		// Resize the decompressed string to the actual decompressed size
-		decompressed.resize(actualSize);
-
+		std::string decompressed(decompressed_size(data, size), '\0');
+		decompressed.resize(decompress_into(data, size, decompressed.data(),
+											decompressed.size()));
 		return decompressed;
 	}
 };
\ No newline at end of file
@@ -1,84 +1,190 @@
 #include "fm_index.h"
-
-std::string serializeMap(const std::map<char, size_t> &map) {
-	std::stringstream ss;
-	for (const auto &pair : map) {
-		ss << pair.first << ':' << pair.second << ',';
+#include "wavelet_tree.h"
+#include <unistd.h>
+
+std::string serializeCounts(const fm_counts &counts) {
+	std::string table(1, '\0');
+	size_t num_entries = 0;
+	for (size_t c = 0; c < ALPHABET; c++) {
+		if (counts[c] == 0) {
+			continue;
+		}
+		num_entries++;
+		table += (char)c;
+		// LEB128, seven bits at a time
+		size_t count = counts[c];
+		while (count >= 0x80) {
+			table += (char)((count & 0x7f) | 0x80);
+			count >>= 7;
+		}
+		table += (char)count;
 	}
-	std::string serializedString = ss.str();
-	if (serializedString.size() > 0) {
-		serializedString.pop_back();
-	} // Remove the trailing comma
-	return serializedString;
+	// 256 entries wrap to 0, which an empty table can't be confused with
+	// since its size is 1
+	table[0] = (char)num_entries;
+	return table;
 }
 
-std::map<char, size_t> deserializeMap(const std::string &serializedString) {
-
-	if (serializedString.size() == 0) {
-		return {};
+void deserializeCounts(const char *data, size_t size, fm_counts &counts) {
+	counts.fill(0);
+	if (size == 0) {
+		throw ReadError("empty FM chunk count table");
 	}
-
-	std::map<char, size_t> map;
-	std::stringstream ss(serializedString);
-	char key;
-	size_t value;
-
-	while (ss >> key && ss.ignore() && ss >> value) {
-		map[key] = value;
-		ss.ignore(); // Skip the comma
+	const unsigned char *cursor = reinterpret_cast<const unsigned char *>(data);
+	const unsigned char *end = cursor + size;
+	size_t num_entries = *cursor++;
+	if (num_entries == 0 && size > 1) {
+		num_entries = ALPHABET;
 	}
+	for (size_t i = 0; i < num_entries; i++) {
+		if (cursor == end) {
+			throw ReadError("truncated FM chunk count table");
+		}
+		unsigned char c = *cursor++;
+		size_t count = 0;
+		for (int shift = 0;; shift += 7) {
+			if (cursor == end || shift > 63) {
+				throw ReadError("truncated FM chunk count table");
+			}
+			unsigned char byte = *cursor++;
+			count |= (size_t)(byte & 0x7f) << shift;
+			if (!(byte & 0x80)) {
+				break;
+			}
+		}
+		counts[c] = count;
+	}
+}
 
-	return map;
+// the text maps of older files, c:123,d:4. Read by position, so that ',',
+// ':' and whitespace work as characters.
+static void parse_text_counts(const std::string &text, fm_counts &counts) {
+	counts.fill(0);
+	size_t i = 0;
+	while (i + 1 < text.size()) {
+		unsigned char c = text[i];
+		size_t count = 0;
+		for (i += 2; i < text.size() && text[i] != ','; i++) {
+			count = count * 10 + (text[i] - '0');
+		}
+		counts[c] = count;
+		i++; // the comma
+	}
 }
 
-std::string serializeChunk(const fm_chunk &chunk) {
-	Compressor compressor(CompressionAlgorithm::ZSTD);
-	std::string serialized_map = serializeMap(std::get<0>(chunk));
-	// compress it
-	std::string compressed_map =
-		compressor.compress(serialized_map.c_str(), serialized_map.size());
-	size_t compressed_map_size = compressed_map.size();
-	// we are going to write out this chunk as length of compressed map,
-	// compressed map, compressed string
+std::string serializeChunk(const fm_chunk &chunk, Codec codec) {
+	Compressor compressor(codec);
+	std::string table = serializeCounts(std::get<0>(chunk));
+	// we are going to write out this chunk as the flagged length of the
+	// count table, the table, the length of the compressed checkpoints,
+	// those, and the compressed string
+	size_t flagged_table_size =
+		table.size() | FM_BINARY_COUNTS | FM_STORED_CHECKPOINTS;
+	std::vector<uint32_t> checkpoints =
+		RankedChunk::checkpoints(std::get<1>(chunk));
+	std::string compressed_checkpoints =
+		compressor.compress(reinterpret_cast<const char *>(checkpoints.data()),
+							checkpoints.size() * sizeof(uint32_t));
+	size_t checkpoints_size = compressed_checkpoints.size();
 	std::string compressed_chunk = compressor.compress(
 		std::get<1>(chunk).c_str(), std::get<1>(chunk).size());
 
 	std::string serialized_chunk;
-	serialized_chunk.resize(sizeof(size_t) + compressed_map_size +
-							compressed_chunk.size());
-	memcpy((void *)serialized_chunk.data(), &compressed_map_size,
-		   sizeof(size_t));
-	memcpy((void *)(serialized_chunk.data() + sizeof(size_t)),
-		   compressed_map.data(), compressed_map_size);
-	memcpy((void *)(serialized_chunk.data() + sizeof(size_t) +
-					compressed_map_size),
-		   compressed_chunk.data(), compressed_chunk.size());
+	serialized_chunk.reserve(2 * sizeof(size_t) + table.size() +
+							 checkpoints_size + compressed_chunk.size());
+	serialized_chunk.append(reinterpret_cast<const char *>(&flagged_table_size),
+							sizeof(size_t));
+	serialized_chunk += table;
+	serialized_chunk.append(reinterpret_cast<const char *>(&checkpoints_size),
+							sizeof(size_t));
+	serialized_chunk += compressed_checkpoints;
+	serialized_chunk += compressed_chunk;
 	return serialized_chunk;
 }
 
-fm_chunk deserializeChunk(const std::string &serializedChunk) {
-	Compressor compressor(CompressionAlgorithm::ZSTD);
-	size_t compressed_map_size;
-	memcpy(&compressed_map_size, serializedChunk.data(), sizeof(size_t));
-	std::string compressed_map(serializedChunk.data() + sizeof(size_t),
-							   compressed_map_size);
-	std::string decompressed_map = compressor.decompress(compressed_map);
-	std::map<char, size_t> map = deserializeMap(decompressed_map);
-	std::string compressed_chunk(
-		serializedChunk.data() + sizeof(size_t) + compressed_map_size,
-		serializedChunk.size() - sizeof(size_t) - compressed_map_size);
-	std::string decompressed_chunk = compressor.decompress(compressed_chunk);
-	return std::make_tuple(map, decompressed_chunk);
+std::vector<size_t> decompress_size_t_array(const char *data, size_t size,
+											CompressionAlgorithm codec) {
+	Compressor compressor(codec);
+	std::vector<size_t> array(compressor.decompressed_size(data, size) /
+							  sizeof(size_t));
+	compressor.decompress_into(data, size, reinterpret_cast<char *>(array.data()),
+							   array.size() * sizeof(size_t));
+	return array;
 }
 
-size_t searchChunk(const fm_chunk &chunk, char c, size_t pos) {
+fm_chunk deserializeChunk(const std::string &serializedChunk) {
+	return deserializeChunk(serializedChunk.data(), serializedChunk.size());
+}
 
-	size_t starting_offset;
-	if (std::get<0>(chunk).find(c) != std::get<0>(chunk).end()) {
-		starting_offset = std::get<0>(chunk).at(c);
+// the counts and characters of a serialized chunk, and its checkpoints if
+// it stored them
+static fm_chunk read_chunk(const char *data, size_t size,
+						   CompressionAlgorithm codec,
+						   std::vector<uint32_t> *checkpoints) {
+	Compressor compressor(codec);
+	size_t table_size;
+	if (size < sizeof(size_t)) {
+		throw ReadError("truncated FM chunk");
+	}
+	memcpy(&table_size, data, sizeof(size_t));
+	bool stored = table_size & FM_STORED_CHECKPOINTS;
+	table_size &= ~FM_STORED_CHECKPOINTS;
+	fm_chunk chunk;
+	if (table_size & FM_BINARY_COUNTS) {
+		table_size &= ~FM_BINARY_COUNTS;
+		if (table_size > size - sizeof(size_t)) {
+			throw ReadError("truncated FM chunk");
+		}
+		deserializeCounts(data + sizeof(size_t), table_size,
+						  std::get<0>(chunk));
 	} else {
-		starting_offset = 0;
+		// a compressed text map
+		parse_text_counts(
+			compressor.decompress(data + sizeof(size_t), table_size),
+			std::get<0>(chunk));
+	}
+	const char *cursor = data + sizeof(size_t) + table_size;
+	const char *end = data + size;
+	if (stored) {
+		size_t checkpoints_size;
+		if ((size_t)(end - cursor) < sizeof(size_t)) {
+			throw ReadError("truncated FM chunk");
+		}
+		memcpy(&checkpoints_size, cursor, sizeof(size_t));
+		cursor += sizeof(size_t);
+		if (checkpoints_size > (size_t)(end - cursor)) {
+			throw ReadError("truncated FM chunk");
+		}
+		// the checkpoints are at least their number of characters, so
+		// they never compress to nothing
+		if (checkpoints) {
+			size_t bytes = checkpoints_size > 0
+							   ? compressor.decompressed_size(cursor,
+															  checkpoints_size)
+							   : 0;
+			checkpoints->resize(bytes / sizeof(uint32_t));
+			if (bytes == 0 || bytes % sizeof(uint32_t) != 0 ||
+				compressor.decompress_into(
+					cursor, checkpoints_size,
+					reinterpret_cast<char *>(checkpoints->data()),
+					bytes) != bytes) {
+				throw ReadError("malformed FM chunk checkpoints");
+			}
+		}
+		cursor += checkpoints_size;
 	}
+	std::get<1>(chunk) = compressor.decompress(cursor, end - cursor);
+	return chunk;
+}
+
+fm_chunk deserializeChunk(const char *data, size_t size,
+						  CompressionAlgorithm codec) {
+	return read_chunk(data, size, codec, nullptr);
+}
+
+size_t searchChunk(const fm_chunk &chunk, char c, size_t pos) {
+
+	size_t starting_offset = std::get<0>(chunk)[(unsigned char)c];
 	for (size_t i = 0; i < pos; i++) {
 		if (std::get<1>(chunk)[i] == c) {
 			starting_offset++;
@@ -87,62 +193,230 @@ size_t searchChunk(const fm_chunk &chunk, char c, size_t pos) {
 	return starting_offset;
 }
 
-void write_fm_index_to_disk(const fm_index_t &tree,
-							const std::vector<size_t> &C, size_t n, FILE *fp) {
-
-	/*
-				   The layout of the file will be a list of compressed chunks of
-	   variable lengths. This will be followed by a metadata page The metadata
-	   page will contain the following information:
-				   - Chunk offsets: the byte offsets of each chunk
-				   - C vector: the C vector for the FM index
-				   - Last eight bytes of the file will be how long the metadata
-	   page is.
-	*/
-	size_t total_length = 0;
-	// iterate through the bitvectors
-	std::vector<size_t> offsets = {0};
-
-	Compressor compressor(CompressionAlgorithm::ZSTD);
-	size_t base_offset = ftell(fp);
+// occurrences of c in [begin, end), a plain loop that vectorizes
+static size_t count_char(const char *begin, const char *end, char c) {
+	size_t count = 0;
+	for (; begin < end; begin++) {
+		count += *begin == c;
+	}
+	return count;
+}
 
-	for (size_t i = 0; i < tree.size(); i++) {
-		std::string serialized_chunk = serializeChunk(tree[i]);
-		fwrite(serialized_chunk.data(), 1, serialized_chunk.size(), fp);
-		offsets.push_back(offsets.back() + serialized_chunk.size());
-		total_length += serialized_chunk.size();
-	}
-
-	LOG(INFO) << total_length << std::endl;
-	LOG(INFO) << "number of chunks" << offsets.size() << std::endl;
-	// compress the offsets too
-	std::string compressed_offsets = compressor.compress(
-		(char *)offsets.data(), offsets.size() * sizeof(size_t));
-	size_t compressed_offsets_byte_offset = ftell(fp) - base_offset;
-	fwrite(compressed_offsets.data(), 1, compressed_offsets.size(), fp);
-	LOG(INFO) << "compressed offsets size " << compressed_offsets.size()
-			  << std::endl;
+RankedChunk::RankedChunk(fm_chunk chunk)
+	: RankedChunk(std::move(chunk), {}) {}
+
+RankedChunk::RankedChunk(fm_chunk chunk, std::vector<uint32_t> checkpoints)
+	: chars_(std::move(std::get<1>(chunk))), counts_(std::get<0>(chunk)),
+	  rows_(chars_.size() / FM_CHECKPOINT_CHARS + 1),
+	  checkpoints_(std::move(checkpoints)) {
+	if (checkpoints_.empty()) {
+		// a column for every character, not knowing which are present, and
+		// a column of one that isn't is just zeros
+		for (size_t c = 0; c < ALPHABET; c++) {
+			slots_[c] = c;
+		}
+		checkpoints_.assign(ALPHABET * rows_, 0);
+		counted_ = std::make_unique<std::once_flag[]>(ALPHABET);
+		return;
+	}
+	std::fill(slots_, slots_ + ALPHABET, -1);
+	size_t num_slots = checkpoints_[0];
+	columns_ = 1 + num_slots;
+	if (num_slots > ALPHABET ||
+		checkpoints_.size() != columns_ + num_slots * rows_) {
+		throw ReadError("malformed FM chunk checkpoints");
+	}
+	for (size_t slot = 0; slot < num_slots; slot++) {
+		if (checkpoints_[1 + slot] >= ALPHABET) {
+			throw ReadError("malformed FM chunk checkpoints");
+		}
+		slots_[checkpoints_[1 + slot]] = slot;
+	}
+}
+
+RankedChunk RankedChunk::deserialize(const char *data, size_t size,
+									 CompressionAlgorithm codec) {
+	std::vector<uint32_t> checkpoints;
+	fm_chunk chunk = read_chunk(data, size, codec, &checkpoints);
+	return RankedChunk(std::move(chunk), std::move(checkpoints));
+}
 
-	// now write out the C vector
-	std::string compressed_C =
-		compressor.compress((char *)C.data(), C.size() * sizeof(size_t));
-	size_t compressed_C_byte_offset = ftell(fp) - base_offset;
-	fwrite(compressed_C.data(), 1, compressed_C.size(), fp);
+std::vector<uint32_t> RankedChunk::checkpoints(const std::string &chars) {
+	bool present[ALPHABET] = {};
+	for (unsigned char c : chars) {
+		present[c] = true;
+	}
+	std::vector<uint32_t> words = {0};
+	for (size_t c = 0; c < ALPHABET; c++) {
+		if (present[c]) {
+			words.push_back(c);
+		}
+	}
+	size_t num_slots = words.size() - 1;
+	words[0] = num_slots;
+	size_t columns = words.size();
+	size_t rows = chars.size() / FM_CHECKPOINT_CHARS + 1;
+	words.resize(columns + num_slots * rows);
+
+	uint32_t running[ALPHABET] = {};
+	for (size_t row = 0; row < rows; row++) {
+		for (size_t slot = 0; slot < num_slots; slot++) {
+			words[columns + slot * rows + row] = running[words[1 + slot]];
+		}
+		size_t start = row * FM_CHECKPOINT_CHARS;
+		size_t end = std::min(start + FM_CHECKPOINT_CHARS, chars.size());
+		for (size_t i = start; i < end; i++) {
+			running[(unsigned char)chars[i]]++;
+		}
+	}
+	return words;
+}
+
+const uint32_t *RankedChunk::column(size_t slot) const {
+	uint32_t *column = checkpoints_.data() + columns_ + slot * rows_;
+	if (counted_) {
+		// lookups of a chunk in the cache come from several threads
+		std::call_once(counted_[slot], [&] {
+			const char *chars = chars_.data();
+			uint32_t running = 0;
+			for (size_t row = 0; row < rows_; row++) {
+				column[row] = running;
+				size_t start = row * FM_CHECKPOINT_CHARS;
+				size_t end =
+					std::min(start + FM_CHECKPOINT_CHARS, chars_.size());
+				running += count_char(chars + start, chars + end, (char)slot);
+			}
+		});
+	}
+	return column;
+}
+
+size_t RankedChunk::rank(char c, size_t pos) const {
+	int16_t slot = slots_[(unsigned char)c];
+	if (slot < 0) {
+		return counts_[(unsigned char)c];
+	}
+	pos = std::min(pos, chars_.size());
+	const uint32_t *checkpoints = column(slot);
+	const char *chars = chars_.data();
+	size_t row = pos / FM_CHECKPOINT_CHARS;
+	size_t before = row * FM_CHECKPOINT_CHARS;
+	size_t after = before + FM_CHECKPOINT_CHARS;
+	// the next checkpoint is there unless pos is in the last, partial row
+	if (row + 1 < rows_ && after - pos < pos - before) {
+		return counts_[(unsigned char)c] + checkpoints[row + 1] -
+			   count_char(chars + pos, chars + after, c);
+	}
+	return counts_[(unsigned char)c] + checkpoints[row] +
+		   count_char(chars + before, chars + pos, c);
+}
 
-	// now write out the byte_offsets as three 8-byte numbers
-	fwrite(&compressed_offsets_byte_offset, 1, sizeof(size_t), fp);
-	fwrite(&compressed_C_byte_offset, 1, sizeof(size_t), fp);
-	fwrite(&n, 1, sizeof(size_t), fp);
+size_t RankedChunk::byte_size() const {
+	return sizeof(RankedChunk) + chars_.size() +
+		   checkpoints_.size() * sizeof(uint32_t) +
+		   (counted_ ? ALPHABET * sizeof(std::once_flag) : 0);
+}
+
+/*
+			   The layout of the file will be a list of compressed chunks of
+   variable lengths. This will be followed by a metadata page The metadata
+   page will contain the following information:
+			   - Chunk offsets: the byte offsets of each chunk
+			   - C vector: the C vector for the FM index
+			   - Last eight bytes of the file will be how long the metadata
+   page is.
+
+FMIndexWriter writes the chunks as they come, either whole or one BWT
+character at a time, so only the chunk being filled and the ones being
+compressed by the BlockWriter are held in memory.
+*/
+class FMIndexWriter {
+  public:
+	FMIndexWriter(FILE *fp, Codec chunk_codec)
+		: fp_(fp), chunk_codec_(chunk_codec), base_offset_(ftell(fp)),
+		  blocks_(fp) {}
+
+	void push_chunk(fm_chunk chunk) {
+		blocks_.write(
+			[chunk = std::move(chunk), codec = chunk_codec_] {
+				return serializeChunk(chunk, codec);
+			},
+			[this](size_t size) { offsets_.push_back(offsets_.back() + size); });
+	}
+
+	// the next character of the BWT, chunks carry the counts before them
+	void push(char c) {
+		streaming_ = true;
+		chunk_ += c;
+		counts_[(unsigned char)c]++;
+		if (chunk_.size() == FM_IDX_CHUNK_CHARS) {
+			push_chunk(std::make_tuple(chunk_counts_, chunk_));
+			chunk_.clear();
+			chunk_counts_ = counts_;
+		}
+	}
+
+	// the last chunk of pushed characters goes out even if it is empty, as
+	// construct_fm_index does
+	void finish(const std::vector<size_t> &C, size_t n) {
+		if (streaming_) {
+			push_chunk(std::make_tuple(chunk_counts_, chunk_));
+		}
+		blocks_.finish();
+		Compressor compressor(CompressionAlgorithm::ZSTD);
+
+		LOG(INFO) << offsets_.back() << std::endl;
+		LOG(INFO) << "number of chunks" << offsets_.size() << std::endl;
+		// compress the offsets too
+		std::string compressed_offsets = compressor.compress(
+			(char *)offsets_.data(), offsets_.size() * sizeof(size_t));
+		size_t compressed_offsets_byte_offset = ftell(fp_) - base_offset_;
+		fwrite(compressed_offsets.data(), 1, compressed_offsets.size(), fp_);
+		LOG(INFO) << "compressed offsets size " << compressed_offsets.size()
+				  << std::endl;
+
+		// now write out the C vector
+		std::string compressed_C =
+			compressor.compress((char *)C.data(), C.size() * sizeof(size_t));
+		size_t compressed_C_byte_offset = ftell(fp_) - base_offset_;
+		fwrite(compressed_C.data(), 1, compressed_C.size(), fp_);
+
+		// now write out the byte_offsets as three 8-byte numbers
+		fwrite(&compressed_offsets_byte_offset, 1, sizeof(size_t), fp_);
+		fwrite(&compressed_C_byte_offset, 1, sizeof(size_t), fp_);
+		fwrite(&n, 1, sizeof(size_t), fp_);
+	}
+
+  private:
+	FILE *fp_;
+	Codec chunk_codec_;
+	size_t base_offset_;
+	std::vector<size_t> offsets_ = {0};
+	BlockWriter blocks_;
+
+	bool streaming_ = false;
+	std::string chunk_ = "";
+	fm_counts counts_ = {};
+	fm_counts chunk_counts_ = {};
+};
+
+void write_fm_index_to_disk(const fm_index_t &tree,
+							const std::vector<size_t> &C, size_t n, FILE *fp,
+							Codec chunk_codec) {
+	FMIndexWriter writer(fp, chunk_codec);
+	for (size_t i = 0; i < tree.size(); i++) {
+		writer.push_chunk(tree[i]);
+	}
+	writer.finish(C, n);
 }
 
 std::tuple<size_t, std::vector<size_t>, std::vector<size_t>>
 read_metadata_from_file(VirtualFileRegion *vfr) {
 
 	size_t file_size = vfr->size();
-	vfr->vfseek(file_size - 24, SEEK_SET);
 
 	std::vector<char> buffer(24);
-	vfr->vfread(buffer.data(), 24);
+	read_trailer(vfr, file_size - 24, buffer.data(), 24);
 	const size_t *data = reinterpret_cast<const size_t *>(buffer.data());
 	size_t compressed_offsets_byte_offset = data[0];
 	size_t compressed_C_byte_offset = data[1];
@@ -154,34 +428,51 @@ read_metadata_from_file(VirtualFileRegion *vfr) {
 			  << std::endl;
 	LOG(INFO) << "file size: " << file_size << std::endl;
 
-	vfr->vfseek(compressed_offsets_byte_offset, SEEK_SET);
-	buffer.clear();
-	buffer.resize(file_size - 24 - compressed_offsets_byte_offset);
-	vfr->vfread(buffer.data(), buffer.size());
-
-	Compressor compressor(CompressionAlgorithm::ZSTD);
-	std::string compressed_offsets(buffer.begin(),
-								   buffer.begin() + compressed_C_byte_offset -
-									   compressed_offsets_byte_offset);
-	std::string decompressed_offsets =
-		compressor.decompress(compressed_offsets);
-	std::vector<size_t> offsets(decompressed_offsets.size() / sizeof(size_t));
-	memcpy(offsets.data(), decompressed_offsets.data(),
-		   decompressed_offsets.size());
-
-	std::string compressed_C(buffer.begin() + compressed_C_byte_offset -
-								 compressed_offsets_byte_offset,
-							 buffer.end());
-	std::string decompressed_C = compressor.decompress(compressed_C);
-	std::vector<size_t> C(decompressed_C.size() / sizeof(size_t));
-	memcpy(C.data(), decompressed_C.data(), decompressed_C.size());
-
-	vfr->reset();
-	return std::make_tuple(n, C, offsets);
+	// offsets and C only depend on the file, keep them decoded in the cache
+	auto offsets_and_C =
+		read_decoded<std::pair<std::vector<size_t>, std::vector<size_t>>>(
+			vfr, compressed_offsets_byte_offset,
+			file_size - 24 - compressed_offsets_byte_offset, "fm_metadata",
+			[&](const char *buffer, size_t size) {
+				size_t compressed_offsets_size =
+					compressed_C_byte_offset - compressed_offsets_byte_offset;
+				std::vector<size_t> offsets =
+					decompress_size_t_array(buffer, compressed_offsets_size);
+				std::vector<size_t> C =
+					decompress_size_t_array(buffer + compressed_offsets_size,
+											size - compressed_offsets_size);
+				return std::make_pair(std::move(offsets), std::move(C));
+			},
+			[](const std::pair<std::vector<size_t>, std::vector<size_t>> &p) {
+				return (p.first.size() + p.second.size()) * sizeof(size_t);
+			});
+
+	return std::make_tuple(n, offsets_and_C->second, offsets_and_C->first);
+}
+
+// decoded FM chunks go through the region's block cache, the backward search
+// keeps coming back to the same handful of chunks. Every chunk requested is
+// fetched in one batch.
+static std::vector<std::shared_ptr<const RankedChunk>>
+read_fm_chunks(VirtualFileRegion *vfr, const std::vector<size_t> &offsets,
+			   const std::vector<size_t> &chunk_ids,
+			   CompressionAlgorithm codec) {
+	std::vector<ReadRange> ranges;
+	for (size_t chunk_id : chunk_ids) {
+		ranges.push_back({(long)offsets[chunk_id],
+						  (long)(offsets[chunk_id + 1] - offsets[chunk_id])});
+	}
+	return read_decoded_batch<RankedChunk>(
+		vfr, ranges, "fm_chunk",
+		[codec](const char *data, size_t size) {
+			return RankedChunk::deserialize(data, size, codec);
+		},
+		[](const RankedChunk &chunk) { return chunk.byte_size(); });
 }
 
 std::tuple<size_t, size_t>
-search_fm_index(VirtualFileRegion *vfr, const char *P, size_t Psize, bool early_exit) {
+search_fm_index(VirtualFileRegion *vfr, const char *P, size_t Psize, bool early_exit,
+				CompressionAlgorithm chunk_codec) {
 
 	auto [n, C, offsets] = read_metadata_from_file(vfr);
 	size_t start = 0;
@@ -193,25 +484,20 @@ search_fm_index(VirtualFileRegion *vfr, const char *P, size_t Psize, bool early_
 		char c = P[i];
 		LOG(INFO) << "c: " << c << std::endl;
 
-		size_t start_byte = offsets[start / FM_IDX_CHUNK_CHARS];
-		size_t end_byte = offsets[start / FM_IDX_CHUNK_CHARS + 1];
-		vfr->vfseek(start_byte, SEEK_SET);
-		std::string serialized_chunk;
-		serialized_chunk.resize(end_byte - start_byte);
-		vfr->vfread((void *)serialized_chunk.data(), serialized_chunk.size());
-		auto chunk = deserializeChunk(serialized_chunk);
-
-		start = C[c] + searchChunk(chunk, c, start % FM_IDX_CHUNK_CHARS);
-
-		start_byte = offsets[end / FM_IDX_CHUNK_CHARS];
-		end_byte = offsets[end / FM_IDX_CHUNK_CHARS + 1];
-		vfr->vfseek(start_byte, SEEK_SET);
-		serialized_chunk.clear();
-		serialized_chunk.resize(end_byte - start_byte);
-		vfr->vfread((void *)serialized_chunk.data(), serialized_chunk.size());
-		chunk = deserializeChunk(serialized_chunk);
+		size_t start_chunk_id = start / FM_IDX_CHUNK_CHARS;
+		size_t end_chunk_id = end / FM_IDX_CHUNK_CHARS;
+		// start and end usually land in the same chunk, otherwise fetch
+		// both with one request
+		std::vector<size_t> chunk_ids = {start_chunk_id};
+		if (end_chunk_id != start_chunk_id) {
+			chunk_ids.push_back(end_chunk_id);
+		}
+		auto chunks = read_fm_chunks(vfr, offsets, chunk_ids, chunk_codec);
 
-		end = C[c] + searchChunk(chunk, c, end % FM_IDX_CHUNK_CHARS);
+		start = C[(unsigned char)c] +
+				chunks.front()->rank(c, start % FM_IDX_CHUNK_CHARS);
+		end = C[(unsigned char)c] +
+			  chunks.back()->rank(c, end % FM_IDX_CHUNK_CHARS);
 
 		LOG(INFO) << "start: " << start << std::endl;
 		LOG(INFO) << "end: " << end << std::endl;
@@ -233,15 +519,15 @@ search_fm_index(VirtualFileRegion *vfr, const char *P, size_t Psize, bool early_
 fm_index_t construct_fm_index(const char *P, size_t Psize) {
 
 	fm_index_t to_hit = {};
-	std::map<char, size_t> current_chunk_char_counts = {};
-	std::map<char, size_t> next_chunk_char_counts = {};
+	fm_counts current_chunk_char_counts = {};
+	fm_counts next_chunk_char_counts = {};
 	std::string curr_chunk = "";
 	for (int idx = 0; idx < Psize; idx++) {
 		char c = P[idx];
-		next_chunk_char_counts[c]++;
+		next_chunk_char_counts[(unsigned char)c]++;
 		curr_chunk += c;
 		if (curr_chunk.size() == FM_IDX_CHUNK_CHARS) {
-			std::tuple<std::map<char, size_t>, std::string> fm_chunk =
+			fm_chunk fm_chunk =
 				std::make_tuple(current_chunk_char_counts, curr_chunk);
 			to_hit.push_back(fm_chunk);
 			curr_chunk = "";
@@ -249,7 +535,7 @@ fm_index_t construct_fm_index(const char *P, size_t Psize) {
 			current_chunk_char_counts = next_chunk_char_counts;
 		}
 	}
-	std::tuple<std::map<char, size_t>, std::string> fm_chunk =
+	fm_chunk fm_chunk =
 		std::make_tuple(current_chunk_char_counts, curr_chunk);
 	to_hit.push_back(fm_chunk);
 	return to_hit;
@@ -258,60 +544,54 @@ fm_index_t construct_fm_index(const char *P, size_t Psize) {
 std::vector<size_t> search_vfr(VirtualFileRegion *wavelet_vfr,
 							   VirtualFileRegion *log_idx_vfr,
 							   std::string query,
-                               bool early_exit) {
+                               bool early_exit,
+							   CompressionAlgorithm fm_codec,
+							   CompressionAlgorithm log_idx_codec,
+							   FMBackend fm_backend) {
 	size_t log_idx_size = log_idx_vfr->size();
 	size_t compressed_offsets_byte_offset;
 
-	log_idx_vfr->vfseek(-sizeof(size_t), SEEK_END);
-	auto start_time = std::chrono::high_resolution_clock::now();
-	log_idx_vfr->vfread(&compressed_offsets_byte_offset, sizeof(size_t));
-	auto stop = std::chrono::high_resolution_clock::now();
-	auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(
-		stop - start_time);
+	read_trailer(log_idx_vfr, log_idx_size - sizeof(size_t),
+				 &compressed_offsets_byte_offset, sizeof(size_t));
+
+	// both the chunk offsets and the chunks themselves are plain size_t
+	// arrays once decompressed, only the chunks use log_idx_codec
+	auto decode_size_t_array = [](const char *data, size_t size) {
+		return decompress_size_t_array(data, size);
+	};
+	auto decode_log_idx_chunk = [log_idx_codec](const char *data,
+												size_t size) {
+		return decompress_size_t_array(data, size, log_idx_codec);
+	};
+	auto size_t_array_charge = [](const std::vector<size_t> &array) {
+		return array.size() * sizeof(size_t);
+	};
 
-	log_idx_vfr->vfseek(compressed_offsets_byte_offset, SEEK_SET);
-	Compressor compressor(CompressionAlgorithm::ZSTD);
-	std::string compressed_offsets;
-	compressed_offsets.resize(log_idx_size - compressed_offsets_byte_offset -
-							  8);
-	log_idx_vfr->vfread((void *)compressed_offsets.data(),
-						compressed_offsets.size());
-	std::string decompressed_offsets =
-		compressor.decompress(compressed_offsets);
-	std::vector<size_t> chunk_offsets(decompressed_offsets.size() /
-									  sizeof(size_t));
-	memcpy(chunk_offsets.data(), decompressed_offsets.data(),
-		   decompressed_offsets.size());
-
-	auto batch_log_idx_lookup = [&chunk_offsets, log_idx_vfr](size_t start_idx,
-															  size_t end_idx) {
-		size_t start_chunk_offset = chunk_offsets[start_idx / LOG_IDX_CHUNK_BYTES];
-		size_t end_chunk_offset = chunk_offsets[end_idx / LOG_IDX_CHUNK_BYTES + 1];
+	auto chunk_offsets_page = read_decoded<std::vector<size_t>>(
+		log_idx_vfr, compressed_offsets_byte_offset,
+		log_idx_size - compressed_offsets_byte_offset - 8, "log_idx_offsets",
+		decode_size_t_array, size_t_array_charge);
+	const std::vector<size_t> &chunk_offsets = *chunk_offsets_page;
+
+	auto batch_log_idx_lookup = [&](size_t start_idx, size_t end_idx) {
 		size_t total_chunks = end_idx / LOG_IDX_CHUNK_BYTES - start_idx / LOG_IDX_CHUNK_BYTES + 1;
 
-		log_idx_vfr->vfseek(start_chunk_offset, SEEK_SET);
-		std::string compressed_chunks;
-		compressed_chunks.resize(end_chunk_offset - start_chunk_offset);
-		log_idx_vfr->vfread((void *)compressed_chunks.data(),
-							compressed_chunks.size());
+		// this spans possibly multiple chunks! We need to decode them
+		// separately, but they are contiguous so fetch them in one go
+		std::vector<ReadRange> ranges;
+		for (int i = 0; i < total_chunks; i++) {
+			size_t chunk_offset = chunk_offsets[start_idx / LOG_IDX_CHUNK_BYTES + i];
+			size_t chunk_size =
+				chunk_offsets[start_idx / LOG_IDX_CHUNK_BYTES + i + 1] - chunk_offset;
+			ranges.push_back({(long)chunk_offset, (long)chunk_size});
+		}
+		auto log_idx_pages = read_decoded_batch<std::vector<size_t>>(
+			log_idx_vfr, ranges, "log_idx", decode_log_idx_chunk,
+			size_t_array_charge);
 
-		// this contains possibly multiple chunks! We need to decode them
-		// separately
 		std::vector<size_t> results = {};
 		for (int i = 0; i < total_chunks; i++) {
-			size_t chunk_offset = chunk_offsets[start_idx / LOG_IDX_CHUNK_BYTES + i];
-			std::string compressed_chunk = compressed_chunks.substr(
-				chunk_offset - start_chunk_offset,
-				chunk_offsets[start_idx / LOG_IDX_CHUNK_BYTES + i + 1] - chunk_offset);
-			compressed_chunk.resize(chunk_offsets[start_idx / LOG_IDX_CHUNK_BYTES + i + 1] -
-									chunk_offset);
-			Compressor compressor(CompressionAlgorithm::ZSTD);
-			std::string decompressed_chunk =
-				compressor.decompress(compressed_chunk);
-			std::vector<size_t> log_idx(decompressed_chunk.size() /
-										sizeof(size_t));
-			memcpy(log_idx.data(), decompressed_chunk.data(),
-				   decompressed_chunk.size());
+			const std::vector<size_t> &log_idx = *log_idx_pages[i];
 			// if this is the first chunk, skip to start_idx, if last chunk,
 			// stop and end_idx, otherwise add the entire chunk to the results
 			if (i == 0) {
@@ -335,14 +615,22 @@ std::vector<size_t> search_vfr(VirtualFileRegion *wavelet_vfr,
 		return results;
 	};
 
-	LOG(INFO) << "num reads: " << wavelet_vfr->num_reads << std::endl;
-	LOG(INFO) << "num bytes read: " << wavelet_vfr->num_bytes_read << std::endl;
-
 	auto [start, end] =
-		search_fm_index(wavelet_vfr, query.c_str(), query.size(), early_exit);
-
-	LOG(INFO) << "num reads: " << wavelet_vfr->num_reads << std::endl;
-	LOG(INFO) << "num bytes read: " << wavelet_vfr->num_bytes_read << std::endl;
+		fm_backend == FMBackend::WAVELET
+			? search_wavelet_tree(wavelet_vfr, query.c_str(), query.size(),
+								  early_exit, fm_codec)
+			: search_fm_index(wavelet_vfr, query.c_str(), query.size(),
+							  early_exit, fm_codec);
+
+	if (IOStats *stats = wavelet_vfr->stats()) {
+		IOStats::Counter fm_chunks =
+			stats->reads(IOStats::file_of(wavelet_vfr->object_id()),
+						 fm_backend == FMBackend::WAVELET ? "wavelet_chunk"
+														  : "fm_chunk");
+		LOG(INFO) << "fm chunk reads: " << fm_chunks.count
+				  << " bytes: " << fm_chunks.bytes
+				  << " cache hits: " << fm_chunks.cache_hits << std::endl;
+	}
 
 	std::vector<size_t> matched_pos = {};
 
@@ -358,12 +646,13 @@ std::vector<size_t> search_vfr(VirtualFileRegion *wavelet_vfr,
 		std::vector<size_t> pos = batch_log_idx_lookup(start, end);
 		matched_pos.insert(matched_pos.end(), pos.begin(), pos.end());
 
-		// doesn't actually matter which vfr since these are static variables
-		LOG(INFO) << "num reads: " << log_idx_vfr->num_reads << std::endl;
-		LOG(INFO) << "num bytes read: " << log_idx_vfr->num_bytes_read
-				  << std::endl;
-		wavelet_vfr->reset();
-		log_idx_vfr->reset();
+		if (IOStats *stats = log_idx_vfr->stats()) {
+			IOStats::Counter log_idx =
+				stats->reads(IOStats::file_of(log_idx_vfr->object_id()), "log_idx");
+			LOG(INFO) << "log_idx reads: " << log_idx.count
+					  << " bytes: " << log_idx.bytes
+					  << " cache hits: " << log_idx.cache_hits << std::endl;
+		}
 	}
 
 	// print out start, end and matched_pos
@@ -419,7 +708,7 @@ bwt_and_build_fm_index(char *Text, size_t block_lines) {
 
 	// the suffix array does not output the last character as the first
 	// character so add it here FM_index[Text[n - 1]].push_back(0);
-	total_chars[Text[n - 1]]++;
+	total_chars[(unsigned char)Text[n - 1]]++;
 
 	// get the second to last element of newlines, since the last element is
 	// always the length of the file assuming file ends with "\n"
@@ -430,9 +719,11 @@ bwt_and_build_fm_index(char *Text, size_t block_lines) {
 	start_time = std::chrono::high_resolution_clock::now();
 	for (int i = 0; i < n; ++i) {
 		// printf("%c\n", Text[SA[i] - 1]);
-		last_chars.push_back(Text[SA[i] - 1]);
-		char c = Text[SA[i] - 1];
-		total_chars[c]++;
+		// nothing precedes the whole text, it sorts first like the empty
+		// suffix would
+		char c = SA[i] > 0 ? Text[SA[i] - 1] : '\0';
+		last_chars.push_back(c);
+		total_chars[(unsigned char)c]++;
 
 		auto it = std::lower_bound(newlines.begin(), newlines.end(), SA[i]);
 		log_idx[i + 1] = it - newlines.begin();
@@ -454,32 +745,190 @@ bwt_and_build_fm_index(char *Text, size_t block_lines) {
 	return std::make_tuple(fm_index, log_idx, C);
 }
 
-void write_log_idx_to_disk(std::vector<size_t> log_idx, FILE *log_idx_fp) {
-	std::vector<size_t> chunk_offsets = {0};
-	// iterate over chunks of log_idx_fp with size LOG_IDX_CHUNK_BYTES, compress each of them, and
-	// record the offsets
-	Compressor compressor(CompressionAlgorithm::ZSTD);
-
-	size_t base_offset = ftell(log_idx_fp);
-
-	for (int i = 0; i < log_idx.size(); i += LOG_IDX_CHUNK_BYTES) {
-		std::vector<size_t> chunk(log_idx.begin() + i,
-								  log_idx.begin() +
-									  std::min(i + LOG_IDX_CHUNK_BYTES, int(log_idx.size())));
-		std::string compressed_chunk = compressor.compress(
-			(char *)chunk.data(), chunk.size() * sizeof(size_t), 5);
-		fwrite(compressed_chunk.data(), 1, compressed_chunk.size(), log_idx_fp);
-		chunk_offsets.push_back(chunk_offsets.back() + compressed_chunk.size());
-	}
-	// now write the compressed_offsets
-	size_t compressed_offsets_byte_offset = ftell(log_idx_fp) - base_offset;
-	LOG(INFO) << "log_idx compressed array size: "
-			  << compressed_offsets_byte_offset << std::endl;
-	std::string compressed_offsets = compressor.compress(
-		(char *)chunk_offsets.data(), chunk_offsets.size() * sizeof(size_t));
-	fwrite(compressed_offsets.data(), 1, compressed_offsets.size(), log_idx_fp);
-	LOG(INFO) << "log_idx compressed_offsets size: "
-			  << compressed_offsets.size() << std::endl;
-	// now write 8 bytes, the byte offset
-	fwrite(&compressed_offsets_byte_offset, 1, sizeof(size_t), log_idx_fp);
+// log_idx chunks of LOG_IDX_CHUNK_BYTES entries, compressed and written as
+// soon as they fill up, then the compressed chunk offsets and 8 bytes for
+// where those start
+class LogIdxWriter {
+  public:
+	LogIdxWriter(FILE *fp, Codec codec)
+		: fp_(fp), chunk_compressor_(codec), base_offset_(ftell(fp)),
+		  blocks_(fp) {
+		chunk_.reserve(LOG_IDX_CHUNK_BYTES);
+	}
+
+	void push(size_t idx) {
+		chunk_.push_back(idx);
+		if (chunk_.size() == LOG_IDX_CHUNK_BYTES) {
+			flush();
+		}
+	}
+
+	void finish() {
+		if (!chunk_.empty()) {
+			flush();
+		}
+		blocks_.finish();
+		// now write the compressed_offsets
+		size_t compressed_offsets_byte_offset = ftell(fp_) - base_offset_;
+		LOG(INFO) << "log_idx compressed array size: "
+				  << compressed_offsets_byte_offset << std::endl;
+		std::string compressed_offsets =
+			Compressor(CompressionAlgorithm::ZSTD)
+				.compress((char *)chunk_offsets_.data(),
+						  chunk_offsets_.size() * sizeof(size_t));
+		fwrite(compressed_offsets.data(), 1, compressed_offsets.size(), fp_);
+		LOG(INFO) << "log_idx compressed_offsets size: "
+				  << compressed_offsets.size() << std::endl;
+		// now write 8 bytes, the byte offset
+		fwrite(&compressed_offsets_byte_offset, 1, sizeof(size_t), fp_);
+	}
+
+  private:
+	FILE *fp_;
+	Compressor chunk_compressor_;
+	size_t base_offset_;
+	std::vector<size_t> chunk_offsets_ = {0};
+	std::vector<size_t> chunk_ = {};
+	BlockWriter blocks_;
+
+	void flush() {
+		blocks_.write(
+			[chunk = std::move(chunk_), compressor = chunk_compressor_] {
+				return compressor.compress((char *)chunk.data(),
+										   chunk.size() * sizeof(size_t));
+			},
+			[this](size_t size) {
+				chunk_offsets_.push_back(chunk_offsets_.back() + size);
+			});
+		chunk_ = {};
+		chunk_.reserve(LOG_IDX_CHUNK_BYTES);
+	}
+};
+
+void write_log_idx_to_disk(std::vector<size_t> log_idx, FILE *log_idx_fp,
+						   Codec codec) {
+	LogIdxWriter writer(log_idx_fp, codec);
+	for (size_t idx : log_idx) {
+		writer.push(idx);
+	}
+	writer.finish();
+}
+
+// the newlines that end every block_lines-th line, log_idx maps a suffix to
+// the block it starts in by binary search over these
+static std::vector<size_t> block_ends(const char *Text, size_t n,
+									  size_t block_lines) {
+	std::vector<size_t> newlines = {};
+	size_t counter = 0;
+	for (size_t i = 0; i < n; i++) {
+		if (Text[i] == '\n') {
+			counter += 1;
+			if (counter % block_lines == 0) {
+				newlines.push_back(i);
+				counter = 0;
+			}
+		}
+	}
+	LOG(INFO) << "detected " << newlines.size() << " logs " << std::endl;
+	assert(newlines.size() >= 2);
+	return newlines;
+}
+
+size_t fm_build_bytes(size_t n, size_t block_lines, FMBackend fm_backend) {
+	// a BlockWriter has up to twice its workers' blocks out, each of which
+	// is there twice while it is compressed
+	size_t in_flight = 2 * std::max(omp_get_max_threads(), 1);
+	size_t text = n * (1 + sizeof(int)) +
+				  (n / std::max<size_t>(block_lines, 1) + 1) * sizeof(size_t);
+	size_t fm_writer;
+	if (fm_backend == FMBackend::WAVELET) {
+		// every node fills a chunk of its own
+		size_t chunk = WAVELET_CHUNK_BITS / 8;
+		fm_writer = (WAVELET_NODES + 2 * in_flight) * chunk;
+	} else {
+		size_t chunk = FM_IDX_CHUNK_CHARS + sizeof(fm_counts);
+		fm_writer = (1 + 2 * in_flight) * chunk;
+	}
+	size_t log_idx_writer =
+		(1 + 2 * in_flight) * LOG_IDX_CHUNK_BYTES * sizeof(size_t);
+	// the log_idx is written once the BWT is done
+	return text + std::max(fm_writer, log_idx_writer);
+}
+
+size_t fm_default_build_bytes() {
+	return sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGESIZE) *
+		   FM_BUILD_MEMORY_FRACTION;
+}
+
+size_t bwt_and_write_fm_index(char *Text, size_t block_lines, FILE *fp,
+							  Codec fm_codec, Codec log_idx_codec,
+							  FMBackend fm_backend) {
+
+	size_t n = strlen(Text);
+	LOG(INFO) << "n:" << n << std::endl;
+	// divsufsort indexes with int
+	if (n >= (size_t)INT_MAX) {
+		throw std::length_error("FM index of " + std::to_string(n) +
+								" characters, divsufsort takes at most " +
+								std::to_string(INT_MAX - 1));
+	}
+	std::vector<int> SA(n);
+
+	auto start_time = std::chrono::high_resolution_clock::now();
+	divsufsort((unsigned char *)Text, SA.data(), n);
+	auto stop = std::chrono::high_resolution_clock::now();
+	LOG(INFO) << "divsufsort took "
+			  << std::chrono::duration_cast<std::chrono::milliseconds>(
+					 stop - start_time)
+					 .count()
+			  << " milliseconds" << std::endl;
+
+	assert(block_lines > 0);
+	std::vector<size_t> newlines = block_ends(Text, n, block_lines);
+
+	// the BWT is the last character, for the row of the empty suffix, then
+	// the character before every suffix in sorted order. The whole text has
+	// nothing before it, that sorts first like the empty suffix would.
+	auto bwt = [&](size_t row) -> char {
+		if (row == 0) {
+			return Text[n - 1];
+		}
+		return SA[row - 1] > 0 ? Text[SA[row - 1] - 1] : '\0';
+	};
+
+	// either writer takes the BWT one character at a time
+	auto write_bwt = [&](auto &fm_writer) {
+		std::vector<size_t> total_chars(ALPHABET, 0);
+		for (size_t row = 0; row <= n; ++row) {
+			char c = bwt(row);
+			total_chars[(unsigned char)c]++;
+			fm_writer.push(c);
+		}
+		std::vector<size_t> C(ALPHABET, 0);
+		for (int i = 1; i < ALPHABET; i++) {
+			C[i] = C[i - 1] + total_chars[i - 1];
+		}
+		fm_writer.finish(C, n);
+	};
+	if (fm_backend == FMBackend::WAVELET) {
+		WaveletTreeWriter fm_writer(fp, fm_codec);
+		write_bwt(fm_writer);
+	} else {
+		FMIndexWriter fm_writer(fp, fm_codec);
+		write_bwt(fm_writer);
+	}
+
+	size_t log_idx_offset = ftell(fp);
+	LogIdxWriter log_idx_writer(fp, log_idx_codec);
+	// get the second to last element of newlines, since the last element is
+	// always the length of the file assuming file ends with "\n"
+	log_idx_writer.push(newlines[newlines.size() - 2]);
+	for (size_t i = 0; i < n; ++i) {
+		auto it = std::lower_bound(newlines.begin(), newlines.end(),
+								   (size_t)SA[i]);
+		log_idx_writer.push(it - newlines.begin());
+	}
+	log_idx_writer.finish();
+
+	return log_idx_offset;
 }
@@ -1,19 +1,24 @@
 #pragma once
 
 #include <cassert>
+#include <climits>
 #include <iostream>
 #include <sstream>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <array>
 #include <tuple>
 #include <unordered_map>
 #include <vector>
 #include <map>
+#include <memory>
+#include <mutex>
 
 #include <divsufsort.h>
 #include "glog/logging.h"
 
+#include "block_writer.h"
 #include "compressor.h"
 #include "vfr.h"
 
@@ -21,34 +26,140 @@
 #define GIVEUP 100
 #define ALPHABET 256
 #define FM_IDX_CHUNK_CHARS 1000000 // fm index chunking granualarity, has nothing to do with chunking for hawaii
-typedef std::tuple<std::map<char, size_t>, std::string> fm_chunk;
+#define FM_CHECKPOINT_CHARS 4096 // characters between occurrence checkpoints
+#define FM_BUILD_MEMORY_FRACTION 0.75 // of physical memory, the default budget of building one FM index
+// flags the count table size of a chunk when the table is binary
+#define FM_BINARY_COUNTS (1ul << 63)
+// and when occurrence checkpoints follow the table
+#define FM_STORED_CHECKPOINTS (1ul << 62)
+// occurrences of every character, by unsigned char, before an FM chunk
+typedef std::array<size_t, ALPHABET> fm_counts;
+typedef std::tuple<fm_counts, std::string> fm_chunk;
 typedef std::vector<fm_chunk> fm_index_t;
 
-std::string serializeMap(const std::map<char, size_t> &map);
-std::map<char, size_t> deserializeMap(const std::string &serializedString);
+// how the BWT of a Hawaii type is stored: CHUNKED as FM chunks of
+// FM_IDX_CHUNK_CHARS characters with their counts, WAVELET as a wavelet tree
+// of rank9 bitvectors, see wavelet_tree.h. Both find the same matches.
+enum class FMBackend : uint8_t {
+	CHUNKED = 0,
+	WAVELET = 1,
+};
 
-std::string serializeChunk(const fm_chunk &chunk);
+// The count table of a chunk: the number of characters with a count, as a
+// byte where 0 stands for all 256 in a table that isn't empty, then each of
+// those characters and its count as a varint. Older files have a compressed
+// text map, c:123,d:4, and no FM_BINARY_COUNTS flag.
+std::string serializeCounts(const fm_counts &counts);
+// throws ReadError if the table is malformed
+void deserializeCounts(const char *data, size_t size, fm_counts &counts);
+
+// a compressed size_t array, decompressed straight into the vector
+std::vector<size_t> decompress_size_t_array(
+	const char *data, size_t size,
+	CompressionAlgorithm codec = CompressionAlgorithm::ZSTD);
+
+// the flagged size of the count table, the table, the size of the
+// checkpoints, the checkpoints (see RankedChunk::checkpoints) and the
+// characters. The checkpoints and the characters go through codec.
+std::string serializeChunk(const fm_chunk &chunk, Codec codec = Codec());
 
 fm_chunk deserializeChunk(const std::string &serializedChunk);
+fm_chunk deserializeChunk(const char *data, size_t size,
+						  CompressionAlgorithm codec = CompressionAlgorithm::ZSTD);
 
+// occurrences of c before pos of the chunk in the whole BWT, by scanning
 size_t searchChunk(const fm_chunk &chunk, char c, size_t pos);
+
+/*
+An FM chunk as the search uses it, with occurrence checkpoints: for every
+character present in the chunk a 32 bit count every FM_CHECKPOINT_CHARS.
+rank() answers what searchChunk does with one lookup and a count over at most
+half of FM_CHECKPOINT_CHARS bytes, from whichever checkpoint is nearer.
+
+Chunks written with FM_STORED_CHECKPOINTS come with theirs, a few percent of
+the chunk. For older ones every character gets a column, counted the first
+time the character is ranked, so decoding costs nothing extra.
+*/
+class RankedChunk {
+  public:
+	// the columns are counted as they are needed
+	explicit RankedChunk(fm_chunk chunk);
+
+	// throws ReadError if the chunk is malformed
+	static RankedChunk deserialize(const char *data, size_t size,
+								   CompressionAlgorithm codec);
+
+	// the checkpoints stored for chars: the number of characters present,
+	// each of them, then a column for each, the occurrences before every
+	// FM_CHECKPOINT_CHARS-th position up to the end
+	static std::vector<uint32_t> checkpoints(const std::string &chars);
+
+	size_t rank(char c, size_t pos) const;
+
+	// roughly how much memory the chunk takes up, for the block cache
+	size_t byte_size() const;
+
+  private:
+	std::string chars_;
+	fm_counts counts_;		  // occurrences before the chunk
+	int16_t slots_[ALPHABET]; // column of a character, -1 if absent
+	size_t rows_;			  // checkpoints in a column
+	// the stored checkpoints, or a column for every character, from
+	// columns_ on
+	mutable std::vector<uint32_t> checkpoints_;
+	size_t columns_ = 0;
+	// per character, null if the checkpoints were stored
+	std::unique_ptr<std::once_flag[]> counted_;
+
+	RankedChunk(fm_chunk chunk, std::vector<uint32_t> checkpoints);
+	const uint32_t *column(size_t slot) const;
+};
+// chunk_codec is for the FM chunks, the offsets and C stay zstd
 void write_fm_index_to_disk(const fm_index_t &tree,
-							const std::vector<size_t> &C, size_t n, FILE *fp);
+							const std::vector<size_t> &C, size_t n, FILE *fp,
+							Codec chunk_codec = Codec());
 
 std::tuple<size_t, std::vector<size_t>, std::vector<size_t>>
 read_metadata_from_file(VirtualFileRegion *vfr);
 
 std::tuple<size_t, size_t>
-search_fm_index(VirtualFileRegion *vfr, const char *P, size_t Psize, bool early_exit);
+search_fm_index(VirtualFileRegion *vfr, const char *P, size_t Psize, bool early_exit,
+				CompressionAlgorithm chunk_codec = CompressionAlgorithm::ZSTD);
 
 fm_index_t construct_fm_index(const char *P, size_t Psize);
 
+// the backend and the codecs are the ones the FM index and the log_idx
+// chunks were written with, as recorded in the Hawaii metadata page
 std::vector<size_t> search_vfr(VirtualFileRegion *wavelet_vfr,
 							   VirtualFileRegion *log_idx_vfr,
 							   std::string query,
-                               bool early_exit = true);
+                               bool early_exit = true,
+							   CompressionAlgorithm fm_codec = CompressionAlgorithm::ZSTD,
+							   CompressionAlgorithm log_idx_codec = CompressionAlgorithm::ZSTD,
+							   FMBackend fm_backend = FMBackend::CHUNKED);
 
 std::tuple<fm_index_t, std::vector<size_t>, std::vector<size_t>>
 bwt_and_build_fm_index(char *Text, size_t block_lines = -1);
 
-void write_log_idx_to_disk(std::vector<size_t> log_idx, FILE *log_idx_fp);
\ No newline at end of file
+// codec is for the log_idx chunks, their offsets stay zstd
+void write_log_idx_to_disk(std::vector<size_t> log_idx, FILE *log_idx_fp,
+						   Codec codec = Codec());
+
+// about what building the FM index of n characters of text in blocks of
+// block_lines lines holds in memory at its peak: the text, its suffix array and
+// block ends, and the chunks the BWT or the log_idx writer is filling and has
+// out for compression
+size_t fm_build_bytes(size_t n, size_t block_lines, FMBackend fm_backend);
+// FM_BUILD_MEMORY_FRACTION of the machine's memory
+size_t fm_default_build_bytes();
+
+// bwt_and_build_fm_index followed by write_fm_index_to_disk and
+// write_log_idx_to_disk, with the same output, but the chunks go to fp as the
+// BWT is walked. Nothing beyond Text and its suffix array is held for the
+// whole build. With FMBackend::WAVELET the BWT goes to a WaveletTreeWriter
+// instead. Returns the offset in fp where the log_idx starts. Throws
+// std::length_error if Text is too long for divsufsort's int offsets.
+size_t bwt_and_write_fm_index(char *Text, size_t block_lines, FILE *fp,
+							  Codec fm_codec = Codec(),
+							  Codec log_idx_codec = Codec(),
+							  FMBackend fm_backend = FMBackend::CHUNKED);
\ No newline at end of file
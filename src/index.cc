@@ -23,33 +23,61 @@ For layout of the metadata file refer to metadata.h
 
 #define BLOCK_BYTE_LIMIT 1000000 // chunk size for oahu
 #define BRUTE_THRESHOLD 5 // if the number of chunks is less than this, brute force, don't build fm index
+#define OAHU_SAMPLE_LINES 64 // lines per dictionary training sample
+#define OAHU_SAMPLE_BYTES 8000000 // string bytes sampled for the dictionaries
 
 using namespace std;
 
-std::vector<plist_size_t> search_oahu(VirtualFileRegion *vfr, 
+// one pass over all of them, rather than growing a bitmap one at a time
+static roaring::Roaring union_all(const std::vector<roaring::Roaring> &bitmaps) {
+	if (bitmaps.empty()) {
+		return roaring::Roaring();
+	}
+	std::vector<const roaring::Roaring *> inputs;
+	for (const roaring::Roaring &bitmap : bitmaps) {
+		inputs.push_back(&bitmap);
+	}
+	return roaring::Roaring::fastunion(inputs.size(), inputs.data());
+}
+
+// an Oahu block once it has been decompressed, this is what gets cached
+struct OahuBlock {
+	std::string strings;
+	PListChunk plist;
+};
+
+roaring::Roaring search_oahu(VirtualFileRegion *vfr, 
                                       int query_type,
 									  std::vector<size_t> chunks,
 									  std::string query_str) {
 	// read the metadata page
 
 	// read the last 8 bytes to figure out the length of the metadata page
-	vfr->vfseek(-sizeof(size_t), SEEK_END);
 	size_t metadata_page_length;
-	vfr->vfread(&metadata_page_length, sizeof(size_t));
-
-	// read the metadata page
-	vfr->vfseek(-sizeof(size_t) - metadata_page_length, SEEK_END);
-	std::string metadata_page;
-	metadata_page.resize(metadata_page_length);
-	vfr->vfread(&metadata_page[0], metadata_page_length);
-
-    Compressor compressor(CompressionAlgorithm::ZSTD);
-
-	// decompress the metadata page
-	OahuMetadataPage oahu_metadata_page(metadata_page);
-    std::vector<int>& type_order = oahu_metadata_page.type_order;
-    std::vector<size_t>& type_offsets = oahu_metadata_page.type_offsets;
-    std::vector<size_t>& block_offsets = oahu_metadata_page.byte_offsets;
+	read_trailer(vfr, vfr->size() - sizeof(size_t), &metadata_page_length,
+				 sizeof(size_t));
+
+	// read and decompress the metadata page
+	auto oahu_metadata_page = read_decoded<OahuMetadataPage>(
+		vfr, vfr->size() - sizeof(size_t) - metadata_page_length,
+		metadata_page_length, "oahu_metadata",
+		[](const char *data, size_t size) {
+			return OahuMetadataPage(std::string(data, size));
+		},
+		[](const OahuMetadataPage &page) {
+			return page.type_order.size() * sizeof(int) +
+				   (page.type_offsets.size() + page.byte_offsets.size()) *
+					   sizeof(size_t) +
+				   (page.strings_dictionary
+						? page.strings_dictionary->bytes().size()
+						: 0) +
+				   (page.plist_dictionary
+						? page.plist_dictionary->bytes().size()
+						: 0);
+		});
+	const std::vector<int> &type_order = oahu_metadata_page->type_order;
+	const std::vector<size_t> &type_offsets = oahu_metadata_page->type_offsets;
+	const std::vector<size_t> &block_offsets = oahu_metadata_page->byte_offsets;
 
 	// figure out where in the type_order is query_type
 	auto it = std::find(type_order.begin(), type_order.end(), query_type);
@@ -63,60 +91,124 @@ std::vector<plist_size_t> search_oahu(VirtualFileRegion *vfr,
 	size_t num_chunks = type_offsets.at(type_index + 1) - type_offset;
 
 	// go through the blocks
-	std::vector<plist_size_t> row_groups = {};
-
-#pragma omp parallel for
-	for (size_t i = 0; i < std::min(chunks.size(), num_chunks); ++i) {
+	// request every block up front so that a remote region has all of them
+	// in flight at once, the threads below decode and scan blocks as they
+	// come in
+	size_t num_blocks = std::min(chunks.size(), num_chunks);
+	std::vector<ReadRange> block_ranges;
+	for (size_t i = 0; i < num_blocks; ++i) {
 		size_t block_offset = block_offsets[type_offset + chunks[i]];
 		size_t next_block_offset = block_offsets[type_offset + chunks[i] + 1];
-		size_t block_size = next_block_offset - block_offset;
-
-		// read the block
-
-		VirtualFileRegion *local_vfr = vfr->slice(block_offset, block_size);
-		std::string block;
-		block.resize(block_size);
-		local_vfr->vfread(&block[0], block_size);
-
-		// read the length of the compressed strings
-		size_t compressed_strings_length =
-			*reinterpret_cast<const size_t *>(block.data());
-		std::string compressed_strings =
-			block.substr(sizeof(size_t), compressed_strings_length);
-		std::string decompressed_strings =
-			compressor.decompress(compressed_strings);
-
-		// read the compressed posting list
-		std::string compressed_plist =
-			block.substr(sizeof(size_t) + compressed_strings_length);
-		PListChunk plist(compressed_plist);
-
-		// decompressed strings will be delimited by \n, figure out which lines
-		// actually contain the query_str
-		std::istringstream iss(decompressed_strings);
-		std::string line;
-		size_t line_number = 0;
-		while (std::getline(iss, line)) {
-			// check if line contains query_str anywhere in the line
-			if (("\n" + line + "\n").find(query_str) != std::string::npos) {
-				// lookup the query string
-				std::vector<plist_size_t> result = plist.lookup(line_number);
-#pragma omp critical
-				{
-					row_groups.insert(row_groups.end(), result.begin(),
-									  result.end());
+		block_ranges.push_back(
+			{(long)block_offset, (long)(next_block_offset - block_offset)});
+	}
+	auto oahu_blocks = read_decoded_async<OahuBlock>(
+		vfr, block_ranges, "oahu_block",
+		// holding the page keeps its dictionaries alive while blocks decode
+		[oahu_metadata_page](const char *block, size_t size) {
+			// read the length of the compressed strings
+			size_t compressed_strings_length =
+				*reinterpret_cast<const size_t *>(block);
+			std::string decompressed_strings =
+				oahu_metadata_page->strings_compressor().decompress(
+					block + sizeof(size_t), compressed_strings_length);
+
+			// read the compressed posting list
+			size_t plist_offset = sizeof(size_t) + compressed_strings_length;
+			return OahuBlock{
+				std::move(decompressed_strings),
+				PListChunk(block + plist_offset, size - plist_offset,
+						   oahu_metadata_page->plist_compressor())};
+		},
+		[](const OahuBlock &block) {
+			return block.strings.size() + block.plist.byte_size();
+		});
+
+	// every block collects its row groups in a bitmap of its own, they are
+	// unioned at the end
+	std::vector<roaring::Roaring> block_row_groups(num_blocks);
+	ParallelErrors errors;
+#pragma omp parallel for schedule(dynamic)
+	for (size_t i = 0; i < num_blocks; ++i) {
+		errors.run([&] {
+			std::shared_ptr<const OahuBlock> oahu_block = oahu_blocks[i].get();
+			const PListChunk &plist = oahu_block->plist;
+
+			// decompressed strings will be delimited by \n, figure out which
+			// lines actually contain the query_str
+			std::istringstream iss(oahu_block->strings);
+			std::string line;
+			size_t line_number = 0;
+			while (std::getline(iss, line)) {
+				// check if line contains query_str anywhere in the line
+				if (("\n" + line + "\n").find(query_str) != std::string::npos) {
+					// lookup the query string
+					plist_span result = plist.lookup(line_number);
+					block_row_groups[i].addMany(result.size(), result.data());
 				}
+				++line_number;
 			}
-			++line_number;
-		}
+		});
 	}
+	errors.rethrow();
 
-	return row_groups;
+	return union_all(block_row_groups);
 }
 
-std::map<int, size_t> write_oahu(
-    std::map<int, std::string> type_input_files,
-    std::string output_name) {
+// Dictionaries for the block strings and posting lists of an Oahu file,
+// trained on runs of OAHU_SAMPLE_LINES lines from the start of every type.
+// Samples stop at a share of OAHU_SAMPLE_BYTES per type so that big types
+// don't crowd out the small ones, whose one or two blocks gain the most.
+static std::pair<std::shared_ptr<const ZstdDictionary>,
+				 std::shared_ptr<const ZstdDictionary>>
+train_oahu_dictionaries(const std::vector<int> &types,
+						PListEncoding plist_encoding) {
+	std::vector<std::string> string_samples;
+	std::vector<std::string> plist_samples;
+	size_t budget = OAHU_SAMPLE_BYTES / std::max<size_t>(types.size(), 1);
+	for (int type : types) {
+		std::ifstream string_file("compressed/compacted_type_" +
+								  std::to_string(type));
+		std::ifstream lineno_file("compressed/compacted_type_" +
+								  std::to_string(type) + "_lineno");
+		std::string strings = "";
+		std::vector<std::vector<plist_size_t>> linenos = {};
+		size_t sampled = 0;
+		std::string str_line;
+		std::string lineno_line;
+		while (sampled < budget && std::getline(string_file, str_line)) {
+			std::getline(lineno_file, lineno_line);
+			strings += str_line + "\n";
+			std::istringstream iss(lineno_line);
+			std::vector<plist_size_t> numbers;
+			plist_size_t number;
+			while (iss >> number) {
+				numbers.push_back(number);
+			}
+			linenos.push_back(numbers);
+			if (linenos.size() == OAHU_SAMPLE_LINES) {
+				sampled += strings.size();
+				string_samples.push_back(std::move(strings));
+				plist_samples.push_back(
+					PListChunk(std::move(linenos)).encode(plist_encoding));
+				strings = "";
+				linenos = {};
+			}
+		}
+		if (!linenos.empty()) {
+			string_samples.push_back(std::move(strings));
+			plist_samples.push_back(
+				PListChunk(std::move(linenos)).encode(plist_encoding));
+		}
+	}
+	return {ZstdDictionary::train(string_samples),
+			ZstdDictionary::train(plist_samples)};
+}
+
+std::map<int, size_t> write_oahu(std::string output_name,
+								 bool train_dictionaries, Codec strings_codec,
+								 Codec plist_codec,
+								 PListEncoding plist_encoding) {
 
 	// first figure out the number of types by listing all
 	// compressed/compacted_type* files
@@ -134,7 +226,27 @@ std::map<int, size_t> write_oahu(
 		}
 	}
 
-	auto compressor = Compressor(CompressionAlgorithm::ZSTD);
+	std::shared_ptr<const ZstdDictionary> strings_dictionary = nullptr;
+	std::shared_ptr<const ZstdDictionary> plist_dictionary = nullptr;
+	if (train_dictionaries) {
+		std::tie(strings_dictionary, plist_dictionary) =
+			train_oahu_dictionaries(types, plist_encoding);
+		// dictionaries are a zstd thing
+		if (strings_codec.algorithm != CompressionAlgorithm::ZSTD) {
+			strings_dictionary = nullptr;
+		}
+		if (plist_codec.algorithm != CompressionAlgorithm::ZSTD) {
+			plist_dictionary = nullptr;
+		}
+		LOG(INFO) << "oahu dictionaries: strings "
+				  << (strings_dictionary ? strings_dictionary->bytes().size() : 0)
+				  << " bytes, posting lists "
+				  << (plist_dictionary ? plist_dictionary->bytes().size() : 0)
+				  << " bytes\n";
+	}
+
+	auto compressor = Compressor(strings_codec, strings_dictionary.get());
+	auto plist_compressor = Compressor(plist_codec, plist_dictionary.get());
 
 	FILE *fp = fopen((output_name + ".oahu").c_str(), "wb");
 	std::vector<size_t> byte_offsets = {0};
@@ -142,6 +254,29 @@ std::map<int, size_t> write_oahu(
 
 	std::map<int, size_t> type_uncompressed_lines_in_block = {};
 
+	// blocks are compressed on the writer's threads and appended in order
+	BlockWriter blocks(fp);
+	auto write_block = [&](std::string strings,
+						   std::vector<std::vector<plist_size_t>> linenos) {
+		blocks.write(
+			[&compressor, &plist_compressor, plist_encoding,
+			 strings = std::move(strings),
+			 linenos = std::move(linenos)]() mutable {
+				std::string compressed_buffer =
+					compressor.compress(strings.c_str(), strings.size());
+				PListChunk plist(std::move(linenos));
+				std::string serialized3 =
+					plist.serialize(plist_compressor, plist_encoding);
+				size_t compressed_buffer_size = compressed_buffer.size();
+				return std::string((char *)&compressed_buffer_size,
+								   sizeof(size_t)) +
+					   compressed_buffer + serialized3;
+			},
+			[&byte_offsets](size_t size) {
+				byte_offsets.push_back(byte_offsets.back() + size);
+			});
+	};
+
 	// go through the types
 	for (int type : types) {
 		std::string string_file_path =
@@ -195,50 +330,22 @@ std::map<int, size_t> write_oahu(
 			if (uncompressed_lines_in_block > 0 &&
 				lines_in_buffer == uncompressed_lines_in_block) {
 				// we have a block
-				// compress the buffer
-				std::string compressed_buffer =
-					compressor.compress(buffer.c_str(), buffer.size());
-				PListChunk plist(std::move(lineno_buffer));
-				std::string serialized3 = plist.serialize();
+				write_block(std::move(buffer), std::move(lineno_buffer));
 				// reset the buffer
 				buffer = "";
 				lines_in_buffer = 0;
 				lineno_buffer = {};
-				size_t compressed_buffer_size = compressed_buffer.size();
-				fwrite(&compressed_buffer_size, sizeof(size_t), 1, fp);
-				fwrite(compressed_buffer.c_str(), sizeof(char),
-					   compressed_buffer.size(), fp);
-				fwrite(serialized3.c_str(), sizeof(char), serialized3.size(),
-					   fp);
-
-				byte_offsets.push_back(byte_offsets.back() +
-									   compressed_buffer.size() +
-									   serialized3.size() + sizeof(size_t));
 				blocks_written += 1;
 			}
 		}
 
-		std::string compressed_buffer =
-			compressor.compress(buffer.c_str(), buffer.size());
-		PListChunk plist(std::move(lineno_buffer));
-		std::string serialized3 = plist.serialize();
-		// reset the buffer
-		buffer = "";
-		lineno_buffer = {};
-		size_t compressed_buffer_size = compressed_buffer.size();
-		fwrite(&compressed_buffer_size, sizeof(size_t), 1, fp);
-		fwrite(compressed_buffer.c_str(), sizeof(char),
-			   compressed_buffer.size(), fp);
-		fwrite(serialized3.c_str(), sizeof(char), serialized3.size(), fp);
+		write_block(std::move(buffer), std::move(lineno_buffer));
 		blocks_written += 1;
 
 		LOG(INFO) << "type: " << type << " blocks written: " << blocks_written
 				  << "\n";
 
-		byte_offsets.push_back(byte_offsets.back() + compressed_buffer.size() +
-							   serialized3.size() + sizeof(size_t));
-
-		type_offsets.push_back(byte_offsets.size() - 1);
+		type_offsets.push_back(type_offsets.back() + blocks_written);
 
         if (blocks_written >= BRUTE_THRESHOLD)
         {
@@ -249,10 +356,16 @@ std::map<int, size_t> write_oahu(
 	}
 
 
+	blocks.finish();
+
 	size_t num_types = types.size();
 	size_t num_blocks = byte_offsets.size() - 1;
     OahuMetadataPage oahu_metadata_page(
         num_types, num_blocks, types, type_offsets , byte_offsets);
+    oahu_metadata_page.strings_dictionary = strings_dictionary;
+    oahu_metadata_page.plist_dictionary = plist_dictionary;
+    oahu_metadata_page.strings_codec = strings_codec.algorithm;
+    oahu_metadata_page.plist_codec = plist_codec.algorithm;
     std::string compressed_metadata_page = oahu_metadata_page.compress();
     size_t compressed_metadata_page_size = compressed_metadata_page.size();
 
@@ -279,7 +392,29 @@ dynamic range of the logidx. This is a lot simpler and will be faster for queryi
 
 void write_hawaii(std::string filename, 
     std::map<int, std::string> type_input_files,
-    std::map<int, size_t> type_uncompressed_lines_in_block) {
+    std::map<int, size_t> type_uncompressed_lines_in_block,
+    Codec fm_codec, Codec log_idx_codec, FMBackend fm_backend,
+    size_t build_bytes) {
+
+	// check every type against the budget before writing anything, the text
+	// is the file with a \n on either side
+	for (auto item : type_uncompressed_lines_in_block) {
+		const std::string &path = type_input_files.at(item.first);
+		size_t n = std::filesystem::file_size(path) + 2;
+		std::string type = "type " + std::to_string(item.first) + ": ";
+		if (n >= (size_t)INT_MAX) {
+			throw std::length_error(type + path + " is " + std::to_string(n) +
+									" characters, divsufsort takes at most " +
+									std::to_string(INT_MAX - 1));
+		}
+		size_t bytes = fm_build_bytes(n, item.second, fm_backend);
+		if (bytes > build_bytes) {
+			throw std::length_error(type + "the FM index of " + path +
+									" takes " + std::to_string(bytes) +
+									" bytes to build, over the budget of " +
+									std::to_string(build_bytes));
+		}
+	}
 
 	std::vector<size_t> byte_offsets = {0};
 	std::vector<int> type_order = {};
@@ -292,19 +427,27 @@ void write_hawaii(std::string filename,
 
         type_order.push_back(type);
 		size_t uncompressed_lines_in_block = item.second;
-		std::ifstream string_file(type_input_files.at(type));
-		std::string buffer = "\n";
-		std::string str_line;
-		while (std::getline(string_file, str_line)) {
-			buffer += str_line + "\n";
+		// read the file in one go into a buffer of its size, with the
+		// leading \n and a trailing one if the last line has none
+		const std::string &path = type_input_files.at(type);
+		size_t file_size = std::filesystem::file_size(path);
+		std::string buffer;
+		buffer.reserve(file_size + 2);
+		buffer.resize(file_size + 1);
+		buffer[0] = '\n';
+		std::ifstream string_file(path, std::ios::binary);
+		if (!string_file.read(buffer.data() + 1, file_size)) {
+			fclose(fp);
+			throw std::runtime_error("could not read " + path);
+		}
+		if (buffer.back() != '\n') {
+			buffer += '\n';
 		}
 
-		auto [fm_index, log_idx, C] =
-			bwt_and_build_fm_index(buffer.data(), uncompressed_lines_in_block);
-		
-        write_fm_index_to_disk(fm_index, C, buffer.size(), fp);
-        byte_offsets.push_back(ftell(fp));
-		write_log_idx_to_disk(log_idx, fp);
+		// the FM chunks and log_idx chunks are written as they are built
+		byte_offsets.push_back(bwt_and_write_fm_index(
+			buffer.data(), uncompressed_lines_in_block, fp, fm_codec,
+			log_idx_codec, fm_backend));
         byte_offsets.push_back(ftell(fp));
 
 	}
@@ -313,6 +456,18 @@ void write_hawaii(std::string filename,
     
 	HawaiiMetadataPage hawaii_metadata_page(
 		num_types, type_order, byte_offsets);
+	// all zstd is what a page without codecs means, keep those readable by
+	// older readers
+	if (fm_codec.algorithm != CompressionAlgorithm::ZSTD ||
+		log_idx_codec.algorithm != CompressionAlgorithm::ZSTD ||
+		fm_backend != FMBackend::CHUNKED) {
+		hawaii_metadata_page.fm_codecs.assign(num_types, fm_codec.algorithm);
+		hawaii_metadata_page.log_idx_codecs.assign(num_types,
+												   log_idx_codec.algorithm);
+	}
+	if (fm_backend != FMBackend::CHUNKED) {
+		hawaii_metadata_page.fm_backends.assign(num_types, fm_backend);
+	}
 	std::string compressed_metadata_page = hawaii_metadata_page.compress();
 	size_t compressed_metadata_page_size = compressed_metadata_page.size();
 
@@ -323,44 +478,44 @@ void write_hawaii(std::string filename,
 	fclose(fp);
 }
 
-std::map<int, std::set<size_t>> search_hawaii(VirtualFileRegion *vfr,
+std::map<int, roaring::Roaring> search_hawaii(VirtualFileRegion *vfr,
 											  std::vector<int> types,
 											  std::string query,
                                               bool early_exit) {
 	// read in the metadata page size and then the metadata page and then
 	// decompress everything
 
-	vfr->vfseek(-sizeof(size_t), SEEK_END);
 	size_t metadata_page_length;
-	vfr->vfread(&metadata_page_length, sizeof(size_t));
+	read_trailer(vfr, vfr->size() - sizeof(size_t), &metadata_page_length,
+				 sizeof(size_t));
 
 	// read the metadata page
-	vfr->vfseek(-sizeof(size_t) - metadata_page_length, SEEK_END);
-	std::string metadata_page;
-	metadata_page.resize(metadata_page_length);
-	vfr->vfread(&metadata_page[0], metadata_page_length);
-
-	HawaiiMetadataPage hawaii_metadata_page(metadata_page);
-	std::vector<int>& type_order =
-		hawaii_metadata_page.type_order;
-	std::vector<size_t>& byte_offsets = hawaii_metadata_page.byte_offsets;
-
-	std::map<int, std::set<size_t>> type_chunks = {};
-
+	auto hawaii_metadata_page = read_decoded<HawaiiMetadataPage>(
+		vfr, vfr->size() - sizeof(size_t) - metadata_page_length,
+		metadata_page_length, "hawaii_metadata",
+		[](const char *data, size_t size) {
+			return HawaiiMetadataPage(std::string(data, size));
+		},
+		[](const HawaiiMetadataPage &page) {
+			return page.type_order.size() * sizeof(int) +
+				   page.byte_offsets.size() * sizeof(size_t) +
+				   page.fm_codecs.size() + page.log_idx_codecs.size() +
+				   page.fm_backends.size();
+		});
+	const std::vector<int> &type_order = hawaii_metadata_page->type_order;
+	const std::vector<size_t> &byte_offsets = hawaii_metadata_page->byte_offsets;
+
+	std::map<int, roaring::Roaring> type_chunks = {};
+
+	ParallelErrors errors;
 #pragma omp parallel for
 	for (int type : types) {
 
-		VirtualFileRegion *local_vfr = vfr->slice(0, vfr->size());
-
 		size_t type_index = std::distance(type_order.begin(), 
             std::find(type_order.begin(), type_order.end(), type));
         
-		// if not found return empty, FM index was not used for this type
-		if (type_index == hawaii_metadata_page.num_types) {
-#pragma omp critical
-            {
-			    type_chunks[type] = {(size_t)-1};
-            }
+		// if not found leave it out, FM index was not used for this type
+		if (type_index == hawaii_metadata_page->num_types) {
 			continue;
 		}
 
@@ -371,26 +526,42 @@ std::map<int, std::set<size_t>> search_hawaii(VirtualFileRegion *vfr,
         size_t fm_index_size = logidx_offset - fm_index_offset;
         size_t logidx_size = byte_offsets[type_index * 2 + 2] - logidx_offset;
 
-        // note that each threads operates on a slice, which is a copy with
-        // own cursor.
-        VirtualFileRegion *fm_index_vfr =
-            local_vfr->slice(fm_index_offset, fm_index_size);
-        VirtualFileRegion *logidx_vfr =
-            local_vfr->slice(logidx_offset, logidx_size);
-
-        auto matched_pos = search_vfr(fm_index_vfr, logidx_vfr, query, early_exit);
-        std::set<size_t> chunks(matched_pos.begin(), matched_pos.end());
+        // the search only does positional reads, so slicing the shared
+        // region is all the per-thread state we need.
+        std::unique_ptr<VirtualFileRegion> fm_index_vfr(
+            vfr->slice(fm_index_offset, fm_index_size));
+        std::unique_ptr<VirtualFileRegion> logidx_vfr(
+            vfr->slice(logidx_offset, logidx_size));
+
+        // search_vfr gives up with {-1}, which is left out like a type
+        // without an FM index
+        std::vector<size_t> matched_pos;
+        errors.run([&] {
+            matched_pos = search_vfr(
+                fm_index_vfr.get(), logidx_vfr.get(), query, early_exit,
+                hawaii_metadata_page->fm_codec(type_index),
+                hawaii_metadata_page->log_idx_codec(type_index),
+                hawaii_metadata_page->fm_backend(type_index));
+        });
+        if (matched_pos == std::vector<size_t>{(size_t)-1}) {
+            continue;
+        }
+        roaring::Roaring chunks;
+        for (size_t chunk : matched_pos) {
+            chunks.add(chunk);
+        }
 
 #pragma omp critical
         {
             type_chunks[type] = std::move(chunks);
         }
 	}
+	errors.rethrow();
 
 	return type_chunks;
 }
 
-std::set<size_t> search_hawaii_oahu(VirtualFileRegion *vfr_hawaii,
+roaring::Roaring search_hawaii_oahu(VirtualFileRegion *vfr_hawaii,
 									VirtualFileRegion *vfr_oahu,
 									std::string query, size_t limit) {
 
@@ -414,82 +585,127 @@ std::set<size_t> search_hawaii_oahu(VirtualFileRegion *vfr_hawaii,
 		LOG(INFO) << "type to search: " << type << "\n";
 	}
 
-	std::set<size_t> results;
-
-	std::map<int, std::set<size_t>> result =
+	std::map<int, roaring::Roaring> result =
 		search_hawaii(vfr_hawaii, types_to_search, query);
 
-	// you cannot parallelize this loop here because vfr_hawaii is going to be
-	// shared across threads and will have conflicts on the cursor_!
-
 	// print out this result
 	for (auto &item : result) {
 
 		int type = item.first;
-		std::set<size_t> chunks = item.second;
+		const roaring::Roaring &chunks = item.second;
 
 		LOG(INFO) << "searching type " << type << "\n";
-		for (size_t chunk : chunks) {
+		for (plist_size_t chunk : chunks) {
 			LOG(INFO) << "chunk " << chunk << "\n";
 		}
 	}
 
-	for (auto &item : result) {
-
-		int type = item.first;
-		std::set<size_t> chunks = item.second;
+	std::vector<roaring::Roaring> results;
+	for (int type : types_to_search) {
 
 		LOG(INFO) << "searching type " << type << "\n";
-		std::vector<plist_size_t> found;
 
-		if (chunks == std::set<size_t>{(size_t)-1}) {
+		auto it = result.find(type);
+		if (it == result.end()) {
 			LOG(INFO) << "type not found, brute forcing Oahu\n";
 			std::vector<size_t> chunks_to_search(BRUTE_THRESHOLD);
 			std::iota(chunks_to_search.begin(), chunks_to_search.end(), 0);
-			found = search_oahu(vfr_oahu, type, chunks_to_search, query);
+			results.push_back(
+				search_oahu(vfr_oahu, type, chunks_to_search, query));
 		} else {
 			// only search up to limit chunks
-			std::vector<size_t> result_vec(chunks.begin(), chunks.end());
-			std::vector<size_t> chunks_to_search(
-				result_vec.begin(),
-				result_vec.begin() + std::min(result_vec.size(), limit));
-			found = search_oahu(vfr_oahu, type, chunks_to_search, query);
+			std::vector<size_t> chunks_to_search;
+			for (plist_size_t chunk : it->second) {
+				if (chunks_to_search.size() == limit) {
+					break;
+				}
+				chunks_to_search.push_back(chunk);
+			}
+			results.push_back(
+				search_oahu(vfr_oahu, type, chunks_to_search, query));
 		}
+	}
 
-		for (plist_size_t r : found) {
-			results.insert(r);
-		}
+	return union_all(results);
+}
+
+// The SDK is initialized while any session is open
+static std::mutex aws_mutex;
+static int aws_users = 0;
+static Aws::SDKOptions aws_options;
+
+static void acquire_aws() {
+	std::lock_guard<std::mutex> lock(aws_mutex);
+	if (aws_users++ == 0) {
+		Aws::InitAPI(aws_options);
+	}
+}
+
+static void release_aws() {
+	std::lock_guard<std::mutex> lock(aws_mutex);
+	if (--aws_users == 0) {
+		Aws::ShutdownAPI(aws_options);
 	}
+}
 
-	return results;
+// glog refuses to be initialized twice, and the python entry points can be
+// called any number of times
+static void init_logging() {
+	static std::once_flag once;
+	std::call_once(once, [] { google::InitGoogleLogging("rottnest"); });
 }
 
-std::vector<size_t> search_all(std::string split_index_prefix,
-							   std::string query, size_t limit) {
+SearchSession::SearchSession(std::string split_index_prefix, BlockCache *cache,
+							 LocalReads local_reads)
+	: local_reads_(local_reads), cache_(cache) {
 
 	/*
 	Expects a split_index_prefix of the form
 	s3://bucket/index-name/indices/split_id or path/index-name/indices/split_id
 	*/
 
-	VirtualFileRegion *vfr_hawaii;
-	VirtualFileRegion *vfr_oahu;
-	VirtualFileRegion *vfr_kauai;
+	if (!cache_) {
+		// footers are small and every query needs them, keep them for as
+		// long as the session is open
+		own_cache_ = std::make_unique<BlockCache>(BLOCK_CACHE_BYTES);
+		for (const char *kind :
+			 {"oahu_metadata", "hawaii_metadata", "fm_metadata",
+			  "log_idx_offsets", "kauai_dictionary", "kauai_template",
+			  "kauai_template_pl", "kauai_outlier", "kauai_outlier_pl",
+			  "kauai_outlier_type", "kauai_outlier_type_pl"}) {
+			own_cache_->pin_kind(kind);
+		}
+		cache_ = own_cache_.get();
+	}
+
+	acquire_aws();
+	try {
+		open(split_index_prefix);
+	} catch (...) {
+		// no destructor for a constructor that throws
+		close();
+		throw;
+	}
+}
 
-	Aws::SDKOptions options;
-	Aws::InitAPI(options);
+void SearchSession::open(std::string split_index_prefix) {
 
 	// print out the split_index_prefix
 	LOG(INFO) << "split_index_prefix: " << split_index_prefix << "\n";
 
-	Aws::Client::ClientConfiguration clientConfig;
-	clientConfig.region = "us-west-2";
-	clientConfig.connectTimeoutMs = 10000; // 10 seconds
-	clientConfig.requestTimeoutMs = 10000; // 10 seconds
-	Aws::S3::S3Client s3_client = Aws::S3::S3Client(clientConfig);
-
 	if (split_index_prefix.find("s3://") != std::string::npos) {
 
+		Aws::Client::ClientConfiguration clientConfig;
+		clientConfig.region = "us-west-2";
+		clientConfig.connectTimeoutMs = 10000; // 10 seconds
+		clientConfig.requestTimeoutMs = 10000; // 10 seconds
+		clientConfig.maxConnections = S3_MAX_CONNECTIONS;
+		// S3VirtualFileRegion retries and hedges by its S3ReadPolicy, SDK
+		// retries underneath would multiply the attempts and hide slow GETs
+		clientConfig.retryStrategy =
+			Aws::MakeShared<Aws::Client::DefaultRetryStrategy>("rottnest", 0);
+		s3_client_ = std::make_shared<Aws::S3::S3Client>(clientConfig);
+
 		split_index_prefix = split_index_prefix.substr(5);
 		std::string bucket =
 			split_index_prefix.substr(0, split_index_prefix.find("/"));
@@ -500,88 +716,231 @@ std::vector<size_t> search_all(std::string split_index_prefix,
 		LOG(INFO) << "bucket: " << bucket << "\n";
 		LOG(INFO) << "prefix: " << prefix << "\n";
 
-		vfr_hawaii = new S3VirtualFileRegion(s3_client, bucket,
-											 prefix + ".hawaii", "us-west-2");
-		vfr_oahu = new S3VirtualFileRegion(s3_client, bucket, prefix + ".oahu",
-										   "us-west-2");
-		vfr_kauai = new S3VirtualFileRegion(s3_client, bucket,
-											prefix + ".kauai", "us-west-2");
+		// raw pages are only worth caching for S3, the mapping already
+		// serves local reads from memory. With a disk cache configured they
+		// also survive this process.
+		auto open_s3 = [&](std::string key) -> VirtualFileRegion * {
+			VirtualFileRegion *vfr = new S3VirtualFileRegion(
+				s3_client_, bucket, key, "us-west-2", S3_TAIL_PREFETCH_BYTES);
+			if (std::shared_ptr<DiskCache> disk_cache = DiskCache::instance()) {
+				vfr = new DiskCachingVirtualFileRegion(vfr, disk_cache);
+			}
+			return new CachingVirtualFileRegion(vfr, CACHE_RAW | CACHE_DECODED,
+												cache_);
+		};
+		vfr_hawaii_.reset(open_s3(prefix + ".hawaii"));
+		vfr_oahu_.reset(open_s3(prefix + ".oahu"));
+		vfr_kauai_.reset(open_s3(prefix + ".kauai"));
 
 	} else {
-		vfr_hawaii = new DiskVirtualFileRegion(split_index_prefix + ".hawaii");
-		vfr_oahu = new DiskVirtualFileRegion(split_index_prefix + ".oahu");
-		vfr_kauai = new DiskVirtualFileRegion(split_index_prefix + ".kauai");
+		auto open_local = [&](std::string filename) -> VirtualFileRegion * {
+			if (local_reads_ == LOCAL_MMAP) {
+				return new CachingVirtualFileRegion(
+					new MmapVirtualFileRegion(filename), CACHE_DECODED, cache_);
+			}
+			// O_DIRECT has no page cache under it, keep raw pages ourselves
+			bool direct = local_reads_ == LOCAL_IO_URING_DIRECT;
+			return new CachingVirtualFileRegion(
+				new IoUringVirtualFileRegion(filename, direct),
+				direct ? CACHE_RAW | CACHE_DECODED : CACHE_DECODED, cache_);
+		};
+		vfr_hawaii_.reset(open_local(split_index_prefix + ".hawaii"));
+		vfr_oahu_.reset(open_local(split_index_prefix + ".oahu"));
+		vfr_kauai_.reset(open_local(split_index_prefix + ".kauai"));
 	}
+}
+
+SearchSession::~SearchSession() { close(); }
+
+void SearchSession::close() {
+	// the S3 regions wait for their GETs, which hold on to s3_client_, and
+	// all of it has to go before the SDK is shut down
+	vfr_hawaii_.reset();
+	vfr_oahu_.reset();
+	vfr_kauai_.reset();
+	s3_client_.reset();
+	release_aws();
+}
+
+std::optional<roaring::Roaring>
+SearchSession::search_row_groups(std::string query, size_t limit,
+								 IOStats *stats) {
+
+	// stats may not outlive the call however it ends
+	set_stats(stats);
+	std::unique_ptr<SearchSession, void (*)(SearchSession *)> unset_stats(
+		this, [](SearchSession *session) { session->set_stats(nullptr); });
 
 	std::pair<int, std::vector<plist_size_t>> result =
-		search_kauai(vfr_kauai, query, 1, limit);
+		search_kauai(vfr_kauai_.get(), query, 1, limit);
 
-	std::vector<size_t> return_results = {};
+	std::optional<roaring::Roaring> row_groups;
 
 	if (result.first == 0) {
 		// you have to brute force
 
-		return_results.push_back(-1);
-
 	} else if (result.first == 1) {
-		// have to convert plist_size_t to size_t
-		return_results.insert(return_results.end(), result.second.begin(),
-							  result.second.end());
+		row_groups = plist_span(result.second.data(), result.second.size())
+						 .bitmap();
 
 	} else if (result.first == 2) {
 
-		std::vector<size_t> current_results(result.second.begin(),
-											result.second.end());
-		std::set<size_t> next_results =
-			search_hawaii_oahu(vfr_hawaii, vfr_oahu, query, limit);
-		return_results = current_results;
-		return_results.insert(return_results.end(), next_results.begin(),
-							  next_results.end());
+		row_groups = plist_span(result.second.data(), result.second.size())
+						 .bitmap();
+		*row_groups |= search_hawaii_oahu(vfr_hawaii_.get(), vfr_oahu_.get(),
+										  query, limit);
 
 	} else {
 		assert(false);
 	}
 
-	Aws::ShutdownAPI(options);
-	return return_results;
+	LOG(INFO) << "block cache hits: " << cache_->hits()
+			  << " misses: " << cache_->misses() << " bytes: " << cache_->used()
+			  << "/" << cache_->capacity() << "\n";
+	if (std::shared_ptr<DiskCache> disk_cache = DiskCache::instance()) {
+		LOG(INFO) << "disk cache hits: " << disk_cache->hits()
+				  << " misses: " << disk_cache->misses()
+				  << " bytes: " << disk_cache->used() << "/"
+				  << disk_cache->capacity() << "\n";
+	}
+	if (stats) {
+		IOStats::Counter requests = stats->requests();
+		LOG(INFO) << "requests: " << requests.count
+				  << " bytes: " << requests.bytes << "\n";
+	}
+
+	return row_groups;
+}
+
+// the row groups as a sorted list, or just -1 when there is nothing to go on
+static std::vector<size_t>
+row_group_vector(const std::optional<roaring::Roaring> &row_groups) {
+	if (!row_groups) {
+		return {(size_t)-1};
+	}
+	std::vector<plist_size_t> values(row_groups->cardinality());
+	row_groups->toUint32Array(values.data());
+	return std::vector<size_t>(values.begin(), values.end());
+}
+
+// the results of a search for python: the list above and the bitmap in the
+// portable roaring format, empty when brute forcing
+static SearchResult
+pack_row_groups(const std::optional<roaring::Roaring> &row_groups,
+				std::string stats) {
+	std::string bitmap;
+	if (row_groups) {
+		bitmap.resize(row_groups->getSizeInBytes());
+		row_groups->write(&bitmap[0]);
+	}
+	return pack_search_result(row_group_vector(row_groups), stats, bitmap);
+}
+
+std::vector<size_t> SearchSession::search(std::string query, size_t limit,
+										  IOStats *stats) {
+	return row_group_vector(search_row_groups(query, limit, stats));
+}
 
-	free(vfr_hawaii);
-	free(vfr_oahu);
-	free(vfr_kauai);
+void SearchSession::set_stats(IOStats *stats) {
+	vfr_hawaii_->set_stats(stats);
+	vfr_oahu_->set_stats(stats);
+	vfr_kauai_->set_stats(stats);
+}
+
+// one-shot search, pages stay in the process-wide block cache between calls
+std::vector<size_t> search_all(std::string split_index_prefix,
+							   std::string query, size_t limit,
+							   IOStats *stats) {
+	SearchSession session(split_index_prefix, &BlockCache::instance());
+	return session.search(query, limit, stats);
 }
 
 extern "C" {
 // expects index_prefix in the format bucket/index_name/split_id/index_name
-Vector search_python(const char *split_index_prefix, const char *query,
-					 size_t limit) {
+SearchResult search_python(const char *split_index_prefix, const char *query,
+						   size_t limit) {
+
+	init_logging();
+
+	IOStats stats;
+	try {
+		SearchSession session(split_index_prefix, &BlockCache::instance());
+		return pack_row_groups(session.search_row_groups(query, limit, &stats),
+							   stats.to_json());
+	} catch (const std::exception &e) {
+		return pack_search_error(stats.to_json(), e.what());
+	}
+}
 
-	google::InitGoogleLogging("rottnest");
+// open a split for many queries, same prefix format as search_python.
+// NULL if it cannot be opened.
+void *open_session_python(const char *split_index_prefix) {
+	init_logging();
+	try {
+		return new SearchSession(split_index_prefix);
+	} catch (const std::exception &e) {
+		LOG(ERROR) << "cannot open " << split_index_prefix << ": " << e.what()
+				   << "\n";
+		return nullptr;
+	}
+}
 
-	std::vector<size_t> results = search_all(split_index_prefix, query, limit);
-	Vector v = pack_vector(results);
+SearchResult search_session_python(void *session, const char *query,
+								   size_t limit) {
+	IOStats stats;
+	try {
+		return pack_row_groups(static_cast<SearchSession *>(session)
+								   ->search_row_groups(query, limit, &stats),
+							   stats.to_json());
+	} catch (const std::exception &e) {
+		return pack_search_error(stats.to_json(), e.what());
+	}
+}
 
-	google::ShutdownGoogleLogging();
+void close_session_python(void *session) {
+	delete static_cast<SearchSession *>(session);
+}
 
-	return v;
+// every SearchResult goes back through here once python has copied it out
+void free_search_result_python(SearchResult result) {
+	free_search_result(result);
 }
 
-void index_python(const char *index_name, size_t num_groups) {
+// budget of the process-wide block cache shared by every search_python call
+void set_block_cache_bytes_python(size_t bytes) {
+	BlockCache::instance().set_capacity(bytes);
+}
 
-	google::InitGoogleLogging("rottnest");
+// keep pages of S3 index objects under directory across search_python calls
+// and processes, up to bytes in total
+void set_disk_cache_python(const char *directory, size_t bytes) {
+	DiskCache::configure(directory, bytes);
+}
 
-	std::string index_name_str(index_name);
-	compact(num_groups);
-	write_kauai(index_name_str, num_groups);
-	auto type_uncompressed_lines_in_block = write_oahu(index_name_str);
+// 0 once the index is written, -1 if it could not be, with the error logged
+int index_python(const char *index_name, size_t num_groups) {
 
-    std::map<int, std::string> type_input_files = {};
-    for (auto type : type_uncompressed_lines_in_block)
-    {
-        type_input_files[type.first] = "compressed/compacted_type_" + std::to_string(type.first);
-    }
+	init_logging();
 
-	write_hawaii(index_name_str, type_input_files, type_uncompressed_lines_in_block);
+	try {
+		std::string index_name_str(index_name);
+		compact(num_groups);
+		write_kauai(index_name_str, num_groups);
+		auto type_uncompressed_lines_in_block = write_oahu(index_name_str);
 
-	google::ShutdownGoogleLogging();
+		std::map<int, std::string> type_input_files = {};
+		for (auto type : type_uncompressed_lines_in_block) {
+			type_input_files[type.first] =
+				"compressed/compacted_type_" + std::to_string(type.first);
+		}
+
+		write_hawaii(index_name_str, type_input_files,
+					 type_uncompressed_lines_in_block);
+	} catch (const std::exception &e) {
+		LOG(ERROR) << "cannot index " << index_name << ": " << e.what()
+				   << "\n";
+		return -1;
+	}
+	return 0;
 }
 }
\ No newline at end of file
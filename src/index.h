@@ -7,6 +7,7 @@
 #include <iostream>
 #include <map>
 #include <numeric>
+#include <optional>
 #include <sstream>
 
 #include "compactor.h"
@@ -19,25 +20,91 @@
 #include "vfr.h"
 #include <glog/logging.h>
 
-std::vector<plist_size_t> search_oahu(VirtualFileRegion *vfr, int query_type,
-									  std::vector<size_t> chunks,
-									  std::string query_str);
+// the row groups of the lines of chunks that contain query_str
+roaring::Roaring search_oahu(VirtualFileRegion *vfr, int query_type,
+							 std::vector<size_t> chunks,
+							 std::string query_str);
 
-std::map<int, size_t> write_oahu(std::string output_name);
+// with train_dictionaries the block strings and posting lists are compressed
+// against zstd dictionaries trained on the input, stored in the metadata page
+// along with the codecs of the two. PListEncoding::PACKED posting lists
+// usually want a plist_codec of CompressionAlgorithm::NONE.
+std::map<int, size_t> write_oahu(std::string output_name,
+								 bool train_dictionaries = false,
+								 Codec strings_codec = Codec(),
+								 Codec plist_codec = Codec(),
+								 PListEncoding plist_encoding = PListEncoding::RAW);
 
+// the codecs of the FM chunks and the log_idx chunks are recorded in the
+// metadata page, e.g. LZ4 for both trades size for decode time. So is
+// fm_backend, FMBackend::WAVELET reads less per step of the search at the
+// cost of more requests. Every type is built in memory on its own, one that
+// would take more than build_bytes (see fm_build_bytes) or is too long for
+// divsufsort throws std::length_error before anything is written. Such a type
+// has to be split into several before indexing. A type file that cannot be
+// read throws std::runtime_error.
 void write_hawaii(std::string filename, 
     std::map<int, std::string> type_input_files,
-    std::map<int, size_t> type_uncompressed_lines_in_block);
+    std::map<int, size_t> type_uncompressed_lines_in_block,
+    Codec fm_codec = Codec(), Codec log_idx_codec = Codec(),
+    FMBackend fm_backend = FMBackend::CHUNKED,
+    size_t build_bytes = fm_default_build_bytes());
 
 
-std::map<int, std::set<size_t>> search_hawaii(VirtualFileRegion *vfr,
+// the Oahu chunks that may contain query for each of types. Types without an
+// FM index, or that it couldn't narrow down, are left out.
+std::map<int, roaring::Roaring> search_hawaii(VirtualFileRegion *vfr,
 											  std::vector<int> types,
 											  std::string query,
                                               bool early_exit = true);
 
-std::set<size_t> search_hawaii_oahu(VirtualFileRegion *vfr_hawaii,
+roaring::Roaring search_hawaii_oahu(VirtualFileRegion *vfr_hawaii,
 									VirtualFileRegion *vfr_oahu,
 									std::string query, size_t limit);
 
+// An index split opened once and searched many times. It keeps the SDK
+// initialized and the S3 client and regions open. With its own cache it also
+// pins the parsed footers (metadata pages, FM C arrays and offsets, Kauai
+// sections), so a query only reads the pages specific to it.
+// how a SearchSession reads a split on local disk
+enum LocalReads {
+	LOCAL_MMAP,			   // zero copy out of the page cache
+	LOCAL_IO_URING,		   // batched io_uring reads through the page cache
+	LOCAL_IO_URING_DIRECT, // batched O_DIRECT io_uring reads
+};
+
+class SearchSession {
+  private:
+	LocalReads local_reads_;
+	std::shared_ptr<Aws::S3::S3Client> s3_client_;
+	std::unique_ptr<BlockCache> own_cache_;
+	BlockCache *cache_;
+	std::unique_ptr<VirtualFileRegion> vfr_hawaii_;
+	std::unique_ptr<VirtualFileRegion> vfr_oahu_;
+	std::unique_ptr<VirtualFileRegion> vfr_kauai_;
+
+	void open(std::string split_index_prefix);
+	void close();
+	void set_stats(IOStats *stats);
+
+  public:
+	// cache defaults to one private to the session. Throws ReadError if the
+	// split cannot be opened.
+	SearchSession(std::string split_index_prefix, BlockCache *cache = nullptr,
+				  LocalReads local_reads = LOCAL_MMAP);
+	~SearchSession();
+	// the row groups matching query from Kauai, Hawaii and Oahu, nullopt if
+	// they all have to be brute forced. Reads are counted in stats if given,
+	// a session serves one query at a time. Throws ReadError when the index
+	// cannot be read.
+	std::optional<roaring::Roaring>
+	search_row_groups(std::string query, size_t limit,
+					  IOStats *stats = nullptr);
+	// the same as a sorted list, {-1} to brute force
+	std::vector<size_t> search(std::string query, size_t limit,
+							   IOStats *stats = nullptr);
+};
+
 std::vector<size_t> search_all(std::string split_index_prefix,
-							   std::string query, size_t limit);
\ No newline at end of file
+							   std::string query, size_t limit,
+							   IOStats *stats = nullptr);
\ No newline at end of file
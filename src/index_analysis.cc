@@ -9,7 +9,6 @@
 
 #include "compressor.h"
 #include "plist.h"
-#include "roaring.c"
 #include "roaring.hh" // the amalgamated roaring.hh includes roaring64map.hh
 #include "type_util.h"
 #include "vfr.h"
@@ -107,7 +106,7 @@ void analyze_oahu(std::string filename) {
 		std::string compressed_plist =
 			block.substr(sizeof(size_t) + compressed_strings_length);
 		PListChunk plist(compressed_plist);
-		std::vector<std::vector<plist_size_t>> &plist_data = plist.data();
+		std::vector<std::vector<plist_size_t>> plist_data = plist.to_vectors();
 
 		CompressionAlgorithm compression_algorithm = CompressionAlgorithm::ZSTD;
 		Compressor compressor(compression_algorithm);
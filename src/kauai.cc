@@ -72,78 +72,64 @@ search_kauai(VirtualFileRegion *vfr, std::string query, int mode, int k) {
 		assert(false);
 	}
 
-	Compressor compressor(CompressionAlgorithm::ZSTD);
 	size_t byte_offsets[8];
-	vfr->vfseek(-sizeof(size_t) * 6, SEEK_END);
-	vfr->vfread(byte_offsets, sizeof(size_t) * 6);
-
-	vfr->vfseek(0, SEEK_SET);
+	read_trailer(vfr, vfr->size() - sizeof(size_t) * 6, byte_offsets,
+				 sizeof(size_t) * 6);
+
+	// every section is decoded through the region's block cache, if it has
+	// one, so repeated queries against the same split skip the reads
+	auto read_plist = [vfr](long offset, long length, const std::string &kind) {
+		return read_decoded<PListChunk>(
+			vfr, offset, length, kind,
+			[](const char *data, size_t size) { return PListChunk(data, size); },
+			[](const PListChunk &plist) { return plist.byte_size(); });
+	};
 
 	// read in the dictionary
 	size_t dictionary_str_size = byte_offsets[0];
-	std::string dictionary_str;
-	dictionary_str.resize(dictionary_str_size);
-	vfr->vfread((void *)dictionary_str.data(), dictionary_str_size);
-	std::string decompressed_dictionary_str =
-		compressor.decompress(dictionary_str);
+	auto dictionary_page =
+		read_decompressed(vfr, 0, dictionary_str_size, "kauai_dictionary");
+	const std::string &decompressed_dictionary_str = *dictionary_page;
 
 	// read in the dead templates
 	size_t template_str_size = byte_offsets[1] - byte_offsets[0];
-	std::string template_str;
-	template_str.resize(template_str_size);
-	vfr->vfseek(byte_offsets[0], SEEK_SET);
-	vfr->vfread(&template_str[0], template_str_size);
-	std::string decompressed_template_str = compressor.decompress(template_str);
+	auto template_page = read_decompressed(vfr, byte_offsets[0],
+										   template_str_size, "kauai_template");
+	const std::string &decompressed_template_str = *template_page;
 
 	// read in the dead template posting lists
 	size_t template_pl_size = byte_offsets[2] - byte_offsets[1];
-	std::string template_pl;
-	template_pl.resize(template_pl_size);
-	vfr->vfseek(byte_offsets[1], SEEK_SET);
-	vfr->vfread(&template_pl[0], template_pl_size);
-	PListChunk template_plist_chunk(std::move(template_pl));
-	std::vector<std::vector<plist_size_t>> &template_plist =
-		template_plist_chunk.data();
+	auto template_plist_chunk =
+		read_plist(byte_offsets[1], template_pl_size, "kauai_template_pl");
+	const PListChunk &template_plist = *template_plist_chunk;
 
 	// read in the outlier strings
 	size_t outlier_str_size = byte_offsets[3] - byte_offsets[2];
-	std::string outlier_str;
-	outlier_str.resize(outlier_str_size);
-	vfr->vfseek(byte_offsets[2], SEEK_SET);
-	vfr->vfread(&outlier_str[0], outlier_str_size);
-	std::string decompressed_outlier_str = compressor.decompress(outlier_str);
+	auto outlier_page = read_decompressed(vfr, byte_offsets[2],
+										  outlier_str_size, "kauai_outlier");
+	const std::string &decompressed_outlier_str = *outlier_page;
 
 	// read in the outlier posting lists
 	size_t outlier_pl_size = byte_offsets[4] - byte_offsets[3];
-	std::string outlier_pl;
-	outlier_pl.resize(outlier_pl_size);
-	vfr->vfseek(byte_offsets[3], SEEK_SET);
-	vfr->vfread(&outlier_pl[0], outlier_pl_size);
-	PListChunk outlier_plist_chunk(std::move(outlier_pl));
-	std::vector<std::vector<plist_size_t>> &outlier_plist =
-		outlier_plist_chunk.data();
+	auto outlier_plist_chunk =
+		read_plist(byte_offsets[3], outlier_pl_size, "kauai_outlier_pl");
+	const PListChunk &outlier_plist = *outlier_plist_chunk;
 
 	// read in the outlier type strings
 	size_t outlier_type_str_size = byte_offsets[5] - byte_offsets[4];
-	std::string outlier_type_str;
-	outlier_type_str.resize(outlier_type_str_size);
-	vfr->vfseek(byte_offsets[4], SEEK_SET);
-	vfr->vfread(&outlier_type_str[0], outlier_type_str_size);
-	std::string decompressed_outlier_type_str =
-		compressor.decompress(outlier_type_str);
+	auto outlier_type_page =
+		read_decompressed(vfr, byte_offsets[4], outlier_type_str_size,
+						  "kauai_outlier_type");
+	const std::string &decompressed_outlier_type_str = *outlier_type_page;
 
 	// read in the outlier type posting lists, first get the file size, the
 	// limit is file_size - byte_offsets[7] - 8 * sizeof(size_t)
 
 	size_t outlier_type_pl_size =
 		vfr->size() - byte_offsets[5] - 6 * sizeof(size_t);
-	std::string outlier_type_pl;
-	outlier_type_pl.resize(outlier_type_pl_size);
-	vfr->vfseek(byte_offsets[5], SEEK_SET);
-	vfr->vfread(&outlier_type_pl[0], outlier_type_pl_size);
-	PListChunk outlier_type_plist_chunk(std::move(outlier_type_pl));
-	std::vector<std::vector<plist_size_t>> &outlier_type_plist =
-		outlier_type_plist_chunk.data();
+	auto outlier_type_plist_chunk = read_plist(
+		byte_offsets[5], outlier_type_pl_size, "kauai_outlier_type_pl");
+	const PListChunk &outlier_type_plist = *outlier_type_plist_chunk;
 
 	// first lookup the query in the dictionary
 
@@ -164,8 +150,9 @@ search_kauai(VirtualFileRegion *vfr, std::string query, int mode, int k) {
 
 	std::vector<plist_size_t> matched_row_groups = {};
 
-	auto search_text = [](std::string &query, std::string &source_str,
-						  std::vector<std::vector<plist_size_t>> &plists,
+	auto search_text = [](const std::string &query,
+						  const std::string &source_str,
+						  const PListChunk &plists,
 						  std::vector<plist_size_t> &matched_row_groups,
 						  bool write = false) {
 		if (write) {
@@ -179,7 +166,7 @@ search_kauai(VirtualFileRegion *vfr, std::string query, int mode, int k) {
 			if (template_idx != std::string::npos) {
 				std::cout << line << " ";
 				std::cout << line_no << std::endl;
-				std::vector<plist_size_t> &posting_list = plists[line_no];
+				plist_span posting_list = plists.lookup(line_no);
 				for (plist_size_t row_group : posting_list) {
 					std::cout << row_group << " ";
 					matched_row_groups.push_back(row_group);
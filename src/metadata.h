@@ -1,9 +1,12 @@
 #pragma once
 #include "compressor.h"
+#include "fm_index.h"
 #include "glog/logging.h"
+#include <cassert>
 #include <cstdint>
 #include <cstdio>
 #include <map>
+#include <memory>
 #include <string>
 #include <vector>
 // define an abstract class MetadataPage
@@ -22,7 +25,12 @@ class OahuMetadataPage : public MetadataPage {
     - type_order: 8 bytes for each type in a list of length N, indicating the order of the types
 	- 8 bytes for each type in a list of length N, indicating the offset into
 	the block-byte-offset array for each type
-	- 8 bytes for each block, denoting block offset */
+	- 8 bytes for each block, denoting block offset
+	- optionally the zstd dictionaries the block strings and the block posting
+	lists were compressed with, each as 8 bytes of length (0 for none) and the
+	dictionary, then one byte each for the codec of the block strings and of
+	the posting lists. Files written without them simply end after the
+	offsets and are all zstd. */
 
     public:
         size_t num_types;
@@ -30,6 +38,10 @@ class OahuMetadataPage : public MetadataPage {
         std::vector<int> type_order = {};
         std::vector<size_t> type_offsets = {};
         std::vector<size_t> byte_offsets = {};
+        std::shared_ptr<const ZstdDictionary> strings_dictionary = nullptr;
+        std::shared_ptr<const ZstdDictionary> plist_dictionary = nullptr;
+        CompressionAlgorithm strings_codec = CompressionAlgorithm::ZSTD;
+        CompressionAlgorithm plist_codec = CompressionAlgorithm::ZSTD;
 
         OahuMetadataPage(size_t num_types, size_t num_blocks, std::vector<int> type_order, std::vector<size_t> type_offsets, std::vector<size_t> byte_offsets)
             : num_types(num_types), num_blocks(num_blocks), type_order(type_order), type_offsets(type_offsets), byte_offsets(byte_offsets) {}
@@ -65,7 +77,31 @@ class OahuMetadataPage : public MetadataPage {
                 byte_offsets.push_back(*reinterpret_cast<const size_t *>(
                     decompressed_metadata_page.data() + 2 * sizeof(size_t) + num_types * sizeof(int)
                     + num_types * sizeof(size_t) + sizeof(size_t) + i * sizeof(size_t)));
-            }       
+            }
+
+            size_t cursor = 2 * sizeof(size_t) + num_types * sizeof(int) +
+                            (num_types + 1) * sizeof(size_t) +
+                            (num_blocks + 1) * sizeof(size_t);
+            if (cursor < decompressed_metadata_page.size()) {
+                strings_dictionary =
+                    read_dictionary(decompressed_metadata_page, cursor);
+                plist_dictionary =
+                    read_dictionary(decompressed_metadata_page, cursor);
+            }
+            if (cursor < decompressed_metadata_page.size()) {
+                strings_codec = static_cast<CompressionAlgorithm>(
+                    decompressed_metadata_page[cursor]);
+                plist_codec = static_cast<CompressionAlgorithm>(
+                    decompressed_metadata_page[cursor + 1]);
+            }
+        }
+
+        // what the blocks of this file decompress with
+        Compressor strings_compressor() const {
+            return Compressor(strings_codec, strings_dictionary.get());
+        }
+        Compressor plist_compressor() const {
+            return Compressor(plist_codec, plist_dictionary.get());
         }
 
         std::string compress() {
@@ -86,12 +122,44 @@ class OahuMetadataPage : public MetadataPage {
                 metadata_page += std::string((char *)&byte_offset, sizeof(size_t));
             }
 
+            if (strings_dictionary || plist_dictionary ||
+                strings_codec != CompressionAlgorithm::ZSTD ||
+                plist_codec != CompressionAlgorithm::ZSTD) {
+                write_dictionary(metadata_page, strings_dictionary.get());
+                write_dictionary(metadata_page, plist_dictionary.get());
+                metadata_page += static_cast<char>(strings_codec);
+                metadata_page += static_cast<char>(plist_codec);
+            }
+
             std::string compressed_metadata_page =
                 Compressor(CompressionAlgorithm::ZSTD)
                     .compress(metadata_page.c_str(), metadata_page.size());
 
             return compressed_metadata_page;
         }
+
+    private:
+        static std::shared_ptr<const ZstdDictionary>
+        read_dictionary(const std::string &page, size_t &cursor) {
+            size_t size =
+                *reinterpret_cast<const size_t *>(page.data() + cursor);
+            cursor += sizeof(size_t);
+            if (size == 0) {
+                return nullptr;
+            }
+            cursor += size;
+            return std::make_shared<const ZstdDictionary>(
+                page.substr(cursor - size, size));
+        }
+
+        static void write_dictionary(std::string &page,
+                                     const ZstdDictionary *dictionary) {
+            size_t size = dictionary ? dictionary->bytes().size() : 0;
+            page += std::string((char *)&size, sizeof(size_t));
+            if (dictionary) {
+                page += dictionary->bytes();
+            }
+        }
 };
 
 class HawaiiMetadataPage : public MetadataPage {
@@ -104,12 +172,21 @@ class HawaiiMetadataPage : public MetadataPage {
     in the blocks, e.g. 1, 21, 53, 63
     - byte_offsets: (16 bytes * N + 8 bytes) for each type in a list of length N, indicating the byte offset for 
     the fm index and the logidx for each type. 
+    - optionally two bytes for each type, the codec of its FM chunks and of
+    its log_idx chunks. Without them everything is zstd.
+    - optionally, after those, a byte for each type with its FMBackend.
+    Without it every type is FMBackend::CHUNKED.
    */
 
   public:
 	size_t num_types;
 	std::vector<int> type_order = {};
 	std::vector<size_t> byte_offsets = {};
+	// one per type, or empty for all zstd
+	std::vector<CompressionAlgorithm> fm_codecs = {};
+	std::vector<CompressionAlgorithm> log_idx_codecs = {};
+	// one per type, or empty for all chunked. Needs the codecs.
+	std::vector<FMBackend> fm_backends = {};
 
 	HawaiiMetadataPage(size_t num_types, 
 					   std::vector<int> type_order, 
@@ -142,6 +219,37 @@ class HawaiiMetadataPage : public MetadataPage {
 				decompressed_metadata_page.data() + sizeof(size_t) + num_types * sizeof(int) + i * sizeof(size_t)));
 			LOG(INFO) << "group offsets: " << byte_offsets[i] << "\n";
 		}
+
+		size_t cursor = sizeof(size_t) + num_types * sizeof(int) +
+						(num_types * 2 + 1) * sizeof(size_t);
+		if (cursor < decompressed_metadata_page.size()) {
+			for (size_t i = 0; i < num_types; ++i) {
+				fm_codecs.push_back(static_cast<CompressionAlgorithm>(
+					decompressed_metadata_page[cursor + 2 * i]));
+				log_idx_codecs.push_back(static_cast<CompressionAlgorithm>(
+					decompressed_metadata_page[cursor + 2 * i + 1]));
+			}
+			cursor += 2 * num_types;
+		}
+		if (cursor < decompressed_metadata_page.size()) {
+			for (size_t i = 0; i < num_types; ++i) {
+				fm_backends.push_back(static_cast<FMBackend>(
+					decompressed_metadata_page[cursor + i]));
+			}
+		}
+	}
+
+	CompressionAlgorithm fm_codec(size_t type_index) const {
+		return fm_codecs.empty() ? CompressionAlgorithm::ZSTD
+								 : fm_codecs[type_index];
+	}
+	CompressionAlgorithm log_idx_codec(size_t type_index) const {
+		return log_idx_codecs.empty() ? CompressionAlgorithm::ZSTD
+									  : log_idx_codecs[type_index];
+	}
+	FMBackend fm_backend(size_t type_index) const {
+		return fm_backends.empty() ? FMBackend::CHUNKED
+								   : fm_backends[type_index];
 	}
 
 	std::string compress() {
@@ -157,6 +265,15 @@ class HawaiiMetadataPage : public MetadataPage {
 			metadata_page += std::string((char *)&byte_offset, sizeof(size_t));
 		}
 
+		for (size_t i = 0; i < fm_codecs.size(); ++i) {
+			metadata_page += static_cast<char>(fm_codecs[i]);
+			metadata_page += static_cast<char>(log_idx_codecs[i]);
+		}
+		assert(fm_backends.empty() || !fm_codecs.empty());
+		for (FMBackend backend : fm_backends) {
+			metadata_page += static_cast<char>(backend);
+		}
+
 		std::string compressed_metadata_page =
 			Compressor(CompressionAlgorithm::ZSTD)
 				.compress(metadata_page.c_str(), metadata_page.size());
@@ -1,102 +1,472 @@
 #include "plist.h"
 
-PListChunk::PListChunk(const std::string &compressed_data)
-	: compressor_(CompressionAlgorithm::ZSTD) {
+namespace {
 
-	// decompress the data
-	std::string data = compressor_.decompress(compressed_data);
+// A packed block is PLIST_PACK_LANES lanes of PACK_ROWS items, item i in lane
+// i % PLIST_PACK_LANES, so all lanes shift by the same amounts. Every width
+// has its own pack and unpack kernel with the shifts and masks fixed at
+// compile time, which the compiler turns into vector shifts across the lanes.
+constexpr int PACK_ROWS = PLIST_PACK_BLOCK / PLIST_PACK_LANES;
 
-	// reinterpret the last 8 bytes of data as the number of posting lists
-	plist_size_t num_posting_lists = *reinterpret_cast<const plist_size_t *>(
-		data.data() + data.size() - sizeof(plist_size_t));
+typedef void (*pack_kernel)(const plist_size_t *, plist_size_t *);
 
-	// Read the bit array
-	std::vector<bool> bit_array;
-	for (plist_size_t i = 0; i < num_posting_lists; ++i) {
-		bit_array.push_back(data[i / 8] & (1 << (i % 8)));
+template <int W> constexpr plist_size_t width_mask() {
+	return W == 32 ? ~0u : (1u << W) - 1;
+}
+
+// row R of every lane, packed is zeroed beforehand
+template <int W, int R>
+inline void pack_row(const plist_size_t *__restrict__ deltas,
+					 plist_size_t *__restrict__ packed) {
+	constexpr int word = R * W / 32;
+	constexpr int shift = R * W % 32;
+	for (int lane = 0; lane < PLIST_PACK_LANES; ++lane) {
+		plist_size_t delta = deltas[PLIST_PACK_LANES * R + lane];
+		packed[PLIST_PACK_LANES * word + lane] |= delta << shift;
+		if constexpr (shift + W > 32) {
+			packed[PLIST_PACK_LANES * (word + 1) + lane] |=
+				delta >> (32 - shift);
+		}
 	}
+}
 
-	plist_size_t cursor = (num_posting_lists + 7) / 8;
+template <int W, int R>
+inline void unpack_row(const plist_size_t *__restrict__ packed,
+					   plist_size_t *__restrict__ deltas) {
+	constexpr int word = R * W / 32;
+	constexpr int shift = R * W % 32;
+	for (int lane = 0; lane < PLIST_PACK_LANES; ++lane) {
+		plist_size_t delta = packed[PLIST_PACK_LANES * word + lane] >> shift;
+		if constexpr (shift + W > 32) {
+			delta |= packed[PLIST_PACK_LANES * (word + 1) + lane]
+					 << (32 - shift);
+		}
+		deltas[PLIST_PACK_LANES * R + lane] = delta & width_mask<W>();
+	}
+}
 
-	// Read the count array
-	std::vector<plist_size_t> count_array;
-	for (bool bit : bit_array) {
-		if (bit) {
-			count_array.push_back(
-				*reinterpret_cast<const plist_size_t *>(data.data() + cursor));
-			cursor += sizeof(plist_size_t);
-		} else {
-			count_array.push_back(1);
+template <int W, int... R>
+void pack_rows(const plist_size_t *deltas, plist_size_t *packed,
+			   std::integer_sequence<int, R...>) {
+	(pack_row<W, R>(deltas, packed), ...);
+}
+
+template <int W, int... R>
+void unpack_rows(const plist_size_t *packed, plist_size_t *deltas,
+				 std::integer_sequence<int, R...>) {
+	(unpack_row<W, R>(packed, deltas), ...);
+}
+
+// W words per lane, none for width 0
+template <int W>
+void pack_block(const plist_size_t *deltas, plist_size_t *packed) {
+	pack_rows<W>(deltas, packed, std::make_integer_sequence<int, PACK_ROWS>());
+}
+
+template <int W>
+void unpack_block(const plist_size_t *packed, plist_size_t *deltas) {
+	if constexpr (W == 0) {
+		std::fill(deltas, deltas + PLIST_PACK_BLOCK, 0);
+	} else {
+		unpack_rows<W>(packed, deltas,
+					   std::make_integer_sequence<int, PACK_ROWS>());
+	}
+}
+
+template <int... W>
+constexpr std::array<pack_kernel, 33>
+pack_kernels(std::integer_sequence<int, W...>) {
+	return {&pack_block<W>...};
+}
+
+template <int... W>
+constexpr std::array<pack_kernel, 33>
+unpack_kernels(std::integer_sequence<int, W...>) {
+	return {&unpack_block<W>...};
+}
+
+// by width
+constexpr std::array<pack_kernel, 33> PACK =
+	pack_kernels(std::make_integer_sequence<int, 33>());
+constexpr std::array<pack_kernel, 33> UNPACK =
+	unpack_kernels(std::make_integer_sequence<int, 33>());
+
+// zigzag deltas of a block to the item before each, base for the first
+void delta_block(const plist_size_t *values, plist_size_t base,
+				 plist_size_t *deltas) {
+	deltas[0] = values[0] - base;
+	for (int i = 1; i < PLIST_PACK_BLOCK; ++i) {
+		deltas[i] = values[i] - values[i - 1];
+	}
+	for (int i = 0; i < PLIST_PACK_BLOCK; ++i) {
+		deltas[i] = (deltas[i] << 1) ^ (plist_size_t)((int32_t)deltas[i] >> 31);
+	}
+}
+
+// the inverse, in place. The running sum is the one loop of unpacking that
+// stays scalar.
+void undelta_block(plist_size_t *values, plist_size_t base) {
+	for (int i = 0; i < PLIST_PACK_BLOCK; ++i) {
+		values[i] = (values[i] >> 1) ^ -(values[i] & 1);
+	}
+	values[0] += base;
+	for (int i = 1; i < PLIST_PACK_BLOCK; ++i) {
+		values[i] += values[i - 1];
+	}
+}
+
+// Bit pack blocks of PLIST_PACK_BLOCK items, see plist.h
+void pack_values(const plist_size_t *values, size_t num_values,
+				 std::vector<plist_size_t> &out) {
+	for (size_t start = 0; start < num_values; start += PLIST_PACK_BLOCK) {
+		size_t n = std::min<size_t>(PLIST_PACK_BLOCK, num_values - start);
+		plist_size_t base = start == 0 ? 0 : values[start - 1];
+		// a partial block is padded with deltas of zero
+		plist_size_t block[PLIST_PACK_BLOCK] = {};
+		std::copy(values + start, values + start + n, block);
+		plist_size_t deltas[PLIST_PACK_BLOCK];
+		delta_block(block, base, deltas);
+		std::fill(deltas + n, deltas + PLIST_PACK_BLOCK, 0);
+		plist_size_t bits = 0;
+		for (int i = 0; i < PLIST_PACK_BLOCK; ++i) {
+			bits |= deltas[i];
 		}
+		plist_size_t width = bits == 0 ? 0 : 32 - __builtin_clz(bits);
+		out.push_back(width);
+		out.push_back(base);
+		size_t block_start = out.size();
+		out.resize(block_start + PLIST_PACK_LANES * width, 0);
+		PACK[width](deltas, out.data() + block_start);
 	}
+}
 
-	data_ = {};
-	// the actual posting lists must have size_t, plist_size_t is just for
-	// counts etc. and usually can be 4 bytes
+} // namespace
 
-	for (plist_size_t count : count_array) {
-		std::vector<plist_size_t> posting_list;
-		for (plist_size_t i = 0; i < count; ++i) {
-			posting_list.push_back(
-				*reinterpret_cast<const plist_size_t *>(data.data() + cursor));
-			cursor += sizeof(plist_size_t);
+// words before the items: header, bit array and counts
+static size_t head_words(size_t num_lists, size_t num_counts) {
+	return 2 + (num_lists + 31) / 32 + num_counts;
+}
+
+PListChunk::PListChunk(const std::vector<std::vector<plist_size_t>> &data) {
+	std::vector<plist_size_t> sizes;
+	sizes.reserve(data.size());
+	std::vector<plist_size_t> values;
+	for (const std::vector<plist_size_t> &posting_list : data) {
+		sizes.push_back(posting_list.size());
+		values.insert(values.end(), posting_list.begin(), posting_list.end());
+	}
+	build(sizes, values.data(), values.size());
+}
+
+PListChunk::PListChunk(const std::string &compressed_data)
+	: PListChunk(compressed_data.data(), compressed_data.size()) {}
+
+PListChunk::PListChunk(const char *compressed_data, size_t compressed_size,
+					   const Compressor &compressor) {
+	size_t size =
+		compressor.decompressed_size(compressed_data, compressed_size);
+	buffer_.resize((size + sizeof(plist_size_t) - 1) / sizeof(plist_size_t));
+	size = compressor.decompress_into(compressed_data, compressed_size,
+									  reinterpret_cast<char *>(buffer_.data()),
+									  buffer_.size() * sizeof(plist_size_t));
+
+	plist_size_t last;
+	memcpy(&last, reinterpret_cast<char *>(buffer_.data()) + size -
+					  sizeof(plist_size_t),
+		   sizeof(plist_size_t));
+	if (size % sizeof(plist_size_t) == 0 && last == PLIST_V2_MAGIC) {
+		index();
+		locate();
+	} else if (size % sizeof(plist_size_t) == 0 && last == PLIST_PACKED_MAGIC) {
+		std::vector<plist_size_t> words = std::move(buffer_);
+		words.resize(size / sizeof(plist_size_t));
+		unpack(std::move(words));
+	} else if (size % sizeof(plist_size_t) == 0 &&
+			   last == PLIST_ROARING_MAGIC) {
+		std::vector<plist_size_t> words = std::move(buffer_);
+		unroar(words.data(), size / sizeof(plist_size_t));
+	} else {
+		// version 1 needs converting, from a copy since buffer_ gets rebuilt
+		std::string data(reinterpret_cast<char *>(buffer_.data()), size);
+		convert_v1(data.data(), data.size());
+	}
+}
+
+void PListChunk::build(const std::vector<plist_size_t> &sizes,
+					   const plist_size_t *values, size_t num_values) {
+	size_t num_lists = sizes.size();
+	size_t num_counts = 0;
+	for (plist_size_t size : sizes) {
+		if (size != 1) {
+			num_counts++;
 		}
-		data_.push_back(posting_list);
 	}
-};
+	buffer_.assign(head_words(num_lists, num_counts) + num_values + 1, 0);
+	buffer_[0] = num_lists;
+	buffer_[1] = num_counts;
+	index();
 
-std::string PListChunk::serialize() {
-	// Calculate the size of the serialized data
-	size_t bit_array_size = (data_.size() + 7) / 8;
-	size_t count_array_size = 0;
-	for (const std::vector<plist_size_t> &posting_list : data_) {
-		if (posting_list.size() > 1) {
-			count_array_size += sizeof(plist_size_t);
+	plist_size_t count_index = 0;
+	for (size_t i = 0; i < num_lists; ++i) {
+		if (sizes[i] != 1) {
+			buffer_[bits_ + i / 32] |= 1u << (i % 32);
+			buffer_[counts_ + count_index++] = sizes[i];
 		}
 	}
-	size_t posting_lists_size = 0;
-	for (const std::vector<plist_size_t> &posting_list : data_) {
-		posting_lists_size += posting_list.size() * sizeof(plist_size_t);
+	std::copy(values, values + num_values, buffer_.begin() + values_);
+	buffer_.back() = PLIST_V2_MAGIC;
+	locate();
+}
+
+void PListChunk::index() {
+	size_t num_lists = buffer_[0];
+	bits_ = 2;
+	counts_ = bits_ + (num_lists + 31) / 32;
+	values_ = head_words(num_lists, buffer_[1]);
+	assert(values_ < buffer_.size());
+}
+
+void PListChunk::locate() {
+	// the size of every list, one unless it has a count, then their
+	// exclusive prefix sum in place
+	size_t num_lists = size();
+	offsets_.assign(num_lists + 1, 1);
+	size_t count_index = 0;
+	for (size_t word = 0; word * 32 < num_lists; ++word) {
+		for (plist_size_t bits = buffer_[bits_ + word]; bits != 0;
+			 bits &= bits - 1) {
+			offsets_[word * 32 + __builtin_ctz(bits)] =
+				buffer_[counts_ + count_index++];
+		}
 	}
-	size_t size = bit_array_size + count_array_size + posting_lists_size +
-				  sizeof(plist_size_t);
+	plist_size_t value_offset = 0;
+	for (plist_size_t &offset : offsets_) {
+		plist_size_t list_size = offset;
+		offset = value_offset;
+		value_offset += list_size;
+	}
+	assert(count_index == buffer_[1] &&
+		   values_ + offsets_.back() + 1 == buffer_.size());
+}
 
-	// Allocate the serialized data
-	std::string serialized(size, '\0');
+void PListChunk::convert_v1(const char *data, size_t size) {
+	// reinterpret the last 4 bytes of data as the number of posting lists
+	plist_size_t num_posting_lists;
+	memcpy(&num_posting_lists, data + size - sizeof(plist_size_t),
+		   sizeof(plist_size_t));
 
-	// Write the bit array
-	plist_size_t num_posting_lists = data_.size();
+	// Read the bit array and the count array, lists without a count have
+	// one item
+	plist_size_t cursor = (num_posting_lists + 7) / 8;
+	std::vector<plist_size_t> sizes(num_posting_lists, 1);
 	for (plist_size_t i = 0; i < num_posting_lists; ++i) {
-		if (data_[i].size() > 1) {
-			serialized[i / 8] |= (1 << (i % 8));
+		if (data[i / 8] & (1 << (i % 8))) {
+			memcpy(&sizes[i], data + cursor, sizeof(plist_size_t));
+			cursor += sizeof(plist_size_t);
 		}
 	}
 
-	plist_size_t cursor = (num_posting_lists + 7) / 8;
+	// the posting lists are already laid out back to back
+	size_t num_values =
+		(size - sizeof(plist_size_t) - cursor) / sizeof(plist_size_t);
+	std::vector<plist_size_t> values(num_values);
+	memcpy(values.data(), data + cursor, num_values * sizeof(plist_size_t));
 
-	// Write the count array
-	for (const std::vector<plist_size_t> &posting_list : data_) {
-		if (posting_list.size() > 1) {
-			*reinterpret_cast<plist_size_t *>(serialized.data() + cursor) =
-				posting_list.size();
-			cursor += sizeof(plist_size_t);
+	// empty lists were written like single item ones, don't let them run
+	// past the values
+	size_t total = 0;
+	for (plist_size_t &list_size : sizes) {
+		list_size = std::min<size_t>(list_size, num_values - total);
+		total += list_size;
+	}
+	build(sizes, values.data(), num_values);
+}
+
+void PListChunk::unpack(std::vector<plist_size_t> words) {
+	// everything up to the items is the same as version 2, then the number
+	// of items
+	size_t head = head_words(words[0], words[1]);
+	assert(head < words.size());
+	size_t num_values = words[head];
+
+	buffer_.resize(head + num_values + 1);
+	std::copy(words.begin(), words.begin() + head, buffer_.begin());
+	buffer_.back() = PLIST_V2_MAGIC;
+	index();
+	locate();
+
+	// the blocks stay packed until a lookup needs them
+	size_t num_blocks = (num_values + PLIST_PACK_BLOCK - 1) / PLIST_PACK_BLOCK;
+	blocks_.resize(num_blocks);
+	size_t cursor = head + 1;
+	for (size_t block = 0; block < num_blocks; ++block) {
+		assert(cursor + 2 <= words.size() - 1 && words[cursor] <= 32);
+		blocks_[block] = cursor;
+		cursor += 2 + PLIST_PACK_LANES * words[cursor];
+	}
+	assert(cursor + 1 == words.size());
+	packed_ = std::move(words);
+	unpacked_ = std::make_unique<std::atomic<uint8_t>[]>(num_blocks);
+}
+
+void PListChunk::unpack_blocks(size_t first, size_t last) const {
+	enum : uint8_t { PACKED, UNPACKING, UNPACKED };
+	if (!unpacked_) {
+		return;
+	}
+	size_t num_values = offsets_.back();
+	// lookups of a chunk in a cache may come from several threads, the one
+	// that claims a block unpacks it into its own items and the others wait
+	plist_size_t *values =
+		const_cast<plist_size_t *>(buffer_.data()) + values_;
+	for (size_t block = first; block < last; ++block) {
+		std::atomic<uint8_t> &state = unpacked_[block];
+		if (state.load(std::memory_order_acquire) == UNPACKED) {
+			continue;
 		}
+		uint8_t expected = PACKED;
+		if (!state.compare_exchange_strong(expected, UNPACKING,
+										   std::memory_order_acq_rel)) {
+			while (state.load(std::memory_order_acquire) != UNPACKED) {
+				std::this_thread::yield();
+			}
+			continue;
+		}
+		const plist_size_t *words = packed_.data() + blocks_[block];
+		size_t start = block * PLIST_PACK_BLOCK;
+		size_t n = std::min<size_t>(PLIST_PACK_BLOCK, num_values - start);
+		plist_size_t deltas[PLIST_PACK_BLOCK];
+		UNPACK[words[0]](words + 2, deltas);
+		undelta_block(deltas, words[1]);
+		std::copy(deltas, deltas + n, values + start);
+		state.store(UNPACKED, std::memory_order_release);
 	}
+}
 
-	// Write the actual posting lists
-	for (const std::vector<plist_size_t> &posting_list : data_) {
-		for (plist_size_t item : posting_list) {
-			*reinterpret_cast<plist_size_t *>(serialized.data() + cursor) =
-				item;
-			cursor += sizeof(plist_size_t);
+void PListChunk::unroar(const plist_size_t *words, size_t num_words) {
+	size_t head = head_words(words[0], words[1]);
+	assert(head < num_words);
+	size_t num_values = words[head];
+
+	buffer_.resize(head + num_values + 1);
+	std::copy(words, words + head, buffer_.begin());
+	buffer_.back() = PLIST_V2_MAGIC;
+	index();
+	locate();
+
+	const plist_size_t *cursor = words + head + 1;
+	const plist_size_t *end = words + num_words - 1;
+	plist_size_t *values = buffer_.data() + values_;
+	plist_size_t *values_end = values + num_values;
+	size_t count_index = 0;
+	for (size_t i = 0; i < size(); ++i) {
+		if (!has_count(i)) {
+			assert(cursor < end && values < values_end);
+			*values++ = *cursor++;
+			continue;
+		}
+		size_t list_size = buffer_[counts_ + count_index++];
+		if (list_size == 0) {
+			continue;
+		}
+		const char *bytes = reinterpret_cast<const char *>(cursor);
+		size_t max_bytes = (end - cursor) * sizeof(plist_size_t);
+		size_t bitmap_bytes =
+			roaring::api::roaring_bitmap_portable_deserialize_size(bytes,
+																   max_bytes);
+		assert(bitmap_bytes > 0);
+		roaring::Roaring bitmap = roaring::Roaring::readSafe(bytes, max_bytes);
+		assert(bitmap.cardinality() == list_size &&
+			   values + list_size <= values_end);
+		bitmap.toUint32Array(values);
+		values += list_size;
+		cursor += (bitmap_bytes + sizeof(plist_size_t) - 1) /
+				  sizeof(plist_size_t);
+	}
+	assert(cursor == end && values == values_end);
+}
+
+plist_span PListChunk::lookup(size_t key) const {
+	assert(key < size());
+	if (offsets_[key + 1] > offsets_[key]) {
+		unpack_blocks(offsets_[key] / PLIST_PACK_BLOCK,
+					  (offsets_[key + 1] - 1) / PLIST_PACK_BLOCK + 1);
+	}
+	return plist_span(buffer_.data() + values_ + offsets_[key],
+					  offsets_[key + 1] - offsets_[key]);
+}
+
+std::string PListChunk::serialize(const Compressor &compressor,
+								  PListEncoding encoding) const {
+	std::string serialized = encode(encoding);
+	return compressor.compress(serialized.data(), serialized.size());
+}
+
+std::string PListChunk::encode(PListEncoding encoding) const {
+	unpack_blocks(0, blocks_.size());
+	if (encoding == PListEncoding::RAW) {
+		return std::string(reinterpret_cast<const char *>(buffer_.data()),
+						   buffer_.size() * sizeof(plist_size_t));
+	}
+	size_t num_values = buffer_.size() - values_ - 1;
+	std::vector<plist_size_t> words(buffer_.begin(),
+									buffer_.begin() + values_);
+	words.push_back(num_values);
+	if (encoding == PListEncoding::ROARING && roar(words)) {
+		words.push_back(PLIST_ROARING_MAGIC);
+	} else {
+		words.resize(values_ + 1);
+		pack_values(buffer_.data() + values_, num_values, words);
+		words.push_back(PLIST_PACKED_MAGIC);
+	}
+	return std::string(reinterpret_cast<const char *>(words.data()),
+					   words.size() * sizeof(plist_size_t));
+}
+
+bool PListChunk::roar(std::vector<plist_size_t> &words) const {
+	const plist_size_t *values = buffer_.data() + values_;
+	size_t count_index = 0;
+	for (size_t i = 0; i < size(); ++i) {
+		if (!has_count(i)) {
+			words.push_back(*values++);
+			continue;
+		}
+		size_t list_size = buffer_[counts_ + count_index++];
+		const plist_size_t *list = values;
+		values += list_size;
+		if (list_size == 0) {
+			continue;
 		}
+		if (std::adjacent_find(list, list + list_size,
+							   std::greater_equal<plist_size_t>()) !=
+			list + list_size) {
+			return false;
+		}
+		roaring::Roaring bitmap;
+		bitmap.addMany(list_size, list);
+		bitmap.runOptimize();
+		size_t start = words.size();
+		words.resize(start + (bitmap.getSizeInBytes() + sizeof(plist_size_t) -
+							  1) / sizeof(plist_size_t),
+					 0);
+		bitmap.write(reinterpret_cast<char *>(words.data() + start));
 	}
+	return true;
+}
 
-	// Write the number of posting lists
-	*reinterpret_cast<plist_size_t *>(serialized.data() + cursor) =
-		num_posting_lists;
+std::vector<std::vector<plist_size_t>> PListChunk::to_vectors() const {
+	std::vector<std::vector<plist_size_t>> data;
+	data.reserve(size());
+	for (size_t i = 0; i < size(); ++i) {
+		plist_span posting_list = lookup(i);
+		data.emplace_back(posting_list.begin(), posting_list.end());
+	}
+	return data;
+}
 
-	std::string compressed_result =
-		compressor_.compress(serialized.data(), serialized.size());
-	return compressed_result;
-}
\ No newline at end of file
+size_t PListChunk::byte_size() const {
+	return sizeof(PListChunk) +
+		   (buffer_.size() + offsets_.size() + packed_.size()) *
+			   sizeof(plist_size_t) +
+		   blocks_.size() * (sizeof(size_t) + 1);
+}
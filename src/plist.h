@@ -3,44 +3,161 @@ This contains the posting list class, a class that stores a list of sorted
 lists, where the first element in those lists is also sorted. The class contains
 serialization, deserialization and lookup methods.
 
-The layout of the serialized data chunk:
-- bit array indicating whether or not each posting list has more than one item
-- count array indicating the number of items in each posting list with more than
-one item
+The layout of the serialized data chunk, version 2, in 4 byte words:
+- the number of posting lists N and the number of counts
+- bit array indicating whether or not each posting list has other than one item
+- count array indicating the number of items in each of those posting lists
 - all the posting lists concatenated together
-- 8 bytes denoting the number of posting lists
+- PLIST_V2_MAGIC
+
+The packed variant ends with PLIST_PACKED_MAGIC instead and stores the items
+as the number of items followed by blocks of PLIST_PACK_BLOCK items. A block
+is the bit width of its largest delta, the item before the block, then the
+zigzag deltas between consecutive items bit packed at that width in
+PLIST_PACK_LANES interleaved lanes, item i in lane i % PLIST_PACK_LANES. Every
+block decodes on its own, and unpacks PLIST_PACK_LANES items at a time. Sorted
+lists pack to a few bits an item and unpack far faster than zstd inflates
+them, so they are usually stored with CompressionAlgorithm::NONE.
+
+The roaring variant ends with PLIST_ROARING_MAGIC. After the number of items
+every list in order is either its one item, when it has no count, or a portable
+roaring bitmap padded to a word. It only holds strictly increasing lists, a
+chunk with any other is encoded packed instead.
+
+Version 1, still read, has no header or magic: the bit array marks
+lists with more than one item, it is not padded to a word and the chunk ends
+with N.
 */
 #pragma once
 #include "compressor.h"
+#include <algorithm>
+#include <array>
+#include <atomic>
 #include <cassert>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <utility>
 #include <vector>
+
+#include "roaring.hh"
 typedef uint32_t plist_size_t;
 
+// ends a version 2 chunk, a version 1 chunk would need this many lists
+#define PLIST_V2_MAGIC 0xFFFFFFFFu
+#define PLIST_PACKED_MAGIC 0xFFFFFFFEu
+#define PLIST_PACK_BLOCK 128 // items per bit width
+#define PLIST_PACK_LANES 4 // interleaved in a packed block
+#define PLIST_ROARING_MAGIC 0xFFFFFFFDu
+
+// how serialize() lays out the items of a chunk, readers tell from the magic
+enum class PListEncoding { RAW, PACKED, ROARING };
+
+// A read-only view of one posting list inside a PListChunk, valid as long as
+// the chunk is. This is std::span<const plist_size_t> until we are on C++20.
+class plist_span {
+  public:
+	plist_span(const plist_size_t *data, size_t size)
+		: data_(data), size_(size) {}
+
+	const plist_size_t *begin() const { return data_; }
+	const plist_size_t *end() const { return data_ + size_; }
+	const plist_size_t *data() const { return data_; }
+	size_t size() const { return size_; }
+	bool empty() const { return size_ == 0; }
+	plist_size_t operator[](size_t i) const { return data_[i]; }
+
+	// the list as a set, to union and intersect with other results
+	roaring::Roaring bitmap() const {
+		roaring::Roaring bitmap;
+		bitmap.addMany(size_, data_);
+		return bitmap;
+	}
+
+	bool operator==(const std::vector<plist_size_t> &other) const {
+		return size_ == other.size() && std::equal(begin(), end(), other.begin());
+	}
+
+  private:
+	const plist_size_t *data_;
+	size_t size_;
+};
+
+/*
+In memory a chunk is its uncompressed version 2 layout, decompressed straight
+into one buffer, and the item offset of every list. Those are summed up from
+the counts once when the chunk is decoded, so lookup() is two loads. A packed
+chunk keeps its blocks
+and unpacks the ones a lookup() lands in on first use, so a search only
+decodes the lists of the lines that matched.
+*/
 class PListChunk {
   public:
-	// move constructor
-	PListChunk(std::vector<std::vector<plist_size_t>> &&data)
-		: data_(std::move(data)), compressor_(CompressionAlgorithm::ZSTD) {}
-    
-    // 
-    PListChunk(const std::vector<std::vector<plist_size_t>> &data)
-		: data_(data), compressor_(CompressionAlgorithm::ZSTD) {}
+	PListChunk(const std::vector<std::vector<plist_size_t>> &data);
 
 	// Constructor method from a compressed string
 	PListChunk(const std::string &data);
 
+	// Constructor method from a compressed buffer, e.g. a view into a mapping,
+	// with the compressor (codec and dictionary) it was serialized with
+	PListChunk(const char *data, size_t size,
+			   const Compressor &compressor =
+				   Compressor(CompressionAlgorithm::ZSTD));
+
 	// Serialize the data
-	std::string serialize();
+	std::string serialize(const Compressor &compressor =
+							  Compressor(CompressionAlgorithm::ZSTD),
+						  PListEncoding encoding = PListEncoding::RAW) const;
 
-	std::vector<std::vector<plist_size_t>> &data() { return data_; }
+	// the uncompressed layout, e.g. as a sample to train a dictionary on
+	std::string encode(PListEncoding encoding = PListEncoding::RAW) const;
 
-	// return a copy
-	std::vector<plist_size_t> lookup(size_t key) {
-		assert(data_[key].size() > 0);
-		return data_[key];
-	}
+	// number of posting lists
+	size_t size() const { return buffer_[0]; }
+
+	plist_span lookup(size_t key) const;
+
+	// a copy of every posting list, for tools and tests
+	std::vector<std::vector<plist_size_t>> to_vectors() const;
+
+	// roughly how much memory the decoded lists take up
+	size_t byte_size() const;
 
   private:
-	std::vector<std::vector<plist_size_t>> data_;
-	Compressor compressor_;
-};
\ No newline at end of file
+	std::vector<plist_size_t> buffer_;
+	// where the sections start in buffer_
+	size_t bits_ = 0;
+	size_t counts_ = 0;
+	size_t values_ = 0;
+	// where every list starts among the items, then the number of items
+	std::vector<plist_size_t> offsets_;
+	// a packed chunk as it came, where each of its blocks starts in it, and
+	// whether a block is unpacked into the items yet
+	std::vector<plist_size_t> packed_;
+	std::vector<size_t> blocks_;
+	std::unique_ptr<std::atomic<uint8_t>[]> unpacked_;
+
+	// lay out the lists given as per-list sizes and their concatenation
+	void build(const std::vector<plist_size_t> &sizes,
+			   const plist_size_t *values, size_t num_values);
+	// find the sections of a version 2 buffer
+	void index();
+	// fill offsets_ from the bit array and counts
+	void locate();
+	// convert a version 1 chunk of size bytes
+	void convert_v1(const char *data, size_t size);
+	// take in a packed chunk, without unpacking any items yet
+	void unpack(std::vector<plist_size_t> words);
+	// unpack the blocks from first up to last if they aren't already
+	void unpack_blocks(size_t first, size_t last) const;
+	// read back the bitmaps of a roaring chunk of num_words words
+	void unroar(const plist_size_t *words, size_t num_words);
+	// append the lists as a roaring chunk does, false if one isn't strictly
+	// increasing
+	bool roar(std::vector<plist_size_t> &words) const;
+
+	bool has_count(size_t key) const {
+		return buffer_[bits_ + key / 32] & (1u << (key % 32));
+	}
+};
@@ -0,0 +1,129 @@
+#include "plist.h"
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+/*
+Compares posting list encodings and codecs on compacted lineno files, e.g.
+test/data/compacted_type_1_lineno. Every line is one posting list and every
+block_lines lines one chunk, like write_oahu groups them.
+
+./plist_bench <lineno_file>... [--block-lines N] [--rounds N]
+*/
+
+struct Variant {
+	std::string name;
+	PListEncoding encoding;
+	Codec codec;
+};
+
+long elapsed_us(std::chrono::steady_clock::time_point start) {
+	return std::chrono::duration_cast<std::chrono::microseconds>(
+			   std::chrono::steady_clock::now() - start)
+		.count();
+}
+
+int main(int argc, char *argv[]) {
+
+	std::vector<std::string> files;
+	size_t block_lines = 5000;
+	size_t rounds = 5;
+	for (int i = 1; i < argc; i++) {
+		std::string arg = argv[i];
+		if (arg == "--block-lines" && i + 1 < argc) {
+			block_lines = std::stoul(argv[++i]);
+		} else if (arg == "--rounds" && i + 1 < argc) {
+			rounds = std::stoul(argv[++i]);
+		} else {
+			files.push_back(arg);
+		}
+	}
+	if (files.empty()) {
+		std::cerr << "usage: ./plist_bench <lineno_file>... [--block-lines N] "
+					 "[--rounds N]"
+				  << std::endl;
+		return 1;
+	}
+
+	std::vector<PListChunk> chunks;
+	size_t num_values = 0;
+	for (const std::string &file : files) {
+		std::ifstream in(file);
+		if (!in) {
+			std::cerr << "can't open " << file << std::endl;
+			return 1;
+		}
+		std::vector<std::vector<plist_size_t>> lists;
+		std::string line;
+		while (std::getline(in, line)) {
+			std::istringstream iss(line);
+			std::vector<plist_size_t> list;
+			plist_size_t lineno;
+			while (iss >> lineno) {
+				list.push_back(lineno);
+			}
+			num_values += list.size();
+			lists.push_back(std::move(list));
+			if (lists.size() == block_lines) {
+				chunks.emplace_back(lists);
+				lists.clear();
+			}
+		}
+		if (!lists.empty()) {
+			chunks.emplace_back(lists);
+		}
+	}
+	printf("%zu chunks, %zu items\n", chunks.size(), num_values);
+
+	std::vector<Variant> variants = {
+		{"raw+zstd", PListEncoding::RAW, Codec{CompressionAlgorithm::ZSTD}},
+		{"raw+lz4", PListEncoding::RAW, Codec{CompressionAlgorithm::LZ4}},
+		{"packed+none", PListEncoding::PACKED,
+		 Codec{CompressionAlgorithm::NONE}},
+		{"packed+zstd", PListEncoding::PACKED,
+		 Codec{CompressionAlgorithm::ZSTD}},
+		{"packed+lz4", PListEncoding::PACKED, Codec{CompressionAlgorithm::LZ4}},
+		{"roaring+none", PListEncoding::ROARING,
+		 Codec{CompressionAlgorithm::NONE}},
+		{"roaring+zstd", PListEncoding::ROARING,
+		 Codec{CompressionAlgorithm::ZSTD}},
+	};
+
+	printf("%-13s %12s %10s %12s %12s\n", "variant", "bytes", "bits/item",
+		   "decode ms", "Mitems/s");
+	for (const Variant &variant : variants) {
+		Compressor compressor(variant.codec);
+		std::vector<std::string> serialized;
+		size_t bytes = 0;
+		for (const PListChunk &chunk : chunks) {
+			serialized.push_back(
+				chunk.serialize(compressor, variant.encoding));
+			bytes += serialized.back().size();
+		}
+
+		// best of rounds, touching every list so the decode can't be skipped
+		long best_us = -1;
+		size_t checksum = 0;
+		for (size_t round = 0; round < rounds; round++) {
+			auto start = std::chrono::steady_clock::now();
+			for (const std::string &data : serialized) {
+				PListChunk chunk(data.data(), data.size(), compressor);
+				for (size_t i = 0; i < chunk.size(); i++) {
+					plist_span list = chunk.lookup(i);
+					checksum += list.empty() ? 0 : list[list.size() - 1];
+				}
+			}
+			long us = elapsed_us(start);
+			best_us = best_us < 0 ? us : std::min(best_us, us);
+		}
+		printf("%-13s %12zu %10.2f %12.2f %12.1f\n", variant.name.c_str(),
+			   bytes, num_values ? 8.0 * bytes / num_values : 0.0,
+			   best_us / 1000.0,
+			   best_us > 0 ? (double)num_values / best_us : 0.0);
+		if (checksum == 0 && num_values > 0) {
+			printf("  (empty checksum)\n");
+		}
+	}
+	return 0;
+}
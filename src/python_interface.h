@@ -1,4 +1,6 @@
 #pragma once
+#include <cstring>
+#include <string>
 #include <vector>
 
 typedef struct {
@@ -15,4 +17,54 @@ inline Vector pack_vector(std::vector<size_t> v) {
 		result.data[i] = v[i];
 	}
 	return result;
-}
\ No newline at end of file
+}
+
+typedef struct {
+	char *data;
+	size_t size;
+} Bytes;
+
+typedef struct {
+	Vector results;
+	char *stats; // IOStats of the query as JSON
+	char *error; // NULL unless the search failed, results are empty then
+	Bytes row_groups; // results as a portable roaring bitmap, empty for -1
+} SearchResult;
+
+inline char *pack_string(std::string s) {
+	char *result = (char *)malloc(s.size() + 1);
+	memcpy(result, s.c_str(), s.size() + 1);
+	return result;
+}
+
+inline Bytes pack_bytes(std::string s) {
+	Bytes result;
+	result.size = s.size();
+	result.data = (char *)malloc(s.size());
+	memcpy(result.data, s.data(), s.size());
+	return result;
+}
+
+inline SearchResult pack_search_result(std::vector<size_t> v, std::string stats,
+									   std::string row_groups = "") {
+	SearchResult result;
+	result.results = pack_vector(v);
+	result.stats = pack_string(stats);
+	result.error = NULL;
+	result.row_groups = pack_bytes(row_groups);
+	return result;
+}
+
+inline SearchResult pack_search_error(std::string stats, std::string error) {
+	SearchResult result = pack_search_result({}, stats);
+	result.error = pack_string(error);
+	return result;
+}
+
+// everything pack_search_result allocated
+inline void free_search_result(SearchResult result) {
+	free(result.results.data);
+	free(result.stats);
+	free(result.error);
+	free(result.row_groups.data);
+}
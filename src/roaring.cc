@@ -0,0 +1,3 @@
+// the vendored CRoaring amalgamation, built once for everything that includes
+// roaring.hh
+#include "roaring.c"
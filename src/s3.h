@@ -1,9 +1,23 @@
 #pragma once
 #include <aws/core/Aws.h>
+#include <aws/core/client/DefaultRetryStrategy.h>
+#include <aws/core/utils/stream/PreallocatedStreamBuf.h>
 #include <aws/s3/S3Client.h>
 #include <aws/s3/model/GetObjectRequest.h>
 #include <aws/s3/model/HeadObjectRequest.h>
 
+// iostream over a caller-owned buffer. Returned from a GetObjectRequest's
+// response stream factory, the SDK writes the body straight into the buffer
+// instead of a stringstream that has to be copied out again.
+class BufferStream : public Aws::IOStream {
+	Aws::Utils::Stream::PreallocatedStreamBuf buffer_;
+
+  public:
+	BufferStream(char *data, size_t size)
+		: Aws::IOStream(&buffer_),
+		  buffer_(reinterpret_cast<unsigned char *>(data), size) {}
+};
+
 inline size_t
 get_object_size(const Aws::S3::S3Client &s3_client,
 				Aws::S3::Model::GetObjectRequest &object_request) {
@@ -26,14 +40,16 @@ inline std::vector<char>
 read_byte_range_from_S3(const Aws::S3::S3Client &s3_client,
 						Aws::S3::Model::GetObjectRequest &object_request,
 						size_t start, size_t end) {
-	object_request.SetRange("bytes=" + std::to_string(start) + "-" +
-							std::to_string(end));
-	auto get_object_outcome = s3_client.GetObject(object_request);
+	std::vector<char> buffer(end - start + 1);
+	// a copy, object_request must not keep a factory pointing at buffer
+	Aws::S3::Model::GetObjectRequest request = object_request;
+	request.SetRange("bytes=" + std::to_string(start) + "-" +
+					 std::to_string(end));
+	request.SetResponseStreamFactory([&buffer]() {
+		return Aws::New<BufferStream>("rottnest", buffer.data(), buffer.size());
+	});
+	auto get_object_outcome = s3_client.GetObject(request);
 	assert(get_object_outcome.IsSuccess());
-	auto &retrieved_data =
-		get_object_outcome.GetResultWithOwnership().GetBody();
-	// Create a buffer to hold the data.
-	std::vector<char> buffer(std::istreambuf_iterator<char>(retrieved_data),
-							 {});
+	buffer.resize(get_object_outcome.GetResult().GetContentLength());
 	return buffer;
 }
@@ -0,0 +1,195 @@
+#include "uring.h"
+#include <cerrno>
+#include <cstring>
+#include <deque>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// the kernel reads the submission tail and writes the completion tail
+// concurrently with us
+static unsigned load_acquire(unsigned *p) {
+	return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+static void store_release(unsigned *p, unsigned v) {
+	__atomic_store_n(p, v, __ATOMIC_RELEASE);
+}
+
+IoUring::IoUring(unsigned entries) {
+	io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	int fd = syscall(__NR_io_uring_setup, entries, &params);
+	if (fd < 0) {
+		return;
+	}
+
+	sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	cq_ring_size_ =
+		params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+	sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+	sq_ring_ = mmap(nullptr, sq_ring_size_, PROT_READ | PROT_WRITE,
+					MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	cq_ring_ = mmap(nullptr, cq_ring_size_, PROT_READ | PROT_WRITE,
+					MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+	void *sqes = mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE,
+					  MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (sq_ring_ == MAP_FAILED || cq_ring_ == MAP_FAILED ||
+		sqes == MAP_FAILED) {
+		if (sq_ring_ != MAP_FAILED) {
+			munmap(sq_ring_, sq_ring_size_);
+		}
+		if (cq_ring_ != MAP_FAILED) {
+			munmap(cq_ring_, cq_ring_size_);
+		}
+		if (sqes != MAP_FAILED) {
+			munmap(sqes, sqes_size_);
+		}
+		sq_ring_ = cq_ring_ = nullptr;
+		close(fd);
+		return;
+	}
+	sqes_ = static_cast<io_uring_sqe *>(sqes);
+
+	char *sq = static_cast<char *>(sq_ring_);
+	sq_head_ = reinterpret_cast<unsigned *>(sq + params.sq_off.head);
+	sq_tail_ = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+	sq_mask_ = reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+	sq_array_ = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+	char *cq = static_cast<char *>(cq_ring_);
+	cq_head_ = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+	cq_tail_ = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+	cq_mask_ = reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+	cqes_ = reinterpret_cast<io_uring_cqe *>(cq + params.cq_off.cqes);
+
+	ring_fd_ = fd;
+	entries_ = params.sq_entries;
+}
+
+IoUring::~IoUring() {
+	if (ring_fd_ < 0) {
+		return;
+	}
+	munmap(sqes_, sqes_size_);
+	munmap(cq_ring_, cq_ring_size_);
+	munmap(sq_ring_, sq_ring_size_);
+	close(ring_fd_);
+}
+
+bool IoUring::register_buffers(const std::vector<iovec> &buffers) {
+	return ring_fd_ >= 0 &&
+		   syscall(__NR_io_uring_register, ring_fd_, IORING_REGISTER_BUFFERS,
+				   buffers.data(), buffers.size()) == 0;
+}
+
+void IoUring::push(const UringRead &read, long done, unsigned long user_data) {
+	unsigned tail = *sq_tail_;
+	unsigned index = tail & *sq_mask_;
+	io_uring_sqe *sqe = &sqes_[index];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode =
+		read.buffer_index >= 0 ? IORING_OP_READ_FIXED : IORING_OP_READ;
+	sqe->fd = read.fd;
+	sqe->off = read.offset + done;
+	sqe->addr = reinterpret_cast<unsigned long>(read.buffer + done);
+	sqe->len = read.length - done;
+	if (read.buffer_index >= 0) {
+		sqe->buf_index = read.buffer_index;
+	}
+	sqe->user_data = user_data;
+	sq_array_[index] = index;
+	store_release(sq_tail_, tail + 1);
+}
+
+void IoUring::read(std::vector<UringRead> &reads) {
+	std::vector<long> done(reads.size(), 0);
+	std::vector<bool> finished(reads.size(), false);
+	std::deque<size_t> queue; // reads with bytes left and no request out
+	for (size_t i = 0; i < reads.size(); i++) {
+		reads[i].result = 0;
+		if (reads[i].length > 0) {
+			queue.push_back(i);
+		} else {
+			finished[i] = true;
+		}
+	}
+
+	unsigned in_flight = 0;
+	while (!queue.empty() || in_flight > 0) {
+		while (!queue.empty() && in_flight < entries_) {
+			size_t i = queue.front();
+			queue.pop_front();
+			push(reads[i], done[i], i);
+			in_flight++;
+		}
+
+		// whatever the kernel has not consumed yet, an interrupted enter
+		// may have taken some of it already
+		unsigned to_submit = *sq_tail_ - load_acquire(sq_head_);
+		if (syscall(__NR_io_uring_enter, ring_fd_, to_submit, 1,
+					IORING_ENTER_GETEVENTS, nullptr, 0) < 0) {
+			if (errno == EINTR || errno == EAGAIN || errno == EBUSY) {
+				continue;
+			}
+			int error = errno;
+			for (size_t i = 0; i < reads.size(); i++) {
+				if (!finished[i]) {
+					reads[i].result = -error;
+				}
+			}
+			// the caller frees the buffers once we return, and the ring is
+			// reused by the next batch, so nothing of this one may be left:
+			// take back what the kernel has not consumed and wait out the
+			// rest. Completions are posted even if enter keeps failing.
+			unsigned unsubmitted = *sq_tail_ - load_acquire(sq_head_);
+			store_release(sq_tail_, *sq_tail_ - unsubmitted);
+			in_flight -= unsubmitted;
+			while (true) {
+				unsigned head = *cq_head_;
+				while (head != load_acquire(cq_tail_)) {
+					head++;
+					in_flight--;
+				}
+				store_release(cq_head_, head);
+				if (in_flight == 0) {
+					return;
+				}
+				if (syscall(__NR_io_uring_enter, ring_fd_, 0, 1,
+							IORING_ENTER_GETEVENTS, nullptr, 0) < 0 &&
+					errno != EINTR) {
+					usleep(100);
+				}
+			}
+		}
+
+		unsigned head = *cq_head_;
+		while (head != load_acquire(cq_tail_)) {
+			const io_uring_cqe &cqe = cqes_[head & *cq_mask_];
+			size_t i = cqe.user_data;
+			int res = cqe.res;
+			head++;
+			in_flight--;
+			if (res == -EAGAIN || res == -EINTR) {
+				queue.push_back(i);
+			} else if (res < 0) {
+				reads[i].result = res;
+				finished[i] = true;
+			} else if (res == 0) {
+				// end of file
+				reads[i].result = done[i];
+				finished[i] = true;
+			} else {
+				done[i] += res;
+				long needed =
+					reads[i].needed > 0 ? reads[i].needed : reads[i].length;
+				if (done[i] < needed) {
+					queue.push_back(i);
+				} else {
+					reads[i].result = done[i];
+					finished[i] = true;
+				}
+			}
+		}
+		store_release(cq_head_, head);
+	}
+}
@@ -0,0 +1,60 @@
+#pragma once
+#include <linux/io_uring.h>
+#include <sys/uio.h>
+#include <vector>
+
+// One read of a batch: length bytes at offset of fd into buffer. With
+// buffer_index >= 0 buffer lies in that registered buffer and the read is
+// done with READ_FIXED.
+struct UringRead {
+	int fd;
+	long offset;
+	long length;
+	char *buffer;
+	int buffer_index = -1;
+	// done once this many bytes are in, 0 for length. Lets O_DIRECT reads
+	// rounded up past the end of the file stop there.
+	long needed = 0;
+	long result = 0; // bytes read, short only at end of file, or -errno
+};
+
+// io_uring over the raw syscalls, no liburing needed. One submission and
+// one completion queue, not thread safe, so keep one per thread.
+class IoUring {
+	int ring_fd_ = -1;
+	unsigned entries_ = 0;
+
+	void *sq_ring_ = nullptr;
+	size_t sq_ring_size_ = 0;
+	void *cq_ring_ = nullptr;
+	size_t cq_ring_size_ = 0;
+	io_uring_sqe *sqes_ = nullptr;
+	size_t sqes_size_ = 0;
+
+	unsigned *sq_head_, *sq_tail_, *sq_mask_, *sq_array_;
+	unsigned *cq_head_, *cq_tail_, *cq_mask_;
+	io_uring_cqe *cqes_;
+
+	// queue what is left of read after done bytes, tagged with user_data
+	void push(const UringRead &read, long done, unsigned long user_data);
+
+  public:
+	explicit IoUring(unsigned entries);
+	~IoUring();
+	IoUring(const IoUring &) = delete;
+	IoUring &operator=(const IoUring &) = delete;
+
+	// false if the kernel (or a seccomp filter) does not allow io_uring
+	bool ok() const { return ring_fd_ >= 0; }
+	unsigned entries() const { return entries_; }
+
+	// pin buffers for READ_FIXED, false if the kernel refused, e.g. over
+	// RLIMIT_MEMLOCK
+	bool register_buffers(const std::vector<iovec> &buffers);
+
+	// Fill every read. Up to entries() of them go to the kernel per
+	// io_uring_enter, short reads are resubmitted for the rest. If enter
+	// fails for good the unfinished reads get -errno, and read() returns only
+	// once none of the batch is left in the kernel.
+	void read(std::vector<UringRead> &reads);
+};
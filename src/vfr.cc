@@ -1,7 +1,261 @@
 #include "vfr.h"
+#include "uring.h"
+#include <algorithm>
+#include <condition_variable>
+#include <filesystem>
+#include <fstream>
+#include <random>
+#include <thread>
+#include <fcntl.h>
+#include <glog/logging.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+void VirtualFileRegion::count_request(long bytes, long start_us) {
+	if (stats_) {
+		stats_->record_request(object_id(), bytes, IOStats::now_us() - start_us);
+	}
+}
+
+void read_trailer(VirtualFileRegion *vfr, long offset, void *buffer,
+				  long size) {
+	long start_us = IOStats::now_us();
+	vfr->read_at(offset, buffer, size);
+	if (vfr->stats()) {
+		vfr->stats()->record_read(vfr->object_id(), "footer", size,
+								  IOStats::now_us() - start_us);
+	}
+}
+
+std::string_view VirtualFileRegion::view_or_read(long offset, long length,
+												 std::string &scratch) {
+	std::string_view mapped = view(offset, length);
+	if (mapped.data() != nullptr) {
+		return mapped;
+	}
+	scratch.resize(length);
+	read_at(offset, &scratch[0], length);
+	return std::string_view(scratch.data(), length);
+}
+
+long IOStats::now_us() {
+	return std::chrono::duration_cast<std::chrono::microseconds>(
+			   std::chrono::steady_clock::now().time_since_epoch())
+		.count();
+}
+
+std::string IOStats::file_of(const std::string &object_id) {
+	std::string extension = object_id.substr(object_id.rfind('.') + 1);
+	if (extension == "kauai" || extension == "oahu" || extension == "hawaii") {
+		return extension;
+	}
+	return object_id;
+}
+
+std::string IOStats::structure_of(const std::string &kind) {
+	auto ends_with = [&](const std::string &suffix) {
+		return kind.size() >= suffix.size() &&
+			   kind.compare(kind.size() - suffix.size(), suffix.size(),
+							suffix) == 0;
+	};
+	if (kind == "footer" || kind == "log_idx_offsets" || ends_with("_metadata")) {
+		return "footer";
+	}
+	if (ends_with("_pl")) {
+		return "posting_list";
+	}
+	if (kind.rfind("kauai_", 0) == 0) {
+		return "kauai_section";
+	}
+	return kind;
+}
+
+void IOStats::add(Counter &counter, long bytes, long latency_us) {
+	counter.count++;
+	counter.bytes += bytes;
+	int bucket = 0;
+	while (bucket < IO_LATENCY_BUCKETS - 1 && (latency_us >> (bucket + 1)) > 0) {
+		bucket++;
+	}
+	counter.latency_us[bucket]++;
+}
+
+void IOStats::record_request(const std::string &object_id, long bytes,
+							 long latency_us) {
+	std::lock_guard<std::mutex> lock(mutex_);
+	add(requests_[file_of(object_id)], bytes, latency_us);
+}
+
+void IOStats::record_read(const std::string &object_id, const std::string &kind,
+						  long bytes, long latency_us) {
+	std::lock_guard<std::mutex> lock(mutex_);
+	add(reads_[{file_of(object_id), structure_of(kind)}], bytes, latency_us);
+}
+
+void IOStats::record_hit(const std::string &object_id,
+						 const std::string &kind) {
+	std::lock_guard<std::mutex> lock(mutex_);
+	reads_[{file_of(object_id), structure_of(kind)}].cache_hits++;
+}
+
+IOStats::Counter IOStats::requests() {
+	std::lock_guard<std::mutex> lock(mutex_);
+	Counter total;
+	for (auto &[file, counter] : requests_) {
+		total.count += counter.count;
+		total.bytes += counter.bytes;
+		for (int i = 0; i < IO_LATENCY_BUCKETS; i++) {
+			total.latency_us[i] += counter.latency_us[i];
+		}
+	}
+	return total;
+}
+
+IOStats::Counter IOStats::requests(const std::string &file) {
+	std::lock_guard<std::mutex> lock(mutex_);
+	auto it = requests_.find(file);
+	return it == requests_.end() ? Counter() : it->second;
+}
+
+IOStats::Counter IOStats::reads(const std::string &file,
+								const std::string &structure) {
+	std::lock_guard<std::mutex> lock(mutex_);
+	auto it = reads_.find({file, structure});
+	return it == reads_.end() ? Counter() : it->second;
+}
+
+// {"requests": {file: counter}, "reads": {file: {structure: counter}}} where
+// a counter is {"count", "bytes", "cache_hits", "latency_us": [histogram]}
+// with trailing empty buckets left out
+std::string IOStats::to_json() {
+	auto counter_json = [](const Counter &counter) {
+		int buckets = IO_LATENCY_BUCKETS;
+		while (buckets > 0 && counter.latency_us[buckets - 1] == 0) {
+			buckets--;
+		}
+		std::string histogram = "";
+		for (int i = 0; i < buckets; i++) {
+			histogram += (i ? "," : "") + std::to_string(counter.latency_us[i]);
+		}
+		return "{\"count\":" + std::to_string(counter.count) +
+			   ",\"bytes\":" + std::to_string(counter.bytes) +
+			   ",\"cache_hits\":" + std::to_string(counter.cache_hits) +
+			   ",\"latency_us\":[" + histogram + "]}";
+	};
+
+	std::lock_guard<std::mutex> lock(mutex_);
+	std::string json = "{\"requests\":{";
+	bool first = true;
+	for (auto &[file, counter] : requests_) {
+		json += (first ? "\"" : ",\"") + file + "\":" + counter_json(counter);
+		first = false;
+	}
+	json += "},\"reads\":{";
+	std::string current_file = "";
+	for (auto &[file_structure, counter] : reads_) {
+		auto &[file, structure] = file_structure;
+		if (file != current_file) {
+			json += (current_file.empty() ? "\"" : "},\"") + file + "\":{";
+			current_file = file;
+		} else {
+			json += ",";
+		}
+		json += "\"" + structure + "\":" + counter_json(counter);
+	}
+	json += current_file.empty() ? "}}" : "}}}";
+	return json;
+}
+
+std::vector<ReadRange> coalesce_ranges(std::vector<ReadRange> ranges, long gap,
+									   long max_length) {
+	std::sort(ranges.begin(), ranges.end(),
+			  [](const ReadRange &a, const ReadRange &b) {
+				  return a.offset < b.offset ||
+						 (a.offset == b.offset && a.length > b.length);
+			  });
+	std::vector<ReadRange> merged;
+	for (const ReadRange &range : ranges) {
+		if (!merged.empty()) {
+			ReadRange &last = merged.back();
+			long last_end = last.offset + last.length;
+			long end = std::max(last_end, range.offset + range.length);
+			// contained ranges are always free, anything else has to be
+			// close enough and keep the request bounded
+			if (range.offset + range.length <= last_end ||
+				(range.offset <= last_end + gap &&
+				 end - last.offset <= max_length)) {
+				last.length = end - last.offset;
+				continue;
+			}
+		}
+		merged.push_back(range);
+	}
+	return merged;
+}
+
+// Dedup and merge the ranges so that a batch costs as few requests as
+// possible and issue all of them at once. Each requested range is cut back
+// out of its merged body when its future is waited on.
+std::vector<std::future<std::string>>
+coalesced_read_async(VirtualFileRegion *vfr, const std::vector<ReadRange> &ranges,
+					 long gap, long max_length) {
+	std::vector<ReadRange> merged = coalesce_ranges(ranges, gap, max_length);
+	std::vector<std::shared_future<std::string>> bodies;
+	bodies.reserve(merged.size());
+	for (const ReadRange &range : merged) {
+		bodies.push_back(vfr->read_at_async(range.offset, range.length).share());
+	}
+
+	std::vector<std::future<std::string>> result;
+	result.reserve(ranges.size());
+	for (const ReadRange &range : ranges) {
+		// the last merged range starting at or before this one contains it
+		auto it = std::upper_bound(merged.begin(), merged.end(), range.offset,
+								   [](long offset, const ReadRange &r) {
+									   return offset < r.offset;
+								   });
+		size_t m = std::distance(merged.begin(), it) - 1;
+		long skip = range.offset - merged[m].offset;
+		long length = range.length;
+		result.push_back(std::async(std::launch::deferred,
+									[body = bodies[m], skip, length] {
+										return body.get().substr(skip, length);
+									}));
+	}
+	return result;
+}
+
+std::future<std::string> VirtualFileRegion::read_at_async(long offset,
+														 long length) {
+	return std::async(std::launch::deferred, [this, offset, length] {
+		std::string buffer(length, '\0');
+		read_at(offset, buffer.data(), length);
+		return buffer;
+	});
+}
+
+std::vector<std::future<std::string>>
+VirtualFileRegion::vfreadv_async(const std::vector<ReadRange> &ranges) {
+	std::vector<std::future<std::string>> result;
+	result.reserve(ranges.size());
+	for (const ReadRange &range : ranges) {
+		result.push_back(read_at_async(range.offset, range.length));
+	}
+	return result;
+}
+
+std::vector<std::string>
+VirtualFileRegion::vfreadv(const std::vector<ReadRange> &ranges) {
+	std::vector<std::future<std::string>> futures = vfreadv_async(ranges);
+	std::vector<std::string> result;
+	result.reserve(ranges.size());
+	for (std::future<std::string> &future : futures) {
+		result.push_back(future.get());
+	}
+	return result;
+}
 
-std::atomic<int> VirtualFileRegion::num_reads(0);
-std::atomic<int> VirtualFileRegion::num_bytes_read(0);
 
 DiskVirtualFileRegion::DiskVirtualFileRegion(std::string filename, long start,
 											 long length)
@@ -14,8 +268,7 @@ DiskVirtualFileRegion::DiskVirtualFileRegion(std::string filename, long start,
 		size_ = end_ - start_;
 		fseek(file_, start_, SEEK_SET);
 	} else {
-		std::cout << "Error opening file: " << filename << std::endl;
-		exit(1);
+		throw ReadError("open " + filename + ": " + strerror(errno));
 	}
 }
 
@@ -29,8 +282,7 @@ DiskVirtualFileRegion::DiskVirtualFileRegion(std::string filename)
 		size_ = end_ - start_;
 		fseek(file_, 0, SEEK_SET);
 	} else {
-		std::cout << "Error opening file: " << filename << std::endl;
-		exit(1);
+		throw ReadError("open " + filename + ": " + strerror(errno));
 	}
 }
 
@@ -67,58 +319,917 @@ void DiskVirtualFileRegion::vfread(void *buffer, long size) {
 				  << std::endl;
 		assert(false);
 	}
-	num_reads++;
-	num_bytes_read += size;
-
+	long start_us = IOStats::now_us();
 	if (!fread(buffer, size, 1, file_)) {
 		std::cout << "fread failed, size: " << size
 				  << " current pos: " << ftell(file_) << " end: " << end_
 				  << std::endl;
 		assert(false);
 	}
+	count_request(size, start_us);
+}
+
+void DiskVirtualFileRegion::read_at(long offset, void *buffer, long size) {
+	if (offset < 0 || offset + size > size_) {
+		std::cout << "pread failed, offset: " << offset << " size: " << size
+				  << " region size: " << size_ << std::endl;
+		assert(false);
+	}
+	long start_us = IOStats::now_us();
+
+	// pread may come back short, keep going until the range is filled
+	int fd = fileno(file_);
+	long done = 0;
+	while (done < size) {
+		ssize_t got = pread(fd, static_cast<char *>(buffer) + done, size - done,
+							start_ + offset + done);
+		if (got <= 0) {
+			std::cout << "pread failed, offset: " << offset + done
+					  << " size: " << size - done << std::endl;
+			assert(false);
+			return;
+		}
+		done += got;
+	}
+	count_request(size, start_us);
 }
 
 VirtualFileRegion *DiskVirtualFileRegion::slice(long start, long length) {
 	if (start + length > end_) {
 		assert(false);
 	}
-	return new DiskVirtualFileRegion(filename_, start_ + start, length);
+	VirtualFileRegion *sliced =
+		new DiskVirtualFileRegion(filename_, start_ + start, length);
+	sliced->set_stats(stats_);
+	return sliced;
 }
 
 void DiskVirtualFileRegion::reset() { fseek(file_, start_, SEEK_SET); }
 
-S3VirtualFileRegion::S3VirtualFileRegion(const Aws::S3::S3Client &s3_client,
-										 std::string bucket_name,
-										 std::string object_name,
-										 std::string region)
-	: s3_client_(s3_client), bucket_name_(bucket_name),
-	  object_name_(object_name), region_(region), start_(0), cursor_(0) {
+std::string DiskVirtualFileRegion::object_id() const { return filename_; }
+
+long DiskVirtualFileRegion::object_offset(long offset) const {
+	return start_ + offset;
+}
+
+MappedFile::MappedFile(std::string filename)
+	: filename(filename), data(nullptr), size(0) {
+	int fd = open(filename.c_str(), O_RDONLY);
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st) != 0) {
+		std::string error = strerror(errno);
+		if (fd >= 0) {
+			close(fd);
+		}
+		throw ReadError("open " + filename + ": " + error);
+	}
+	size = st.st_size;
+	// mmap refuses zero-length mappings, an empty file just has no data
+	if (size > 0) {
+		void *addr = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (addr == MAP_FAILED) {
+			std::string error = strerror(errno);
+			close(fd);
+			throw ReadError("map " + filename + ": " + error);
+		}
+		// index lookups jump around the file, don't waste IO on readahead
+		madvise(addr, size, MADV_RANDOM);
+		data = static_cast<const char *>(addr);
+	}
+	close(fd);
+}
+
+MappedFile::~MappedFile() {
+	if (data) {
+		munmap((void *)data, size);
+	}
+}
+
+MmapVirtualFileRegion::MmapVirtualFileRegion(
+	std::shared_ptr<MappedFile> mapping, long start, long length)
+	: mapping_(mapping), start_(start), cursor_(start) {
+	end_ = (start + length <= mapping_->size) ? start + length
+											  : mapping_->size;
+	size_ = end_ - start_;
+}
+
+MmapVirtualFileRegion::MmapVirtualFileRegion(std::string filename)
+	: mapping_(std::make_shared<MappedFile>(filename)), start_(0),
+	  cursor_(0) {
+	end_ = mapping_->size;
+	size_ = end_ - start_;
+}
+
+MmapVirtualFileRegion::~MmapVirtualFileRegion() {}
+
+long MmapVirtualFileRegion::size() const { return size_; }
+
+int MmapVirtualFileRegion::vfseek(long offset, int origin) {
+	switch (origin) {
+	case SEEK_SET:
+		cursor_ = start_ + offset;
+		return 0;
+	case SEEK_CUR:
+		cursor_ += offset;
+		return 0;
+	case SEEK_END:
+		cursor_ = end_ + offset;
+		return 0;
+	default:
+		return -1;
+	}
+}
+
+long MmapVirtualFileRegion::vftell() { return cursor_ - start_; }
+
+void MmapVirtualFileRegion::reset() { cursor_ = start_; }
+
+void MmapVirtualFileRegion::vfread(void *buffer, long size) {
+	if (cursor_ < start_ || cursor_ + size > end_) {
+		std::cout << "mmap read failed, size: " << size
+				  << " current pos: " << cursor_ << " end: " << end_
+				  << std::endl;
+		assert(false);
+	}
+	count_request(size, IOStats::now_us());
+
+	memcpy(buffer, mapping_->data + cursor_, size);
+	cursor_ += size;
+}
+
+void MmapVirtualFileRegion::read_at(long offset, void *buffer, long size) {
+	memcpy(buffer, view(offset, size).data(), size);
+}
+
+std::string_view MmapVirtualFileRegion::view(long offset, long length) {
+	if (offset < 0 || offset + length > size_) {
+		std::cout << "mmap view failed, offset: " << offset
+				  << " length: " << length << " size: " << size_ << std::endl;
+		assert(false);
+	}
+	// the bytes are only faulted in when they are touched, so there is no
+	// latency worth measuring here
+	count_request(length, IOStats::now_us());
+
+	return std::string_view(mapping_->data + start_ + offset, length);
+}
+
+VirtualFileRegion *MmapVirtualFileRegion::slice(long start, long length) {
+	if (start + length > size_) {
+		assert(false);
+	}
+	VirtualFileRegion *sliced =
+		new MmapVirtualFileRegion(mapping_, start_ + start, length);
+	sliced->set_stats(stats_);
+	return sliced;
+}
+
+std::string MmapVirtualFileRegion::object_id() const {
+	return mapping_->filename;
+}
+
+long MmapVirtualFileRegion::object_offset(long offset) const {
+	return start_ + offset;
+}
+
+UringFile::UringFile(std::string filename, bool direct)
+	: filename(filename), direct(direct) {
+	fd = open(filename.c_str(), O_RDONLY | (direct ? O_DIRECT : 0));
+	if (fd < 0 && direct) {
+		// e.g. tmpfs has no O_DIRECT
+		this->direct = false;
+		fd = open(filename.c_str(), O_RDONLY);
+	}
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st) != 0) {
+		std::string error = strerror(errno);
+		if (fd >= 0) {
+			close(fd);
+		}
+		throw ReadError("open " + filename + ": " + error);
+	}
+	size = st.st_size;
+}
+
+UringFile::~UringFile() { close(fd); }
+
+namespace {
+
+// every thread gets its own ring, and for O_DIRECT a bounce buffer that is
+// registered with it
+struct UringThread {
+	IoUring ring{IO_URING_ENTRIES};
+	char *bounce = nullptr;
+	bool registered = false;
 
+	char *bounce_buffer() {
+		if (!bounce) {
+			bounce = static_cast<char *>(
+				aligned_alloc(IO_URING_ALIGN, IO_URING_BOUNCE_BYTES));
+			registered = ring.register_buffers(
+				{{bounce, (size_t)IO_URING_BOUNCE_BYTES}});
+		}
+		return bounce;
+	}
+	~UringThread() { free(bounce); }
+};
+
+UringThread &uring_thread() {
+	static thread_local UringThread thread;
+	return thread;
+}
+
+} // namespace
+
+IoUringVirtualFileRegion::IoUringVirtualFileRegion(
+	std::shared_ptr<UringFile> file, long start, long length)
+	: file_(file), start_(start), cursor_(start) {
+	end_ = (start + length <= file_->size) ? start + length : file_->size;
+	size_ = end_ - start_;
+}
+
+IoUringVirtualFileRegion::IoUringVirtualFileRegion(std::string filename,
+												   bool direct)
+	: file_(std::make_shared<UringFile>(filename, direct)), start_(0),
+	  cursor_(0) {
+	end_ = file_->size;
+	size_ = end_ - start_;
+}
+
+long IoUringVirtualFileRegion::size() const { return size_; }
+
+int IoUringVirtualFileRegion::vfseek(long offset, int origin) {
+	switch (origin) {
+	case SEEK_SET:
+		cursor_ = start_ + offset;
+		return 0;
+	case SEEK_CUR:
+		cursor_ += offset;
+		return 0;
+	case SEEK_END:
+		cursor_ = end_ + offset;
+		return 0;
+	default:
+		return -1;
+	}
+}
+
+long IoUringVirtualFileRegion::vftell() { return cursor_ - start_; }
+
+void IoUringVirtualFileRegion::reset() { cursor_ = start_; }
+
+void IoUringVirtualFileRegion::vfread(void *buffer, long size) {
+	read_at(cursor_ - start_, buffer, size);
+	cursor_ += size;
+}
+
+void IoUringVirtualFileRegion::read_at(long offset, void *buffer, long size) {
+	read_ranges({{offset, size}}, {static_cast<char *>(buffer)});
+}
+
+std::vector<std::future<std::string>>
+IoUringVirtualFileRegion::vfreadv_async(const std::vector<ReadRange> &ranges) {
+	std::vector<std::string> bodies(ranges.size());
+	std::vector<char *> buffers(ranges.size());
+	for (size_t i = 0; i < ranges.size(); i++) {
+		bodies[i].resize(ranges[i].length);
+		buffers[i] = bodies[i].data();
+	}
+	// local reads are done by the time the kernel answers, there is no
+	// point in handing out pending futures
+	read_ranges(ranges, buffers);
+	std::vector<std::future<std::string>> futures;
+	futures.reserve(ranges.size());
+	for (std::string &body : bodies) {
+		futures.push_back(ready_future(std::move(body)));
+	}
+	return futures;
+}
+
+void IoUringVirtualFileRegion::read_ranges(const std::vector<ReadRange> &ranges,
+										   const std::vector<char *> &buffers) {
+	for (const ReadRange &range : ranges) {
+		if (range.offset < 0 || range.offset + range.length > size_) {
+			std::cout << "io_uring read failed, offset: " << range.offset
+					  << " size: " << range.length
+					  << " region size: " << size_ << std::endl;
+			assert(false);
+		}
+	}
+	long start_us = IOStats::now_us();
+
+	UringThread &thread = uring_thread();
+	std::vector<UringRead> reads(ranges.size());
+	// O_DIRECT reads that do not fit in the bounce buffer
+	std::vector<std::unique_ptr<char, decltype(&free)>> overflow;
+	long bounce_used = 0;
+	for (size_t i = 0; i < ranges.size(); i++) {
+		long position = start_ + ranges[i].offset;
+		if (!file_->direct) {
+			reads[i] = {file_->fd, position, ranges[i].length, buffers[i]};
+			continue;
+		}
+		long first = position / IO_URING_ALIGN * IO_URING_ALIGN;
+		long last = (position + ranges[i].length + IO_URING_ALIGN - 1) /
+					IO_URING_ALIGN * IO_URING_ALIGN;
+		char *buffer;
+		int buffer_index = -1;
+		if (bounce_used + last - first <= IO_URING_BOUNCE_BYTES) {
+			buffer = thread.bounce_buffer() + bounce_used;
+			buffer_index = thread.registered ? 0 : -1;
+			bounce_used += last - first;
+		} else {
+			buffer =
+				static_cast<char *>(aligned_alloc(IO_URING_ALIGN, last - first));
+			overflow.emplace_back(buffer, &free);
+		}
+		reads[i] = {file_->fd, first, last - first, buffer, buffer_index,
+					position + ranges[i].length - first};
+	}
+
+	if (thread.ring.ok()) {
+		thread.ring.read(reads);
+	} else {
+		for (UringRead &read : reads) {
+			read.result = 0;
+			long needed = read.needed > 0 ? read.needed : read.length;
+			while (read.result < needed) {
+				ssize_t got = pread(read.fd, read.buffer + read.result,
+									read.length - read.result,
+									read.offset + read.result);
+				if (got <= 0) {
+					read.result = got < 0 ? -errno : read.result;
+					break;
+				}
+				read.result += got;
+			}
+		}
+	}
+
+	for (size_t i = 0; i < ranges.size(); i++) {
+		long skip = start_ + ranges[i].offset - reads[i].offset;
+		if (reads[i].result < skip + ranges[i].length) {
+			throw ReadError(
+				"read " + file_->filename + " at " +
+				std::to_string(start_ + ranges[i].offset) + ": " +
+				(reads[i].result < 0 ? strerror(-reads[i].result) : "short read"));
+		}
+		if (file_->direct) {
+			memcpy(buffers[i], reads[i].buffer + skip, ranges[i].length);
+		}
+		count_request(ranges[i].length, start_us);
+	}
+}
+
+VirtualFileRegion *IoUringVirtualFileRegion::slice(long start, long length) {
+	if (start + length > size_) {
+		assert(false);
+	}
+	VirtualFileRegion *sliced =
+		new IoUringVirtualFileRegion(file_, start_ + start, length);
+	sliced->set_stats(stats_);
+	return sliced;
+}
+
+std::string IoUringVirtualFileRegion::object_id() const {
+	return file_->filename;
+}
+
+long IoUringVirtualFileRegion::object_offset(long offset) const {
+	return start_ + offset;
+}
+
+void LatencyTracker::record(long latency_us) {
+	std::lock_guard<std::mutex> lock(mutex_);
+	if (samples_.size() < S3_LATENCY_SAMPLES) {
+		samples_.push_back(latency_us);
+	} else {
+		samples_[next_] = latency_us;
+	}
+	next_ = (next_ + 1) % S3_LATENCY_SAMPLES;
+}
+
+long LatencyTracker::percentile(double p) {
+	std::vector<long> samples;
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		if (samples_.size() < S3_LATENCY_SAMPLES / 4) {
+			return -1;
+		}
+		samples = samples_;
+	}
+	size_t k = std::min(samples.size() - 1, (size_t)(p * samples.size()));
+	std::nth_element(samples.begin(), samples.begin() + k, samples.end());
+	return samples[k];
+}
+
+namespace {
+
+// Runs callbacks at their deadline on one thread shared by every remote
+// region: hedges, retry backoff and simulated requests. A callback gets false
+// instead when the region it is for closes first.
+class Timers {
+  public:
+	static Timers &instance() {
+		static Timers timers;
+		return timers;
+	}
+
+	void schedule(RemoteRequests *owner, long delay_us,
+				  std::function<void(bool)> callback) {
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			// close() sets closing before it cancels, so nothing slips in
+			// after the cancel
+			if (!owner->closing()) {
+				entries_.emplace(std::chrono::steady_clock::now() +
+									 std::chrono::microseconds(delay_us),
+								 Entry{owner, std::move(callback)});
+				wake_.notify_one();
+				return;
+			}
+		}
+		callback(false);
+	}
+
+	// runs the pending callbacks of owner with false, after waiting for one
+	// of them that is running
+	void cancel(RemoteRequests *owner) {
+		std::vector<Entry> cancelled;
+		{
+			std::unique_lock<std::mutex> lock(mutex_);
+			for (auto it = entries_.begin(); it != entries_.end();) {
+				if (it->second.owner == owner) {
+					cancelled.push_back(std::move(it->second));
+					it = entries_.erase(it);
+				} else {
+					++it;
+				}
+			}
+			if (std::this_thread::get_id() != thread_.get_id()) {
+				ran_.wait(lock, [&] { return running_ != owner; });
+			}
+		}
+		for (Entry &entry : cancelled) {
+			entry.callback(false);
+		}
+	}
+
+  private:
+	struct Entry {
+		RemoteRequests *owner;
+		std::function<void(bool)> callback;
+	};
+
+	std::mutex mutex_;
+	std::condition_variable wake_;
+	std::condition_variable ran_;
+	std::multimap<std::chrono::steady_clock::time_point, Entry> entries_;
+	RemoteRequests *running_ = nullptr;
+	bool stopping_ = false;
+	std::thread thread_;
+
+	Timers() : thread_([this] { run(); }) {}
+
+	~Timers() {
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			stopping_ = true;
+		}
+		wake_.notify_one();
+		thread_.join();
+	}
+
+	void run() {
+		std::unique_lock<std::mutex> lock(mutex_);
+		while (!stopping_) {
+			if (entries_.empty()) {
+				wake_.wait(lock);
+				continue;
+			}
+			auto first = entries_.begin();
+			if (first->first > std::chrono::steady_clock::now()) {
+				wake_.wait_until(lock, first->first);
+				continue;
+			}
+			Entry entry = std::move(first->second);
+			entries_.erase(first);
+			running_ = entry.owner;
+			lock.unlock();
+			entry.callback(true);
+			// what the callback holds goes before its region may finish
+			// closing
+			entry.callback = nullptr;
+			lock.lock();
+			running_ = nullptr;
+			ran_.notify_all();
+		}
+	}
+};
+
+// what came back for one request of a RangeGet
+struct Attempt {
+	bool ok = false;
+	bool retryable = false;
+	std::string error;
+	S3Body body;
+};
+
+// One logical range GET. Its first request, retries and hedges race to
+// settle promise, whoever finds done set leaves everything alone.
+struct RangeGet {
+	// sends one request, which ends in complete() and requests->end() on
+	// whatever thread it comes back on. It holds what the store needs, e.g.
+	// the S3 client, and is dropped once the GET is settled with nothing
+	// out.
+	std::function<void(std::shared_ptr<RangeGet>)> issue;
+	std::shared_ptr<RemoteRequests> requests;
+	std::string name; // for errors
+	// bodies are at most capacity bytes. Each request gets its own, unless
+	// there is a caller's buffer to write into.
+	long capacity;
+	char *buffer = nullptr;
+	S3ReadPolicy policy;
+	std::shared_ptr<LatencyTracker> latencies;
+	long start_us;
+
+	std::mutex mutex;
+	std::promise<S3Body> promise;
+	bool done = false;
+	int failures = 0;
+	int hedges = 0;
+	int in_flight = 0;
+
+	// with mutex held
+	void release_if_idle() {
+		if (done && in_flight == 0) {
+			issue = nullptr;
+		}
+	}
+
+	// settle with a ReadError, with mutex held by lock
+	void fail(std::unique_lock<std::mutex> &lock, const std::string &error) {
+		done = true;
+		release_if_idle();
+		lock.unlock();
+		promise.set_exception(
+			std::make_exception_ptr(ReadError("GET " + name + ": " + error)));
+	}
+};
+
+// exponential backoff with equal jitter, so GETs that failed together do not
+// come back together
+long backoff_us(const S3ReadPolicy &policy, int failures) {
+	static thread_local std::mt19937 rng(
+		std::hash<std::thread::id>{}(std::this_thread::get_id()));
+	long backoff = policy.backoff_us;
+	for (int i = 1; i < failures && backoff < policy.max_backoff_us; i++) {
+		backoff *= 2;
+	}
+	backoff = std::min(backoff, policy.max_backoff_us);
+	return backoff / 2 +
+		   std::uniform_int_distribution<long>(0, backoff / 2)(rng);
+}
+
+// send one request of get, the caller already counted it in in_flight. A
+// closing region sends nothing more.
+void send(std::shared_ptr<RangeGet> get) {
+	// the request is out until it completes, and so is this call while it
+	// holds a copy of issue
+	if (!get->requests->begin(2)) {
+		std::unique_lock<std::mutex> lock(get->mutex);
+		get->in_flight--;
+		if (!get->done && get->in_flight == 0) {
+			get->fail(lock, "region closed");
+		} else {
+			get->release_if_idle();
+		}
+		return;
+	}
+	std::function<void(std::shared_ptr<RangeGet>)> issue;
+	{
+		std::lock_guard<std::mutex> lock(get->mutex);
+		issue = get->issue;
+	}
+	issue(get);
+	issue = nullptr;
+	get->requests->end();
+}
+
+// settle or retry get with what one of its requests sent at sent_us got
+void complete(std::shared_ptr<RangeGet> get, long sent_us, Attempt attempt) {
+	std::unique_lock<std::mutex> lock(get->mutex);
+	get->in_flight--;
+
+	if (attempt.ok) {
+		get->latencies->record(IOStats::now_us() - sent_us);
+		if (get->done) {
+			get->release_if_idle();
+			return;
+		}
+		if (attempt.body.size > get->capacity) {
+			get->fail(lock, std::to_string(attempt.body.size) +
+								" bytes do not fit in " +
+								std::to_string(get->capacity));
+			return;
+		}
+		get->done = true;
+		get->release_if_idle();
+		lock.unlock();
+		get->requests->count(attempt.body.size, get->start_us);
+		get->promise.set_value(std::move(attempt.body));
+		return;
+	}
+
+	// leave the decision to a request that is still racing
+	get->failures++;
+	if (get->done || get->in_flight > 0) {
+		get->release_if_idle();
+		return;
+	}
+	if (attempt.retryable && get->failures < get->policy.max_attempts) {
+		get->in_flight++;
+		long wait_us = backoff_us(get->policy, get->failures);
+		lock.unlock();
+		Timers::instance().schedule(
+			get->requests.get(), wait_us, [get](bool run) {
+				if (run) {
+					send(get);
+					return;
+				}
+				std::unique_lock<std::mutex> lock(get->mutex);
+				get->in_flight--;
+				get->fail(lock, "region closed");
+			});
+		return;
+	}
+	get->fail(lock, attempt.error + " after " +
+						std::to_string(get->failures) + " attempts");
+}
+
+// duplicate get every delay_us until it settles or runs out of hedges
+void hedge_after(std::shared_ptr<RangeGet> get, long delay_us) {
+	Timers::instance().schedule(
+		get->requests.get(), delay_us, [get, delay_us](bool run) {
+			std::unique_lock<std::mutex> lock(get->mutex);
+			if (!run || get->done ||
+				get->hedges >= get->policy.max_hedges) {
+				return;
+			}
+			get->hedges++;
+			get->in_flight++;
+			bool more = get->hedges < get->policy.max_hedges;
+			lock.unlock();
+			send(get);
+			if (more) {
+				hedge_after(get, delay_us);
+			}
+		});
+}
+
+// the delay before hedging a GET, -1 for no hedging. There is none until
+// there are enough latencies to pick a delay from.
+long hedge_delay_us(const S3ReadPolicy &policy, LatencyTracker &latencies) {
+	long delay_us =
+		policy.hedge ? latencies.percentile(policy.hedge_percentile) : -1;
+	if (delay_us < 0 || policy.max_hedges <= 0) {
+		return -1;
+	}
+	return std::max(delay_us, policy.min_hedge_delay_us);
+}
+
+// send the first request of get, and hedges after delay_us unless it is -1
+std::future<S3Body> start(std::shared_ptr<RangeGet> get, long delay_us) {
+	get->start_us = IOStats::now_us();
+	get->in_flight = 1;
+	std::future<S3Body> body = get->promise.get_future();
+	send(get);
+	if (delay_us >= 0) {
+		hedge_after(get, delay_us);
+	}
+	return body;
+}
+
+// one S3 request of get
+void send_s3(const Aws::S3::S3Client &client,
+			 Aws::S3::Model::GetObjectRequest request,
+			 std::shared_ptr<RangeGet> get) {
+	long sent_us = IOStats::now_us();
+	std::shared_ptr<std::string> own;
+	char *target = get->buffer;
+	if (!target) {
+		own = std::make_shared<std::string>(get->capacity, '\0');
+		target = own->data();
+	}
+	long capacity = get->capacity;
+	request.SetResponseStreamFactory([target, capacity]() {
+		return Aws::New<BufferStream>("rottnest", target, capacity);
+	});
+	client.GetObjectAsync(
+		request,
+		[get, own, sent_us](
+			const Aws::S3::S3Client *, const Aws::S3::Model::GetObjectRequest &,
+			Aws::S3::Model::GetObjectOutcome get_object_outcome,
+			const std::shared_ptr<const Aws::Client::AsyncCallerContext> &) {
+			Attempt attempt;
+			if (get_object_outcome.IsSuccess()) {
+				auto &result = get_object_outcome.GetResultWithOwnership();
+				attempt.ok = true;
+				attempt.body.size = result.GetContentLength();
+				attempt.body.content_range = result.GetContentRange();
+				attempt.body.etag = result.GetETag();
+				if (own && attempt.body.size <= (long)own->size()) {
+					own->resize(attempt.body.size);
+					attempt.body.data = std::move(*own);
+				}
+			} else {
+				const auto &error = get_object_outcome.GetError();
+				attempt.retryable = error.ShouldRetry();
+				attempt.error = error.GetMessage();
+			}
+			std::shared_ptr<RemoteRequests> requests = get->requests;
+			complete(get, sent_us, std::move(attempt));
+			requests->end();
+		});
+}
+
+std::string byte_range(long position, long length) {
+	return "bytes=" + std::to_string(position) + "-" +
+		   std::to_string(position + length - 1);
+}
+
+} // namespace
+
+RemoteRequests::RemoteRequests(std::string object_id)
+	: object_id_(std::move(object_id)) {}
+
+bool RemoteRequests::begin(long count) {
+	std::lock_guard<std::mutex> lock(mutex_);
+	if (closing_) {
+		return false;
+	}
+	out_ += count;
+	return true;
+}
+
+void RemoteRequests::end() {
+	std::lock_guard<std::mutex> lock(mutex_);
+	if (--out_ == 0) {
+		idle_.notify_all();
+	}
+}
+
+bool RemoteRequests::closing() {
+	std::lock_guard<std::mutex> lock(mutex_);
+	return closing_;
+}
+
+void RemoteRequests::set_stats(IOStats *stats) {
+	std::lock_guard<std::mutex> lock(mutex_);
+	stats_ = stats;
+}
+
+void RemoteRequests::count(long bytes, long start_us) {
+	std::lock_guard<std::mutex> lock(mutex_);
+	if (stats_) {
+		stats_->record_request(object_id_, bytes, IOStats::now_us() - start_us);
+	}
+}
+
+void RemoteRequests::close() {
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		closing_ = true;
+	}
+	Timers::instance().cancel(this);
+	std::unique_lock<std::mutex> lock(mutex_);
+	idle_.wait(lock, [this] { return out_ == 0; });
+}
+
+S3VirtualFileRegion::S3VirtualFileRegion(
+	std::shared_ptr<Aws::S3::S3Client> s3_client, std::string bucket_name,
+	std::string object_name, std::string region, long tail_prefetch)
+	: start_(0), end_(0), bucket_name_(bucket_name),
+	  object_name_(object_name), region_(region), cursor_(0),
+	  coalesce_gap_(S3_COALESCE_GAP), tail_prefetch_(tail_prefetch),
+	  tail_start_(0), latencies_(std::make_shared<LatencyTracker>()),
+	  s3_client_(std::move(s3_client)) {
+
+	requests_ = std::make_shared<RemoteRequests>(object_id());
 	object_request_ = Aws::S3::Model::GetObjectRequest();
 	object_request_.WithBucket(bucket_name).WithKey(object_name);
 
-	auto file_size = this->object_size();
-	end_ = file_size;
+	try {
+		if (tail_prefetch_ > 0) {
+			fetch_tail("bytes=-" + std::to_string(tail_prefetch_),
+					   tail_prefetch_);
+		} else {
+			end_ = this->object_size();
+		}
+	} catch (...) {
+		// a hedge of the tail GET may still be out
+		requests_->close();
+		throw;
+	}
 	size_ = end_ - start_;
 }
 
-S3VirtualFileRegion::S3VirtualFileRegion(const Aws::S3::S3Client &s3_client,
-										 std::string bucket_name,
-										 std::string object_name,
-										 std::string region, long start,
-										 long length)
-	: s3_client_(s3_client), bucket_name_(bucket_name),
-	  object_name_(object_name), region_(region), start_(start),
-	  cursor_(start) {
+S3VirtualFileRegion::S3VirtualFileRegion(
+	std::shared_ptr<Aws::S3::S3Client> s3_client, std::string bucket_name,
+	std::string object_name, std::string region, long start, long length)
+	: start_(start), end_(start + length), bucket_name_(bucket_name),
+	  object_name_(object_name), region_(region), cursor_(start),
+	  coalesce_gap_(S3_COALESCE_GAP), tail_prefetch_(0), tail_start_(0),
+	  latencies_(std::make_shared<LatencyTracker>()),
+	  s3_client_(std::move(s3_client)) {
 
+	requests_ = std::make_shared<RemoteRequests>(object_id());
 	object_request_ = Aws::S3::Model::GetObjectRequest();
 	object_request_.WithBucket(bucket_name).WithKey(object_name);
 
-	end_ = start + length;
 	size_ = end_ - start_;
 }
 
-S3VirtualFileRegion::~S3VirtualFileRegion() {}
+std::future<S3Body> S3VirtualFileRegion::get_range(std::string range,
+													long capacity,
+													char *buffer) {
+	long delay_us = hedge_delay_us(policy_, *latencies_);
+
+	Aws::S3::Model::GetObjectRequest request;
+	request.WithBucket(bucket_name_).WithKey(object_name_);
+	request.SetRange(range.c_str());
+
+	auto get = std::make_shared<RangeGet>();
+	// the client goes with the GET, not the region
+	get->issue = [client = s3_client_,
+				  request](std::shared_ptr<RangeGet> get) {
+		send_s3(*client, request, get);
+	};
+	get->requests = requests_;
+	get->name = object_id() + " " + range;
+	get->capacity = capacity;
+	// a hedge that lost may still be writing its body, so only an unhedged
+	// GET can go straight into the caller's buffer
+	get->buffer = delay_us < 0 ? buffer : nullptr;
+	get->policy = policy_;
+	get->latencies = latencies_;
+	return start(get, delay_us);
+}
+
+// GET range into tail_. Content-Range ("bytes first-last/total") says where
+// the bytes sit, which for a suffix range also tells us the object size.
+void S3VirtualFileRegion::fetch_tail(std::string range, long capacity) {
+	S3Body body;
+	try {
+		body = get_range(range, capacity).get();
+	} catch (const ReadError &) {
+		// e.g. an empty object has no satisfiable suffix, fall back to
+		// the plain HEAD
+		if (end_ == 0) {
+			end_ = object_size();
+		}
+		tail_prefetch_ = 0;
+		return;
+	}
+	long first, last, total;
+	if (sscanf(body.content_range.c_str(), "bytes %ld-%ld/%ld", &first, &last,
+			   &total) != 3 ||
+		last - first + 1 != body.size) {
+		throw ReadError("GET " + object_id() + " " + range +
+						": bad Content-Range " + body.content_range);
+	}
+	if (end_ == 0) {
+		end_ = total;
+		etag_ = body.etag;
+	}
+
+	tail_start_ = first;
+	tail_ = std::make_shared<const std::string>(std::move(body.data));
+}
+
+// The bytes at object position [position, position + size) if they are in
+// tail_. The first read that lands in the last tail_prefetch_ bytes of the
+// region fetches them all.
+std::string_view S3VirtualFileRegion::from_tail(long position, long size) {
+	std::lock_guard<std::mutex> lock(tail_mutex_);
+	long window_start = std::max(start_, end_ - tail_prefetch_);
+	bool have_window = tail_ && tail_start_ <= window_start &&
+					   tail_start_ + (long)tail_->size() >= end_;
+	if (tail_prefetch_ > 0 && position >= window_start && !have_window) {
+		fetch_tail("bytes=" + std::to_string(window_start) + "-" +
+					   std::to_string(end_ - 1),
+				   end_ - window_start);
+	}
+	if (!tail_ || position < tail_start_ ||
+		position + size > tail_start_ + (long)tail_->size()) {
+		return {};
+	}
+	return std::string_view(tail_->data() + (position - tail_start_), size);
+}
+
+// late responses, retries and hedges only hold requests_, but the client
+// and the caller's stats have to outlive them
+S3VirtualFileRegion::~S3VirtualFileRegion() { requests_->close(); }
 
 long S3VirtualFileRegion::size() const { return size_; }
 
@@ -126,16 +1237,20 @@ long S3VirtualFileRegion::object_size() {
 	Aws::S3::Model::HeadObjectRequest head_object_request;
 	head_object_request.WithBucket(object_request_.GetBucket())
 		.WithKey(object_request_.GetKey());
-	auto head_object_outcome = s3_client_.HeadObject(head_object_request);
-	long file_size;
-	if (head_object_outcome.IsSuccess()) {
-		file_size = head_object_outcome.GetResult().GetContentLength();
-	} else {
-		std::cout << "Error: " << head_object_outcome.GetError().GetMessage()
-				  << std::endl;
-		exit(1);
+	for (int attempt = 1;; attempt++) {
+		auto head_object_outcome = s3_client_->HeadObject(head_object_request);
+		if (head_object_outcome.IsSuccess()) {
+			etag_ = head_object_outcome.GetResult().GetETag();
+			return head_object_outcome.GetResult().GetContentLength();
+		}
+		const auto &error = head_object_outcome.GetError();
+		if (!error.ShouldRetry() || attempt >= policy_.max_attempts) {
+			throw ReadError("HEAD " + object_id() + ": " + error.GetMessage() +
+							" after " + std::to_string(attempt) + " attempts");
+		}
+		std::this_thread::sleep_for(
+			std::chrono::microseconds(backoff_us(policy_, attempt)));
 	}
-	return file_size;
 }
 
 int S3VirtualFileRegion::vfseek(long offset, int origin) {
@@ -159,46 +1274,801 @@ long S3VirtualFileRegion::vftell() { return cursor_; }
 void S3VirtualFileRegion::reset() { cursor_ = start_; }
 
 void S3VirtualFileRegion::vfread(void *buffer, long size) {
+	read_at(cursor_ - start_, buffer, size);
+	cursor_ += size;
+}
+
+void S3VirtualFileRegion::read_at(long offset, void *buffer, long size) {
+
+	long position = start_ + offset;
+	if (offset < 0 || position + size > end_) {
+		std::cout << "position: " << position << " size: " << size
+				  << " end: " << end_ << std::endl;
+		assert(false);
+	}
+
+	std::string_view cached = from_tail(position, size);
+	if (cached.data()) {
+		memcpy(buffer, cached.data(), size);
+		return;
+	}
 
-	num_reads++;
-	num_bytes_read += size;
+	std::string range = byte_range(position, size);
+	S3Body body = get_range(range, size, static_cast<char *>(buffer)).get();
+	if (body.size != size) {
+		throw ReadError("GET " + object_id() + " " + range + ": got " +
+						std::to_string(body.size) + " bytes");
+	}
+	if (!body.data.empty()) {
+		// a hedge won, its body could not go to buffer
+		memcpy(buffer, body.data.data(), size);
+	}
+}
 
-	Aws::S3::Model::GetObjectRequest object_request;
-	object_request.WithBucket(bucket_name_).WithKey(object_name_);
+std::future<std::string> S3VirtualFileRegion::read_at_async(long offset,
+														   long length) {
 
-	if (cursor_ + size > end_) {
-		std::cout << "cursor: " << cursor_ << " size: " << size
+	long position = start_ + offset;
+	if (offset < 0 || position + length > end_) {
+		std::cout << "position: " << position << " size: " << length
 				  << " end: " << end_ << std::endl;
 		assert(false);
 	}
 
-	// std::cout << object_request_.GetBucket() << " " <<
-	// object_request_.GetKey()
-	// << " " << cursor_ << " " << size << std::endl;
-	std::string argument = "bytes=" + std::to_string(cursor_) + "-" +
-						   std::to_string(cursor_ + size - 1);
-	// std::string argument = "bytes=" + std::to_string(cursor_) + "-" +
-	// std::to_string(cursor_ + 1000);
-	object_request.SetRange(argument.c_str());
-	auto start_time = std::chrono::high_resolution_clock::now();
-	auto get_object_outcome = s3_client_.GetObject(object_request);
-	auto stop = std::chrono::high_resolution_clock::now();
-	auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(
-		stop - start_time);
-	// std::cout << "s3 get took " << duration.count() << " milliseconds" <<
-	// std::endl;
-	assert(get_object_outcome.IsSuccess());
-	auto &retrieved_data =
-		get_object_outcome.GetResultWithOwnership().GetBody();
-	retrieved_data.read(static_cast<char *>(buffer), size);
+	std::string_view cached = from_tail(position, length);
+	if (cached.data()) {
+		return ready_future(std::string(cached));
+	}
+
+	std::string range = byte_range(position, length);
+	return std::async(
+		std::launch::deferred,
+		[length](std::future<S3Body> body, std::string name) {
+			S3Body got = body.get();
+			if (got.size != length) {
+				throw ReadError("GET " + name + ": got " +
+								std::to_string(got.size) + " bytes");
+			}
+			return std::move(got.data);
+		},
+		get_range(range, length), object_id() + " " + range);
+}
+
+std::vector<std::future<std::string>>
+S3VirtualFileRegion::vfreadv_async(const std::vector<ReadRange> &ranges) {
+	return coalesced_read_async(this, ranges, coalesce_gap_,
+								S3_COALESCE_MAX_BYTES);
 }
 
 VirtualFileRegion *S3VirtualFileRegion::slice(long start, long length) {
 	if (start + length > end_) {
 		assert(false);
 	}
-	return new S3VirtualFileRegion(s3_client_, bucket_name_, object_name_,
-								   region_, start_ + start, length);
+	S3VirtualFileRegion *sliced = new S3VirtualFileRegion(
+		s3_client_, bucket_name_, object_name_, region_, start_ + start, length);
+	sliced->set_coalesce_gap(coalesce_gap_);
+	sliced->policy_ = policy_;
+	sliced->latencies_ = latencies_;
+	sliced->set_stats(stats_);
+	sliced->etag_ = etag_;
+	// slices keep reading their own footers speculatively, and the one at
+	// the end of the object can use the tail we already have
+	sliced->tail_prefetch_ = tail_prefetch_;
+	std::lock_guard<std::mutex> lock(tail_mutex_);
+	sliced->tail_ = tail_;
+	sliced->tail_start_ = tail_start_;
+	return sliced;
+}
+
+std::string_view S3VirtualFileRegion::view(long offset, long length) {
+	if (offset < 0 || start_ + offset + length > end_) {
+		return {};
+	}
+	return from_tail(start_ + offset, length);
+}
+
+void S3VirtualFileRegion::set_coalesce_gap(long gap) { coalesce_gap_ = gap; }
+
+void S3VirtualFileRegion::set_read_policy(S3ReadPolicy policy) {
+	policy_ = policy;
+}
+
+std::string S3VirtualFileRegion::object_id() const {
+	return "s3://" + bucket_name_ + "/" + object_name_;
+}
+
+long S3VirtualFileRegion::object_offset(long offset) const {
+	return start_ + offset;
+}
+
+std::string S3VirtualFileRegion::object_version() const { return etag_; }
+
+void S3VirtualFileRegion::set_stats(IOStats *stats) {
+	VirtualFileRegion::set_stats(stats);
+	requests_->set_stats(stats);
+}
+
+RequestTrace::RequestTrace() : epoch_(std::chrono::steady_clock::now()) {}
+
+long RequestTrace::now_us() {
+	return std::chrono::duration_cast<std::chrono::microseconds>(
+			   std::chrono::steady_clock::now() - epoch_)
+		.count();
+}
+
+void RequestTrace::record(SimulatedRequest request) {
+	std::lock_guard<std::mutex> lock(mutex_);
+	requests_.push_back(std::move(request));
+}
+
+std::vector<SimulatedRequest> RequestTrace::requests() {
+	std::lock_guard<std::mutex> lock(mutex_);
+	return requests_;
+}
+
+void RequestTrace::clear() {
+	std::lock_guard<std::mutex> lock(mutex_);
+	requests_.clear();
+	epoch_ = std::chrono::steady_clock::now();
+}
+
+SimulatedRemoteVirtualFileRegion::SimulatedRemoteVirtualFileRegion(
+	std::string filename, SimulatedRemoteConfig config,
+	std::shared_ptr<RequestTrace> trace)
+	: SimulatedRemoteVirtualFileRegion(new MmapVirtualFileRegion(filename),
+									   config, trace,
+									   std::make_shared<LatencyTracker>()) {}
+
+SimulatedRemoteVirtualFileRegion::SimulatedRemoteVirtualFileRegion(
+	VirtualFileRegion *file, SimulatedRemoteConfig config,
+	std::shared_ptr<RequestTrace> trace,
+	std::shared_ptr<LatencyTracker> latencies)
+	: file_(file), config_(config), trace_(trace), latencies_(latencies),
+	  requests_(std::make_shared<RemoteRequests>(file_->object_id())),
+	  cursor_(0) {}
+
+SimulatedRemoteVirtualFileRegion::~SimulatedRemoteVirtualFileRegion() {
+	requests_->close();
+}
+
+long SimulatedRemoteVirtualFileRegion::size() const { return file_->size(); }
+
+int SimulatedRemoteVirtualFileRegion::vfseek(long offset, int origin) {
+	switch (origin) {
+	case SEEK_SET:
+		cursor_ = offset;
+		return 0;
+	case SEEK_CUR:
+		cursor_ += offset;
+		return 0;
+	case SEEK_END:
+		cursor_ = size() + offset;
+		return 0;
+	default:
+		return -1;
+	}
+}
+
+long SimulatedRemoteVirtualFileRegion::vftell() { return cursor_; }
+
+void SimulatedRemoteVirtualFileRegion::reset() { cursor_ = 0; }
+
+void SimulatedRemoteVirtualFileRegion::vfread(void *buffer, long size) {
+	read_at(cursor_, buffer, size);
+	cursor_ += size;
+}
+
+// Every request completes on the timer thread once what it costs has passed,
+// and only then reads the file
+std::future<S3Body> SimulatedRemoteVirtualFileRegion::get_range(long offset,
+																 long length) {
+	auto get = std::make_shared<RangeGet>();
+	get->issue = [file = file_, config = config_, trace = trace_, offset,
+				  length](std::shared_ptr<RangeGet> get) {
+		static thread_local std::mt19937 rng(
+			config.seed ^
+			std::hash<std::thread::id>{}(std::this_thread::get_id()));
+		long jitter = config.jitter_us > 0
+						  ? std::uniform_int_distribution<long>(
+								0, config.jitter_us - 1)(rng)
+						  : 0;
+		SimulatedFault fault;
+		if (config.fault) {
+			fault = config.fault(file->object_offset(offset), length);
+		}
+		long duration_us = config.latency_us + jitter +
+						   (long)(length / config.bytes_per_second * 1e6) +
+						   fault.extra_us;
+
+		long sent_us = IOStats::now_us();
+		long start_us = trace->now_us();
+		Timers::instance().schedule(
+			get->requests.get(), duration_us,
+			[get, file, trace, fault, offset, length, sent_us,
+			 start_us](bool run) {
+				Attempt attempt;
+				if (run) {
+					trace->record({file->object_id(),
+								   file->object_offset(offset), length,
+								   start_us, trace->now_us() - start_us});
+				}
+				if (!run) {
+					attempt.retryable = false;
+					attempt.error = "region closed";
+				} else if (fault.fail) {
+					attempt.retryable = fault.retryable;
+					attempt.error = "injected failure";
+				} else {
+					attempt.ok = true;
+					attempt.body.size = length;
+					attempt.body.data.resize(length);
+					file->read_at(offset, attempt.body.data.data(), length);
+				}
+				std::shared_ptr<RemoteRequests> requests = get->requests;
+				complete(get, sent_us, std::move(attempt));
+				requests->end();
+			});
+	};
+	get->requests = requests_;
+	get->name = object_id() + " " + byte_range(object_offset(offset), length);
+	get->capacity = length;
+	get->policy = config_.policy;
+	get->latencies = latencies_;
+	return start(get, hedge_delay_us(config_.policy, *latencies_));
+}
+
+void SimulatedRemoteVirtualFileRegion::read_at(long offset, void *buffer,
+											   long size) {
+	S3Body body = get_range(offset, size).get();
+	if (body.size != size) {
+		throw ReadError("GET " + object_id() + " returned " +
+						std::to_string(body.size) + " bytes instead of " +
+						std::to_string(size));
+	}
+	memcpy(buffer, body.data.data(), size);
+}
+
+std::future<std::string>
+SimulatedRemoteVirtualFileRegion::read_at_async(long offset, long length) {
+	// the request is out already, only taking the body waits
+	auto body = std::make_shared<std::future<S3Body>>(get_range(offset, length));
+	return std::async(std::launch::deferred,
+					  [body] { return std::move(body->get().data); });
+}
+
+std::vector<std::future<std::string>>
+SimulatedRemoteVirtualFileRegion::vfreadv_async(
+	const std::vector<ReadRange> &ranges) {
+	return coalesced_read_async(this, ranges, config_.coalesce_gap,
+								S3_COALESCE_MAX_BYTES);
+}
+
+VirtualFileRegion *SimulatedRemoteVirtualFileRegion::slice(long start,
+														   long length) {
+	VirtualFileRegion *sliced = new SimulatedRemoteVirtualFileRegion(
+		file_->slice(start, length), config_, trace_, latencies_);
+	sliced->set_stats(stats_);
+	return sliced;
+}
+
+std::string SimulatedRemoteVirtualFileRegion::object_id() const {
+	return file_->object_id();
+}
+
+long SimulatedRemoteVirtualFileRegion::object_offset(long offset) const {
+	return file_->object_offset(offset);
+}
+
+void SimulatedRemoteVirtualFileRegion::set_stats(IOStats *stats) {
+	VirtualFileRegion::set_stats(stats);
+	requests_->set_stats(stats);
+}
+
+BlockCache::BlockCache(size_t capacity)
+	: capacity_(capacity), used_(0), hits_(0), misses_(0) {}
+
+BlockCache &BlockCache::instance() {
+	static BlockCache cache(BLOCK_CACHE_BYTES);
+	return cache;
+}
+
+std::string BlockCache::make_key(const VirtualFileRegion *vfr, long offset,
+								 long length, const std::string &kind) {
+	return kind + ":" + vfr->object_id() + "@" + vfr->object_version() + ":" +
+		   std::to_string(vfr->object_offset(offset)) + ":" +
+		   std::to_string(length);
+}
+
+std::shared_ptr<const void> BlockCache::lookup(const std::string &key) {
+	std::lock_guard<std::mutex> lock(mutex_);
+	auto pinned = pinned_.find(key);
+	if (pinned != pinned_.end()) {
+		hits_++;
+		return pinned->second;
+	}
+	auto it = index_.find(key);
+	if (it == index_.end()) {
+		misses_++;
+		return nullptr;
+	}
+	hits_++;
+	lru_.splice(lru_.begin(), lru_, it->second);
+	return it->second->value;
+}
+
+void BlockCache::insert(const std::string &key,
+						std::shared_ptr<const void> value, size_t charge) {
+	std::lock_guard<std::mutex> lock(mutex_);
+	// make_key puts the kind first
+	if (pinned_kinds_.count(key.substr(0, key.find(':')))) {
+		pinned_[key] = value;
+		return;
+	}
+	// something bigger than the whole budget would just flush everything
+	if (charge > capacity_) {
+		return;
+	}
+	auto it = index_.find(key);
+	if (it != index_.end()) {
+		used_ -= it->second->charge;
+		lru_.erase(it->second);
+		index_.erase(it);
+	}
+	lru_.push_front({key, value, charge});
+	index_[key] = lru_.begin();
+	used_ += charge;
+	evict();
+}
+
+// caller holds mutex_
+void BlockCache::evict() {
+	while (used_ > capacity_ && !lru_.empty()) {
+		used_ -= lru_.back().charge;
+		index_.erase(lru_.back().key);
+		lru_.pop_back();
+	}
+}
+
+void BlockCache::set_capacity(size_t capacity) {
+	std::lock_guard<std::mutex> lock(mutex_);
+	capacity_ = capacity;
+	evict();
+}
+
+void BlockCache::pin_kind(const std::string &kind) {
+	std::lock_guard<std::mutex> lock(mutex_);
+	pinned_kinds_.insert(kind);
+}
+
+void BlockCache::clear() {
+	std::lock_guard<std::mutex> lock(mutex_);
+	lru_.clear();
+	index_.clear();
+	pinned_.clear();
+	used_ = 0;
+}
+
+size_t BlockCache::capacity() {
+	std::lock_guard<std::mutex> lock(mutex_);
+	return capacity_;
+}
+
+size_t BlockCache::used() {
+	std::lock_guard<std::mutex> lock(mutex_);
+	return used_;
+}
+
+CachingVirtualFileRegion::CachingVirtualFileRegion(VirtualFileRegion *inner,
+												   int pages,
+												   BlockCache *cache)
+	: inner_(inner), pages_(pages), cache_(cache), cursor_(0) {}
+
+CachingVirtualFileRegion::~CachingVirtualFileRegion() {}
+
+long CachingVirtualFileRegion::size() const { return inner_->size(); }
+
+int CachingVirtualFileRegion::vfseek(long offset, int origin) {
+	switch (origin) {
+	case SEEK_SET:
+		cursor_ = offset;
+		return 0;
+	case SEEK_CUR:
+		cursor_ += offset;
+		return 0;
+	case SEEK_END:
+		cursor_ = size() + offset;
+		return 0;
+	default:
+		return -1;
+	}
+}
+
+long CachingVirtualFileRegion::vftell() { return cursor_; }
+
+void CachingVirtualFileRegion::reset() { cursor_ = 0; }
+
+void CachingVirtualFileRegion::vfread(void *buffer, long size) {
+	read_at(cursor_, buffer, size);
+	cursor_ += size;
+}
+
+void CachingVirtualFileRegion::read_at(long offset, void *buffer, long size) {
+	if (!(pages_ & CACHE_RAW)) {
+		inner_->read_at(offset, buffer, size);
+		return;
+	}
+	std::string key = BlockCache::make_key(this, offset, size, "raw");
+	std::shared_ptr<const void> hit = cache_->lookup(key);
+	if (hit) {
+		memcpy(buffer, static_cast<const std::string *>(hit.get())->data(),
+			   size);
+		return;
+	}
+	inner_->read_at(offset, buffer, size);
+	cache_->insert(
+		key,
+		std::make_shared<const std::string>(static_cast<char *>(buffer), size),
+		size);
+}
+
+std::vector<std::future<std::string>>
+CachingVirtualFileRegion::vfreadv_async(const std::vector<ReadRange> &ranges) {
+	if (!(pages_ & CACHE_RAW)) {
+		return inner_->vfreadv_async(ranges);
+	}
+	std::vector<std::future<std::string>> result(ranges.size());
+	std::vector<std::string> keys(ranges.size());
+	std::vector<size_t> misses;
+	std::vector<ReadRange> miss_ranges;
+	for (size_t i = 0; i < ranges.size(); i++) {
+		keys[i] = BlockCache::make_key(this, ranges[i].offset, ranges[i].length,
+									   "raw");
+		std::shared_ptr<const void> hit = cache_->lookup(keys[i]);
+		if (hit) {
+			result[i] = ready_future(*static_cast<const std::string *>(hit.get()));
+		} else {
+			misses.push_back(i);
+			miss_ranges.push_back(ranges[i]);
+		}
+	}
+	if (misses.empty()) {
+		return result;
+	}
+	std::vector<std::future<std::string>> fetched =
+		inner_->vfreadv_async(miss_ranges);
+	for (size_t j = 0; j < misses.size(); j++) {
+		result[misses[j]] = std::async(
+			std::launch::deferred,
+			[cache = cache_](std::future<std::string> body, std::string key) {
+				std::string data = body.get();
+				cache->insert(key, std::make_shared<const std::string>(data),
+							  data.size());
+				return data;
+			},
+			std::move(fetched[j]), keys[misses[j]]);
+	}
+	return result;
+}
+
+VirtualFileRegion *CachingVirtualFileRegion::slice(long start, long length) {
+	VirtualFileRegion *sliced = new CachingVirtualFileRegion(
+		inner_->slice(start, length), pages_, cache_);
+	sliced->set_stats(stats_);
+	return sliced;
+}
+
+// memory-backed regions don't need the cache for raw bytes
+std::string_view CachingVirtualFileRegion::view(long offset, long length) {
+	return inner_->view(offset, length);
+}
+
+std::string CachingVirtualFileRegion::object_id() const {
+	return inner_->object_id();
+}
+
+long CachingVirtualFileRegion::object_offset(long offset) const {
+	return inner_->object_offset(offset);
+}
+
+std::string CachingVirtualFileRegion::object_version() const {
+	return inner_->object_version();
+}
+
+BlockCache *CachingVirtualFileRegion::block_cache() {
+	return (pages_ & CACHE_DECODED) ? cache_ : nullptr;
+}
+
+VirtualFileRegion *CachingVirtualFileRegion::backing() {
+	return inner_->backing();
+}
+
+void CachingVirtualFileRegion::set_stats(IOStats *stats) {
+	stats_ = stats;
+	inner_->set_stats(stats);
+}
+
+std::mutex DiskCache::instance_mutex_;
+std::shared_ptr<DiskCache> DiskCache::instance_;
+
+DiskCache::DiskCache(std::string directory, size_t capacity)
+	: directory_(directory), capacity_(capacity), used_(0), scanned_(0),
+	  hits_(0), misses_(0) {
+	std::filesystem::create_directories(directory_);
+	std::lock_guard<std::mutex> lock(mutex_);
+	evict();
+}
+
+std::shared_ptr<DiskCache> DiskCache::instance() {
+	std::lock_guard<std::mutex> lock(instance_mutex_);
+	return instance_;
+}
+
+void DiskCache::configure(std::string directory, size_t capacity) {
+	auto cache = std::make_shared<DiskCache>(directory, capacity);
+	std::lock_guard<std::mutex> lock(instance_mutex_);
+	instance_ = cache;
+}
+
+std::string DiskCache::make_key(const VirtualFileRegion *vfr, long offset,
+								long length) {
+	return vfr->object_id() + "@" + vfr->object_version() + ":" +
+		   std::to_string(vfr->object_offset(offset)) + ":" +
+		   std::to_string(length);
+}
+
+std::string DiskCache::path(const std::string &name) const {
+	return directory_ + "/" + name;
+}
+
+bool DiskCache::lookup(const std::string &key, std::string &value) {
+	char name[17];
+	snprintf(name, sizeof(name), "%016zx", std::hash<std::string>{}(key));
+
+	std::ifstream file(path(name), std::ios::binary);
+	size_t key_length = 0;
+	std::string stored_key;
+	if (file.read(reinterpret_cast<char *>(&key_length), sizeof(size_t))) {
+		stored_key.resize(key_length);
+		file.read(stored_key.data(), key_length);
+	}
+	if (!file || stored_key != key) {
+		misses_++;
+		return false;
+	}
+	std::string data((std::istreambuf_iterator<char>(file)),
+					 std::istreambuf_iterator<char>());
+	value = std::move(data);
+	hits_++;
+
+	// bump the file so that eviction, in any process, sees it as recently used
+	std::error_code ec;
+	std::filesystem::last_write_time(
+		path(name), std::filesystem::file_time_type::clock::now(), ec);
+	return true;
+}
+
+void DiskCache::insert(const std::string &key, const std::string &value) {
+	char name[17];
+	snprintf(name, sizeof(name), "%016zx", std::hash<std::string>{}(key));
+	size_t size = sizeof(size_t) + key.size() + value.size();
+	if (size > capacity_) {
+		return;
+	}
+
+	// write to a temporary private to this process and thread and rename, so
+	// that readers never see a partial page
+	std::string tmp = path(name) + ".tmp" + std::to_string(getpid()) + "." +
+					  std::to_string(std::hash<std::thread::id>{}(
+						  std::this_thread::get_id()));
+	{
+		std::ofstream file(tmp, std::ios::binary);
+		size_t key_length = key.size();
+		file.write(reinterpret_cast<const char *>(&key_length), sizeof(size_t));
+		file.write(key.data(), key.size());
+		file.write(value.data(), value.size());
+		if (!file) {
+			LOG(WARNING) << "disk cache could not write " << tmp;
+			std::error_code ec;
+			std::filesystem::remove(tmp, ec);
+			return;
+		}
+	}
+	// e.g. another process removed the directory, the page is just not kept
+	std::error_code ec;
+	std::filesystem::rename(tmp, path(name), ec);
+	if (ec) {
+		LOG(WARNING) << "disk cache could not keep " << tmp << ": "
+					 << ec.message();
+		std::filesystem::remove(tmp, ec);
+		return;
+	}
+
+	// this may replace a page, which the next scan sorts out. Other processes
+	// add pages too, so rescan every so often even under budget.
+	std::lock_guard<std::mutex> lock(mutex_);
+	used_ += size;
+	if (used_ > capacity_ ||
+		used_ - scanned_ > capacity_ * (1 - DISK_CACHE_LOW_WATER)) {
+		evict();
+	}
+}
+
+void DiskCache::evict() {
+	struct Page {
+		std::filesystem::file_time_type mtime;
+		std::string name;
+		size_t size;
+	};
+	std::vector<Page> pages;
+	used_ = 0;
+	std::error_code ec;
+	for (const auto &entry :
+		 std::filesystem::directory_iterator(directory_, ec)) {
+		std::string name = entry.path().filename();
+		// temporaries are another writer's, and gone soon either way
+		if (name.find(".tmp") != std::string::npos) {
+			continue;
+		}
+		// another process may remove pages under us
+		std::error_code stat_ec;
+		if (!entry.is_regular_file(stat_ec)) {
+			continue;
+		}
+		size_t size = entry.file_size(stat_ec);
+		if (stat_ec) {
+			continue;
+		}
+		auto mtime = entry.last_write_time(stat_ec);
+		if (stat_ec) {
+			continue;
+		}
+		pages.push_back({mtime, name, size});
+		used_ += size;
+	}
+	if (used_ > capacity_) {
+		// oldest first
+		std::sort(pages.begin(), pages.end(),
+				  [](const Page &a, const Page &b) { return a.mtime < b.mtime; });
+		size_t target = capacity_ * DISK_CACHE_LOW_WATER;
+		for (const Page &page : pages) {
+			if (used_ <= target) {
+				break;
+			}
+			std::filesystem::remove(path(page.name), ec);
+			used_ -= page.size;
+		}
+	}
+	scanned_ = used_;
+}
+
+size_t DiskCache::capacity() {
+	std::lock_guard<std::mutex> lock(mutex_);
+	return capacity_;
+}
+
+size_t DiskCache::used() {
+	std::lock_guard<std::mutex> lock(mutex_);
+	return used_;
+}
+
+DiskCachingVirtualFileRegion::DiskCachingVirtualFileRegion(
+	VirtualFileRegion *inner, std::shared_ptr<DiskCache> cache)
+	: inner_(inner), cache_(std::move(cache)), cursor_(0) {}
+
+DiskCachingVirtualFileRegion::~DiskCachingVirtualFileRegion() {}
+
+long DiskCachingVirtualFileRegion::size() const { return inner_->size(); }
+
+int DiskCachingVirtualFileRegion::vfseek(long offset, int origin) {
+	switch (origin) {
+	case SEEK_SET:
+		cursor_ = offset;
+		return 0;
+	case SEEK_CUR:
+		cursor_ += offset;
+		return 0;
+	case SEEK_END:
+		cursor_ = size() + offset;
+		return 0;
+	default:
+		return -1;
+	}
+}
+
+long DiskCachingVirtualFileRegion::vftell() { return cursor_; }
+
+void DiskCachingVirtualFileRegion::reset() { cursor_ = 0; }
+
+void DiskCachingVirtualFileRegion::vfread(void *buffer, long size) {
+	read_at(cursor_, buffer, size);
+	cursor_ += size;
+}
+
+void DiskCachingVirtualFileRegion::read_at(long offset, void *buffer,
+										   long size) {
+	std::string key = DiskCache::make_key(this, offset, size);
+	std::string value;
+	if (cache_->lookup(key, value) && (long)value.size() == size) {
+		memcpy(buffer, value.data(), size);
+		return;
+	}
+	inner_->read_at(offset, buffer, size);
+	cache_->insert(key, std::string(static_cast<char *>(buffer), size));
+}
+
+std::vector<std::future<std::string>>
+DiskCachingVirtualFileRegion::vfreadv_async(const std::vector<ReadRange> &ranges) {
+	std::vector<std::future<std::string>> result(ranges.size());
+	std::vector<std::string> keys(ranges.size());
+	std::vector<size_t> misses;
+	std::vector<ReadRange> miss_ranges;
+	for (size_t i = 0; i < ranges.size(); i++) {
+		keys[i] = DiskCache::make_key(this, ranges[i].offset, ranges[i].length);
+		std::string value;
+		if (cache_->lookup(keys[i], value) &&
+			(long)value.size() == ranges[i].length) {
+			result[i] = ready_future(std::move(value));
+		} else {
+			misses.push_back(i);
+			miss_ranges.push_back(ranges[i]);
+		}
+	}
+	if (misses.empty()) {
+		return result;
+	}
+	std::vector<std::future<std::string>> fetched =
+		inner_->vfreadv_async(miss_ranges);
+	for (size_t j = 0; j < misses.size(); j++) {
+		result[misses[j]] = std::async(
+			std::launch::deferred,
+			[cache = cache_](std::future<std::string> body, std::string key) {
+				std::string data = body.get();
+				cache->insert(key, data);
+				return data;
+			},
+			std::move(fetched[j]), keys[misses[j]]);
+	}
+	return result;
+}
+
+VirtualFileRegion *DiskCachingVirtualFileRegion::slice(long start, long length) {
+	VirtualFileRegion *sliced =
+		new DiskCachingVirtualFileRegion(inner_->slice(start, length), cache_);
+	sliced->set_stats(stats_);
+	return sliced;
+}
+
+// bytes the inner region has in memory don't need to go to disk
+std::string_view DiskCachingVirtualFileRegion::view(long offset, long length) {
+	return inner_->view(offset, length);
+}
+
+std::string DiskCachingVirtualFileRegion::object_id() const {
+	return inner_->object_id();
+}
+
+long DiskCachingVirtualFileRegion::object_offset(long offset) const {
+	return inner_->object_offset(offset);
+}
+
+std::string DiskCachingVirtualFileRegion::object_version() const {
+	return inner_->object_version();
+}
+
+void DiskCachingVirtualFileRegion::set_stats(IOStats *stats) {
+	stats_ = stats;
+	inner_->set_stats(stats);
+}
+
+std::shared_ptr<const std::string> read_decompressed(VirtualFileRegion *vfr,
+													 long offset, long length,
+													 const std::string &kind) {
+	return read_decoded<std::string>(
+		vfr, offset, length, kind,
+		[](const char *data, size_t size) {
+			return Compressor(CompressionAlgorithm::ZSTD).decompress(data, size);
+		},
+		[](const std::string &page) { return page.size(); });
 }
 
 // Aws::S3::S3Client S3VirtualFileRegion::CreateS3Client(const std::string&
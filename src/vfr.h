@@ -1,16 +1,142 @@
 #pragma once
+#include "compressor.h"
 #include "s3.h"
 #include <atomic>
 #include <cassert>
+#include <chrono>
+#include <condition_variable>
 #include <cstdio>
 #include <cstring>
+#include <functional>
+#include <future>
 #include <iostream>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <stdexcept>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
 
-class VirtualFileRegion {
+#define BLOCK_CACHE_BYTES (256L * 1024 * 1024) // default budget of BlockCache
+#define S3_COALESCE_GAP (256L * 1024) // merge S3 ranges at most this far apart
+#define S3_COALESCE_MAX_BYTES (16L * 1024 * 1024) // but never into a bigger GET
+#define S3_MAX_CONNECTIONS 64 // how many async GETs the client keeps in flight
+#define S3_TAIL_PREFETCH_BYTES (256L * 1024) // speculative footer read size
+#define DISK_CACHE_BYTES (4L * 1024 * 1024 * 1024) // default budget of DiskCache
+#define DISK_CACHE_LOW_WATER 0.9 // share of the budget eviction goes down to
+#define IO_LATENCY_BUCKETS 32 // log2 microsecond buckets of IOStats histograms
+#define S3_LATENCY_SAMPLES 256 // recent GET latencies the hedge delay comes from
+#define IO_URING_ENTRIES 64 // submission queue depth of each thread's ring
+#define IO_URING_ALIGN 4096 // O_DIRECT offset, length and buffer alignment
+#define IO_URING_BOUNCE_BYTES (4L * 1024 * 1024) // per thread O_DIRECT buffer
+
+class BlockCache;
+
+// A read that cannot be served, e.g. an S3 GET that still fails after all
+// retries. Thrown by read_at and out of the futures of read_at_async.
+class ReadError : public std::runtime_error {
+  public:
+	using std::runtime_error::runtime_error;
+};
+
+// Exceptions must not escape an omp parallel region. Loop bodies run through
+// run(), which keeps the first exception, and rethrow() raises it once the
+// loop is done.
+class ParallelErrors {
+	std::mutex mutex_;
+	std::exception_ptr first_;
+
+  public:
+	template <typename F> void run(F f) {
+		try {
+			f();
+		} catch (...) {
+			std::lock_guard<std::mutex> lock(mutex_);
+			if (!first_) {
+				first_ = std::current_exception();
+			}
+		}
+	}
+	void rethrow() {
+		if (first_) {
+			std::rethrow_exception(first_);
+		}
+	}
+};
+
+// [offset, offset + length) relative to the start of a region
+struct ReadRange {
+	long offset;
+	long length;
+};
+
+// Sort and dedup ranges, then merge neighbours that are at most gap bytes
+// apart as long as the merged range stays within max_length. Used by regions
+// where a round trip costs far more than the bytes in between.
+std::vector<ReadRange> coalesce_ranges(std::vector<ReadRange> ranges, long gap,
+									   long max_length);
+
+class VirtualFileRegion;
+
+// Reads done on behalf of one query, shared by every region the query goes
+// through. Requests are what actually went to the file or object store,
+// reads are the pages readers asked for, broken down by structure (footer,
+// fm_chunk, log_idx, oahu_block, posting_list, kauai_section) and counted as
+// cache hits when no request was needed. Both are also split by file.
+class IOStats {
   public:
-	static std::atomic<int> num_reads;
-	static std::atomic<int> num_bytes_read;
+	struct Counter {
+		size_t count = 0;
+		size_t bytes = 0;
+		size_t cache_hits = 0;
+		// bucket i counts latencies in [2^i, 2^(i+1)) us, 0 goes to bucket 0
+		size_t latency_us[IO_LATENCY_BUCKETS] = {};
+	};
+
+  private:
+	std::mutex mutex_;
+	std::map<std::string, Counter> requests_; // by file
+	std::map<std::pair<std::string, std::string>, Counter>
+		reads_; // by file and structure
+
+	static void add(Counter &counter, long bytes, long latency_us);
+
+  public:
+	static long now_us();
+	// kauai/oahu/hawaii from the object's extension
+	static std::string file_of(const std::string &object_id);
+	// the structure a read_decoded kind belongs to
+	static std::string structure_of(const std::string &kind);
+
+	void record_request(const std::string &object_id, long bytes,
+						long latency_us);
+	void record_read(const std::string &object_id, const std::string &kind,
+					 long bytes, long latency_us);
+	void record_hit(const std::string &object_id, const std::string &kind);
+
+	Counter requests();
+	Counter requests(const std::string &file);
+	Counter reads(const std::string &file, const std::string &structure);
+	std::string to_json();
+};
 
+// vfreadv_async for regions that pay per request: coalesce_ranges, then one
+// read_at_async per merged range
+std::vector<std::future<std::string>>
+coalesced_read_async(VirtualFileRegion *vfr, const std::vector<ReadRange> &ranges,
+					 long gap, long max_length);
+
+class VirtualFileRegion {
+  protected:
+	IOStats *stats_ = nullptr;
+
+	// count a request that went to the backing file or store since start_us
+	void count_request(long bytes, long start_us);
+
+  public:
 	virtual ~VirtualFileRegion() = default;
 
 	virtual long size() const = 0;
@@ -19,8 +145,63 @@ class VirtualFileRegion {
 	virtual void vfread(void *buffer, long size) = 0;
 	virtual void reset() = 0;
 	virtual VirtualFileRegion *slice(long start, long length) = 0;
+
+	// Positional read of [offset, offset + size) relative to the start of the
+	// region. It does not touch the cursor, so a single region can be shared
+	// by concurrent readers.
+	virtual void read_at(long offset, void *buffer, long size) = 0;
+
+	// Asynchronous read_at. The default defers the read to whoever calls
+	// get(), remote regions start the request right away so that many can be
+	// in flight from a single thread.
+	virtual std::future<std::string> read_at_async(long offset, long length);
+
+	// Read several ranges at once, one future per range in the order given.
+	// The default issues a read_at_async per range, remote regions override
+	// it to save round trips.
+	virtual std::vector<std::future<std::string>>
+	vfreadv_async(const std::vector<ReadRange> &ranges);
+
+	// vfreadv_async that waits for all of the ranges
+	std::vector<std::string> vfreadv(const std::vector<ReadRange> &ranges);
+
+	// Pointer into memory backing [offset, offset + length) of this region.
+	// Regions that are not memory-backed return a view with a null data().
+	virtual std::string_view view(long /*offset*/, long /*length*/) {
+		return {};
+	}
+
+	// view() if the region supports it, otherwise read the range into scratch
+	// and return a view of that.
+	std::string_view view_or_read(long offset, long length,
+								  std::string &scratch);
+
+	// Name of the underlying file or object and where this region starts in
+	// it. Together they key cached pages, so slices share cache entries.
+	virtual std::string object_id() const = 0;
+	virtual long object_offset(long offset) const = 0;
+
+	// Changes whenever the object is overwritten, e.g. the S3 ETag. Empty if
+	// the region has no notion of versions.
+	virtual std::string object_version() const { return ""; }
+
+	// Cache that decoded pages read from this region go to, if any.
+	virtual BlockCache *block_cache() { return nullptr; }
+
+	// The region to read through on a decoded-page miss. Caching regions
+	// return what they wrap so the raw bytes are not cached a second time.
+	virtual VirtualFileRegion *backing() { return this; }
+
+	// Where reads through this region are counted, if anywhere. Slices
+	// count into the same IOStats, decorators pass it on to what they wrap.
+	IOStats *stats() const { return stats_; }
+	virtual void set_stats(IOStats *stats) { stats_ = stats; }
 };
 
+// read_at for the fixed-size trailers at the end of index files, counted as
+// footer reads
+void read_trailer(VirtualFileRegion *vfr, long offset, void *buffer, long size);
+
 class DiskVirtualFileRegion : public VirtualFileRegion {
   private:
 	std::string filename_;
@@ -30,6 +211,7 @@ class DiskVirtualFileRegion : public VirtualFileRegion {
 	long size_;
 
   public:
+	// throw ReadError if the file cannot be opened
 	DiskVirtualFileRegion(std::string filename, long start, long length);
 	DiskVirtualFileRegion(std::string filename);
 	~DiskVirtualFileRegion();
@@ -37,8 +219,159 @@ class DiskVirtualFileRegion : public VirtualFileRegion {
 	int vfseek(long offset, int origin) override;
 	long vftell() override;
 	void vfread(void *buffer, long size) override;
+	void read_at(long offset, void *buffer, long size) override;
 	void reset() override;
 	VirtualFileRegion *slice(long start, long length) override;
+	std::string object_id() const override;
+	long object_offset(long offset) const override;
+};
+
+// A read-only mapping of a whole file. Every slice of an
+// MmapVirtualFileRegion shares one of these.
+struct MappedFile {
+	std::string filename;
+	const char *data;
+	long size;
+
+	// throws ReadError if the file cannot be opened or mapped
+	MappedFile(std::string filename);
+	~MappedFile();
+};
+
+class MmapVirtualFileRegion : public VirtualFileRegion {
+  private:
+	std::shared_ptr<MappedFile> mapping_;
+	long start_;
+	long end_;
+	long size_;
+	long cursor_;
+
+  public:
+	MmapVirtualFileRegion(std::shared_ptr<MappedFile> mapping, long start,
+						  long length);
+	MmapVirtualFileRegion(std::string filename);
+	~MmapVirtualFileRegion();
+	long size() const override;
+	int vfseek(long offset, int origin) override;
+	long vftell() override;
+	void vfread(void *buffer, long size) override;
+	void read_at(long offset, void *buffer, long size) override;
+	void reset() override;
+	VirtualFileRegion *slice(long start, long length) override;
+	std::string_view view(long offset, long length) override;
+	std::string object_id() const override;
+	long object_offset(long offset) const override;
+};
+
+// A local file opened for IoUringVirtualFileRegion, shared by its slices
+struct UringFile {
+	std::string filename;
+	int fd;
+	bool direct; // opened O_DIRECT
+	long size;
+
+	// throws ReadError if the file cannot be opened
+	UringFile(std::string filename, bool direct);
+	~UringFile();
+};
+
+// Local file read through io_uring. vfreadv_async hands all of its ranges,
+// e.g. a query's oahu blocks or FM chunks, to the kernel in one submission
+// instead of a pread each. With direct the file is opened O_DIRECT so the
+// page cache stays out of the way: reads are widened to IO_URING_ALIGN and
+// land in a bounce buffer registered with the thread's ring. Falls back to
+// buffered reads where O_DIRECT is refused and to pread where io_uring is.
+class IoUringVirtualFileRegion : public VirtualFileRegion {
+  private:
+	std::shared_ptr<UringFile> file_;
+	long start_;
+	long end_;
+	long size_;
+	long cursor_;
+
+	// read_at for every range at once, relative to the region
+	void read_ranges(const std::vector<ReadRange> &ranges,
+					 const std::vector<char *> &buffers);
+
+  public:
+	IoUringVirtualFileRegion(std::shared_ptr<UringFile> file, long start,
+							 long length);
+	IoUringVirtualFileRegion(std::string filename, bool direct = false);
+	long size() const override;
+	int vfseek(long offset, int origin) override;
+	long vftell() override;
+	void vfread(void *buffer, long size) override;
+	void read_at(long offset, void *buffer, long size) override;
+	std::vector<std::future<std::string>>
+	vfreadv_async(const std::vector<ReadRange> &ranges) override;
+	void reset() override;
+	VirtualFileRegion *slice(long start, long length) override;
+	std::string object_id() const override;
+	long object_offset(long offset) const override;
+	bool direct() const { return file_->direct; }
+};
+
+// How S3VirtualFileRegion handles failed and slow GETs. A GET that fails
+// with a retryable error is reissued after an exponential backoff with
+// jitter, up to max_attempts tries. With hedge, a GET still outstanding after
+// the hedge_percentile latency of recent GETs (but at least
+// min_hedge_delay_us) gets up to max_hedges duplicates, and the first
+// response wins.
+struct S3ReadPolicy {
+	int max_attempts = 4;
+	long backoff_us = 50000;
+	long max_backoff_us = 2000000;
+	bool hedge = true;
+	double hedge_percentile = 0.95;
+	long min_hedge_delay_us = 10000;
+	int max_hedges = 1;
+};
+
+// Latencies of the last S3_LATENCY_SAMPLES successful GETs
+class LatencyTracker {
+	std::mutex mutex_;
+	std::vector<long> samples_;
+	size_t next_ = 0;
+
+  public:
+	void record(long latency_us);
+	// -1 until a quarter of the samples are in
+	long percentile(double p);
+};
+
+// What the requests of a remote region share with it. Both hold it, so a
+// response, retry or hedge that comes back after the region is gone only
+// touches this: the IOStats to count into and how many requests are out. The
+// region's destructor calls close(), after which nothing new is sent.
+class RemoteRequests {
+  private:
+	std::mutex mutex_;
+	std::condition_variable idle_;
+	std::string object_id_;
+	IOStats *stats_ = nullptr;
+	long out_ = 0;
+	bool closing_ = false;
+
+  public:
+	explicit RemoteRequests(std::string object_id);
+	// count more requests as out, false once closing
+	bool begin(long count = 1);
+	void end();
+	bool closing();
+	void set_stats(IOStats *stats);
+	// a request that succeeded, issued at start_us
+	void count(long bytes, long start_us);
+	// cancel pending retries and hedges, then wait for the requests out
+	void close();
+};
+
+// A range GET once it succeeded. data is empty if the body went to the
+// caller's buffer.
+struct S3Body {
+	std::string data;
+	long size = 0;
+	std::string content_range;
+	std::string etag;
 };
 
 class S3VirtualFileRegion : public VirtualFileRegion {
@@ -50,25 +383,455 @@ class S3VirtualFileRegion : public VirtualFileRegion {
 	std::string object_name_;
 	std::string region_;
 	long cursor_;
+	long coalesce_gap_;
+	std::string etag_;
+
+	// the last tail_prefetch_ bytes of the region are fetched with a single
+	// request the first time anything in them is read, footers are then
+	// parsed out of tail_ which starts at object offset tail_start_
+	long tail_prefetch_;
+	std::mutex tail_mutex_;
+	std::shared_ptr<const std::string> tail_;
+	long tail_start_;
+
+	// shared with slices, so the hedge delay learns from all of them
+	S3ReadPolicy policy_;
+	std::shared_ptr<LatencyTracker> latencies_;
 
-	const Aws::S3::S3Client &s3_client_;
+	std::shared_ptr<Aws::S3::S3Client> s3_client_;
+	std::shared_ptr<RemoteRequests> requests_;
 	Aws::S3::Model::GetObjectRequest object_request_;
 
 	Aws::S3::S3Client CreateS3Client(const std::string &region);
+	std::string_view from_tail(long position, long size);
+	void fetch_tail(std::string range, long capacity);
+	// GET with policy_ applied, fails with ReadError. The SDK writes the
+	// body, at most capacity bytes, straight into buffer if given (and the
+	// GET is not hedged) and otherwise into S3Body::data, either way it is
+	// copied only once off the wire.
+	std::future<S3Body> get_range(std::string range, long capacity,
+								  char *buffer = nullptr);
 
   public:
-	S3VirtualFileRegion(const Aws::S3::S3Client &s3_client,
+	// With tail_prefetch > 0 the object size comes from a suffix-range GET
+	// of the last tail_prefetch bytes instead of a HeadObject, and the
+	// footer is served out of that one response. The GETs of the region and
+	// its slices keep s3_client alive, the destructor waits for them.
+	S3VirtualFileRegion(std::shared_ptr<Aws::S3::S3Client> s3_client,
 						std::string bucket_name, std::string object_name,
-						std::string region);
-	S3VirtualFileRegion(const Aws::S3::S3Client &s3_client,
+						std::string region, long tail_prefetch = 0);
+	S3VirtualFileRegion(std::shared_ptr<Aws::S3::S3Client> s3_client,
 						std::string bucket_name, std::string object_name,
 						std::string region, long start, long length);
 	~S3VirtualFileRegion();
 	long size() const override;
+	// HEAD, retried like GETs. Like the constructors and reads it throws
+	// ReadError instead of giving up on the process.
 	long object_size();
 	int vfseek(long offset, int origin) override;
 	long vftell() override;
 	void vfread(void *buffer, long size) override;
+	void read_at(long offset, void *buffer, long size) override;
+	std::future<std::string> read_at_async(long offset, long length) override;
+	std::vector<std::future<std::string>>
+	vfreadv_async(const std::vector<ReadRange> &ranges) override;
 	void reset() override;
 	VirtualFileRegion *slice(long start, long length) override;
+	std::string_view view(long offset, long length) override;
+	std::string object_id() const override;
+	long object_offset(long offset) const override;
+	std::string object_version() const override;
+	void set_stats(IOStats *stats) override;
+
+	// ranges at most this many bytes apart are fetched with a single GET,
+	// 0 only merges overlapping and adjacent ranges
+	void set_coalesce_gap(long gap);
+	// applies to this region and slices taken afterwards
+	void set_read_policy(S3ReadPolicy policy);
+};
+
+// What a simulated request does on top of its cost
+struct SimulatedFault {
+	bool fail = false;
+	bool retryable = true;
+	long extra_us = 0;
+};
+
+// Cost model of SimulatedRemoteVirtualFileRegion. Every request pays
+// latency_us plus up to jitter_us, then the transfer at bytes_per_second.
+// Failed and slow requests are retried and hedged by policy like S3 GETs.
+struct SimulatedRemoteConfig {
+	long latency_us = 30000;
+	long jitter_us = 10000;
+	double bytes_per_second = 100e6;
+	long coalesce_gap = S3_COALESCE_GAP;
+	unsigned seed = 0;
+	S3ReadPolicy policy;
+	// if set, called with the object offset and length of every request
+	// (retries and hedges included) to inject failures and latency
+	std::function<SimulatedFault(long offset, long length)> fault;
 };
+
+// One request served by a simulated remote, times in microseconds since the
+// trace was started
+struct SimulatedRequest {
+	std::string object;
+	long offset;
+	long length;
+	long start_us;
+	long duration_us;
+};
+
+// Requests of every region sharing it, in the order they were issued
+class RequestTrace {
+  private:
+	std::mutex mutex_;
+	std::vector<SimulatedRequest> requests_;
+	std::chrono::steady_clock::time_point epoch_;
+
+  public:
+	RequestTrace();
+	long now_us();
+	void record(SimulatedRequest request);
+	std::vector<SimulatedRequest> requests();
+	void clear();
+};
+
+// A local file that behaves like an object store: it is never memory-mapped
+// from the reader's point of view, every request completes after what the
+// config says it costs, and batches are coalesced like S3VirtualFileRegion
+// does. Requests go through the same retries and hedges as S3 GETs and wait
+// on the same timer thread, so concurrency shows up in the wall time.
+class SimulatedRemoteVirtualFileRegion : public VirtualFileRegion {
+  private:
+	std::shared_ptr<VirtualFileRegion> file_;
+	SimulatedRemoteConfig config_;
+	std::shared_ptr<RequestTrace> trace_;
+	std::shared_ptr<LatencyTracker> latencies_;
+	std::shared_ptr<RemoteRequests> requests_;
+	long cursor_;
+
+	SimulatedRemoteVirtualFileRegion(VirtualFileRegion *file,
+									 SimulatedRemoteConfig config,
+									 std::shared_ptr<RequestTrace> trace,
+									 std::shared_ptr<LatencyTracker> latencies);
+	std::future<S3Body> get_range(long offset, long length);
+
+  public:
+	SimulatedRemoteVirtualFileRegion(std::string filename,
+									 SimulatedRemoteConfig config,
+									 std::shared_ptr<RequestTrace> trace);
+	~SimulatedRemoteVirtualFileRegion();
+	long size() const override;
+	int vfseek(long offset, int origin) override;
+	long vftell() override;
+	void vfread(void *buffer, long size) override;
+	void read_at(long offset, void *buffer, long size) override;
+	std::future<std::string> read_at_async(long offset, long length) override;
+	std::vector<std::future<std::string>>
+	vfreadv_async(const std::vector<ReadRange> &ranges) override;
+	void reset() override;
+	VirtualFileRegion *slice(long start, long length) override;
+	std::string object_id() const override;
+	long object_offset(long offset) const override;
+	void set_stats(IOStats *stats) override;
+};
+
+// Process-wide LRU of pages keyed by (kind, object, version, offset, length),
+// bounded by a byte budget. Values are either raw bytes or whatever a reader
+// decoded them into, kind tells the two apart. The version keeps an
+// overwritten object from being served its old pages.
+class BlockCache {
+  private:
+	struct Entry {
+		std::string key;
+		std::shared_ptr<const void> value;
+		size_t charge;
+	};
+
+	std::mutex mutex_;
+	std::list<Entry> lru_; // most recently used first
+	std::unordered_map<std::string, std::list<Entry>::iterator> index_;
+	size_t capacity_;
+	size_t used_;
+	std::atomic<size_t> hits_;
+	std::atomic<size_t> misses_;
+
+	// pages of a pinned kind are never evicted and don't count against the
+	// budget, meant for small pages like footers that every query needs
+	std::set<std::string> pinned_kinds_;
+	std::unordered_map<std::string, std::shared_ptr<const void>> pinned_;
+
+	void evict();
+
+  public:
+	BlockCache(size_t capacity);
+
+	static BlockCache &instance();
+	// kind, object, version and range of a page at offset of vfr
+	static std::string make_key(const VirtualFileRegion *vfr, long offset,
+								long length, const std::string &kind);
+
+	std::shared_ptr<const void> lookup(const std::string &key);
+	void insert(const std::string &key, std::shared_ptr<const void> value,
+				size_t charge);
+	void set_capacity(size_t capacity);
+	void pin_kind(const std::string &kind);
+	void clear();
+
+	size_t capacity();
+	size_t used();
+	size_t hits() const { return hits_; }
+	size_t misses() const { return misses_; }
+};
+
+enum CachePages { CACHE_RAW = 1, CACHE_DECODED = 2 };
+
+// Decorator that puts a BlockCache in front of another region. With
+// CACHE_RAW every read_at is served from the cache when possible, with
+// CACHE_DECODED read_decoded() keeps the decoded form of pages instead.
+class CachingVirtualFileRegion : public VirtualFileRegion {
+  private:
+	std::unique_ptr<VirtualFileRegion> inner_;
+	int pages_;
+	BlockCache *cache_;
+	long cursor_;
+
+  public:
+	// takes ownership of inner
+	CachingVirtualFileRegion(VirtualFileRegion *inner,
+							 int pages = CACHE_RAW | CACHE_DECODED,
+							 BlockCache *cache = &BlockCache::instance());
+	~CachingVirtualFileRegion();
+	long size() const override;
+	int vfseek(long offset, int origin) override;
+	long vftell() override;
+	void vfread(void *buffer, long size) override;
+	void read_at(long offset, void *buffer, long size) override;
+	std::vector<std::future<std::string>>
+	vfreadv_async(const std::vector<ReadRange> &ranges) override;
+	void reset() override;
+	VirtualFileRegion *slice(long start, long length) override;
+	std::string_view view(long offset, long length) override;
+	std::string object_id() const override;
+	long object_offset(long offset) const override;
+	std::string object_version() const override;
+	BlockCache *block_cache() override;
+	VirtualFileRegion *backing() override;
+	void set_stats(IOStats *stats) override;
+};
+
+// Byte-budgeted cache of raw pages in a local directory that outlives the
+// process and may be shared by several. Every page is a file named after a
+// hash of its key, with the key stored in front of the data to rule out
+// collisions. Usage comes from the directory itself: it is summed up when the
+// cache is opened, and again once this process has added what eviction frees
+// up or would go over the budget. If the directory is over it, the files least
+// recently modified go until DISK_CACHE_LOW_WATER of the budget is left. Reads
+// touch the files they hit.
+class DiskCache {
+  private:
+	std::string directory_;
+	std::mutex mutex_;
+	size_t capacity_;
+	size_t used_; // as of the last scan, plus inserts since
+	size_t scanned_; // as of the last scan
+	std::atomic<size_t> hits_;
+	std::atomic<size_t> misses_;
+
+	static std::mutex instance_mutex_;
+	static std::shared_ptr<DiskCache> instance_;
+
+	std::string path(const std::string &name) const;
+	// scan the directory and evict if it is over budget, caller holds mutex_
+	void evict();
+
+  public:
+	DiskCache(std::string directory, size_t capacity);
+
+	// process-wide cache used by search_all, null until configure() is called.
+	// Regions opened before a configure() keep the cache they were given.
+	static std::shared_ptr<DiskCache> instance();
+	static void configure(std::string directory, size_t capacity);
+	static std::string make_key(const VirtualFileRegion *vfr, long offset,
+								long length);
+
+	bool lookup(const std::string &key, std::string &value);
+	void insert(const std::string &key, const std::string &value);
+
+	size_t capacity();
+	size_t used();
+	size_t hits() const { return hits_; }
+	size_t misses() const { return misses_; }
+};
+
+// Decorator that serves reads from a DiskCache and fills it on a miss. Pages
+// are keyed by object, version and range, so an overwritten object never
+// serves stale bytes.
+class DiskCachingVirtualFileRegion : public VirtualFileRegion {
+  private:
+	std::unique_ptr<VirtualFileRegion> inner_;
+	std::shared_ptr<DiskCache> cache_;
+	long cursor_;
+
+  public:
+	// takes ownership of inner
+	DiskCachingVirtualFileRegion(VirtualFileRegion *inner,
+								 std::shared_ptr<DiskCache> cache);
+	~DiskCachingVirtualFileRegion();
+	long size() const override;
+	int vfseek(long offset, int origin) override;
+	long vftell() override;
+	void vfread(void *buffer, long size) override;
+	void read_at(long offset, void *buffer, long size) override;
+	std::vector<std::future<std::string>>
+	vfreadv_async(const std::vector<ReadRange> &ranges) override;
+	void reset() override;
+	VirtualFileRegion *slice(long start, long length) override;
+	std::string_view view(long offset, long length) override;
+	std::string object_id() const override;
+	long object_offset(long offset) const override;
+	std::string object_version() const override;
+	void set_stats(IOStats *stats) override;
+};
+
+// Read [offset, offset + length) and decode it, going through the region's
+// BlockCache if it has one. decode(const char *, size_t) builds the value,
+// charge(const T &) says how many bytes of the budget it takes up.
+template <typename T, typename Decode, typename Charge>
+std::shared_ptr<const T> read_decoded(VirtualFileRegion *vfr, long offset,
+									  long length, const std::string &kind,
+									  Decode decode, Charge charge) {
+	BlockCache *cache = vfr->block_cache();
+	IOStats *stats = vfr->stats();
+	std::string key;
+	if (cache) {
+		key = BlockCache::make_key(vfr, offset, length, kind);
+		std::shared_ptr<const void> hit = cache->lookup(key);
+		if (hit) {
+			if (stats) {
+				stats->record_hit(vfr->object_id(), kind);
+			}
+			return std::static_pointer_cast<const T>(hit);
+		}
+	}
+	std::string scratch;
+	long start_us = IOStats::now_us();
+	std::string_view raw = vfr->backing()->view_or_read(offset, length, scratch);
+	if (stats) {
+		stats->record_read(vfr->object_id(), kind, length,
+						   IOStats::now_us() - start_us);
+	}
+	std::shared_ptr<const T> value =
+		std::make_shared<const T>(decode(raw.data(), raw.size()));
+	if (cache) {
+		cache->insert(key, value, charge(*value));
+	}
+	return value;
+}
+
+template <typename T> std::future<T> ready_future(T value) {
+	std::promise<T> promise;
+	promise.set_value(std::move(value));
+	return promise.get_future();
+}
+
+// read_decoded for several pages at once. Cached pages come back ready, the
+// rest are requested with a single vfreadv_async and decoded by whichever
+// thread calls get() on their future, so fetches for all of them are in
+// flight while the first ones are decoded.
+template <typename T, typename Decode, typename Charge>
+std::vector<std::future<std::shared_ptr<const T>>>
+read_decoded_async(VirtualFileRegion *vfr, const std::vector<ReadRange> &ranges,
+				   const std::string &kind, Decode decode, Charge charge) {
+	BlockCache *cache = vfr->block_cache();
+	IOStats *stats = vfr->stats();
+	std::string object_id = vfr->object_id();
+	VirtualFileRegion *backing = vfr->backing();
+	std::vector<std::future<std::shared_ptr<const T>>> values(ranges.size());
+	std::vector<std::string> keys(ranges.size());
+	std::vector<size_t> to_fetch;
+	std::vector<ReadRange> fetch_ranges;
+
+	auto decode_and_cache = [cache, decode, charge](std::string_view raw,
+													 const std::string &key) {
+		std::shared_ptr<const T> value =
+			std::make_shared<const T>(decode(raw.data(), raw.size()));
+		if (cache) {
+			cache->insert(key, value, charge(*value));
+		}
+		return value;
+	};
+
+	for (size_t i = 0; i < ranges.size(); i++) {
+		if (cache) {
+			keys[i] = BlockCache::make_key(vfr, ranges[i].offset,
+										   ranges[i].length, kind);
+			std::shared_ptr<const void> hit = cache->lookup(keys[i]);
+			if (hit) {
+				if (stats) {
+					stats->record_hit(object_id, kind);
+				}
+				values[i] = ready_future(std::static_pointer_cast<const T>(hit));
+				continue;
+			}
+		}
+		std::string_view mapped = backing->view(ranges[i].offset, ranges[i].length);
+		if (mapped.data()) {
+			if (stats) {
+				stats->record_read(object_id, kind, ranges[i].length, 0);
+			}
+			values[i] = std::async(std::launch::deferred, decode_and_cache,
+								   mapped, keys[i]);
+		} else {
+			to_fetch.push_back(i);
+			fetch_ranges.push_back(ranges[i]);
+		}
+	}
+
+	if (fetch_ranges.empty()) {
+		return values;
+	}
+	long start_us = IOStats::now_us();
+	std::vector<std::future<std::string>> bodies =
+		backing->vfreadv_async(fetch_ranges);
+	for (size_t j = 0; j < to_fetch.size(); j++) {
+		// latency runs from issuing the batch until the body is waited on
+		// and in, which is as close to arrival as a deferred future gets
+		values[to_fetch[j]] = std::async(
+			std::launch::deferred,
+			[decode_and_cache, stats, object_id, kind,
+			 start_us](std::future<std::string> body, const std::string &key) {
+				std::string raw = body.get();
+				if (stats) {
+					stats->record_read(object_id, kind, raw.size(),
+									   IOStats::now_us() - start_us);
+				}
+				return decode_and_cache(raw, key);
+			},
+			std::move(bodies[j]), keys[to_fetch[j]]);
+	}
+	return values;
+}
+
+// read_decoded_async that waits for every page, decoding them in parallel
+template <typename T, typename Decode, typename Charge>
+std::vector<std::shared_ptr<const T>>
+read_decoded_batch(VirtualFileRegion *vfr, const std::vector<ReadRange> &ranges,
+				   const std::string &kind, Decode decode, Charge charge) {
+	std::vector<std::future<std::shared_ptr<const T>>> futures =
+		read_decoded_async<T>(vfr, ranges, kind, decode, charge);
+	std::vector<std::shared_ptr<const T>> values(ranges.size());
+	ParallelErrors errors;
+#pragma omp parallel for schedule(dynamic) if (ranges.size() > 1)
+	for (size_t i = 0; i < ranges.size(); i++) {
+		errors.run([&] { values[i] = futures[i].get(); });
+	}
+	errors.rethrow();
+	return values;
+}
+
+// read_decoded for a single zstd frame
+std::shared_ptr<const std::string> read_decompressed(VirtualFileRegion *vfr,
+													 long offset, long length,
+													 const std::string &kind);
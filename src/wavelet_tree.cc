@@ -0,0 +1,295 @@
+#include "wavelet_tree.h"
+
+WaveletChunk::WaveletChunk(std::vector<uint64_t> words, size_t zeros_before,
+						   size_t ones_before)
+	: words_(std::move(words)), zeros_before_(zeros_before),
+	  ones_before_(ones_before) {
+	// one more block than needed for the words, rank1 of the end of a chunk
+	// that fills its last block looks there
+	size_t num_blocks = words_.size() / 8 + 1;
+	counts_.resize(2 * num_blocks);
+	uint64_t ones = 0;
+	for (size_t block = 0; block < num_blocks; block++) {
+		counts_[2 * block] = ones;
+		uint64_t in_block = 0;
+		uint64_t sub_counts = 0;
+		for (size_t i = 0; i < 8; i++) {
+			size_t word = block * 8 + i;
+			if (i > 0) {
+				sub_counts |= in_block << (9 * (i - 1));
+			}
+			if (word < words_.size()) {
+				in_block += __builtin_popcountll(words_[word]);
+			}
+		}
+		counts_[2 * block + 1] = sub_counts;
+		ones += in_block;
+	}
+}
+
+std::string WaveletChunk::serialize(const std::vector<uint64_t> &words,
+									size_t zeros_before, size_t ones_before,
+									Codec codec) {
+	std::string compressed = Compressor(codec).compress(
+		reinterpret_cast<const char *>(words.data()),
+		words.size() * sizeof(uint64_t));
+	std::string chunk(2 * sizeof(size_t) + compressed.size(), '\0');
+	memcpy(chunk.data(), &zeros_before, sizeof(size_t));
+	memcpy(chunk.data() + sizeof(size_t), &ones_before, sizeof(size_t));
+	memcpy(chunk.data() + 2 * sizeof(size_t), compressed.data(),
+		   compressed.size());
+	return chunk;
+}
+
+WaveletChunk WaveletChunk::deserialize(const char *data, size_t size,
+									   CompressionAlgorithm codec) {
+	if (size < 2 * sizeof(size_t)) {
+		throw ReadError("truncated wavelet tree chunk");
+	}
+	size_t zeros_before, ones_before;
+	memcpy(&zeros_before, data, sizeof(size_t));
+	memcpy(&ones_before, data + sizeof(size_t), sizeof(size_t));
+	data += 2 * sizeof(size_t);
+	size -= 2 * sizeof(size_t);
+
+	Compressor compressor(codec);
+	// compress gives "" for empty input
+	size_t bytes = size > 0 ? compressor.decompressed_size(data, size) : 0;
+	if (bytes % sizeof(uint64_t) != 0) {
+		throw ReadError("truncated wavelet tree chunk");
+	}
+	std::vector<uint64_t> words(bytes / sizeof(uint64_t));
+	if (bytes > 0 && compressor.decompress_into(
+						 data, size, reinterpret_cast<char *>(words.data()),
+						 bytes) != bytes) {
+		throw ReadError("truncated wavelet tree chunk");
+	}
+	return WaveletChunk(std::move(words), zeros_before, ones_before);
+}
+
+size_t WaveletChunk::rank1(size_t pos) const {
+	assert(pos <= words_.size() * 64);
+	size_t block = pos / 512;
+	size_t word = pos / 64;
+	size_t in_block = word % 8;
+	size_t ones = counts_[2 * block];
+	if (in_block > 0) {
+		ones += (counts_[2 * block + 1] >> (9 * (in_block - 1))) & 0x1FF;
+	}
+	if (pos % 64) {
+		ones += __builtin_popcountll(words_[word] &
+									 ((uint64_t(1) << (pos % 64)) - 1));
+	}
+	return ones;
+}
+
+size_t WaveletChunk::rank(bool bit, size_t pos) const {
+	size_t ones = rank1(pos);
+	return bit ? ones_before_ + ones : zeros_before_ + pos - ones;
+}
+
+size_t WaveletChunk::byte_size() const {
+	return sizeof(WaveletChunk) +
+		   (words_.size() + counts_.size()) * sizeof(uint64_t);
+}
+
+WaveletTreeWriter::WaveletTreeWriter(FILE *fp, Codec chunk_codec)
+	: fp_(fp), chunk_codec_(chunk_codec), base_offset_(ftell(fp)),
+	  nodes_(WAVELET_NODES), blocks_(fp) {}
+
+void WaveletTreeWriter::push(char c) {
+	unsigned char uc = c;
+	size_t node = 0;
+	for (int level = 0; level < LOG_ALPHABET; level++) {
+		bool bit = (uc >> (LOG_ALPHABET - 1 - level)) & 1;
+		Node &current = nodes_[node];
+		if (current.bits % 64 == 0) {
+			current.words.push_back(0);
+		}
+		current.words.back() |= uint64_t(bit) << (current.bits % 64);
+		current.bits++;
+		if (current.bits % WAVELET_CHUNK_BITS == 0) {
+			flush(node);
+		}
+		node = 2 * node + 1 + bit;
+	}
+}
+
+void WaveletTreeWriter::flush(size_t node) {
+	Node &current = nodes_[node];
+	size_t ones = 0;
+	for (uint64_t word : current.words) {
+		ones += __builtin_popcountll(word);
+	}
+	size_t chunk_bits = (current.bits - 1) % WAVELET_CHUNK_BITS + 1;
+	blocks_.write(
+		[words = std::move(current.words), zeros = current.zeros,
+		 ones = current.ones, codec = chunk_codec_] {
+			return WaveletChunk::serialize(words, zeros, ones, codec);
+		},
+		[this](size_t size) { offsets_.push_back(offsets_.back() + size); });
+	current.chunk_ids.push_back(num_chunks_++);
+	current.zeros += chunk_bits - ones;
+	current.ones += ones;
+	current.words = {};
+}
+
+void WaveletTreeWriter::finish(const std::vector<size_t> &C, size_t n) {
+	// the partly filled last chunk of every node
+	for (size_t node = 0; node < WAVELET_NODES; node++) {
+		if (nodes_[node].bits % WAVELET_CHUNK_BITS != 0) {
+			flush(node);
+		}
+	}
+	blocks_.finish();
+
+	std::vector<size_t> directory = {0};
+	for (const Node &node : nodes_) {
+		directory.push_back(directory.back() + node.chunk_ids.size());
+	}
+	for (const Node &node : nodes_) {
+		directory.insert(directory.end(), node.chunk_ids.begin(),
+						 node.chunk_ids.end());
+	}
+	LOG(INFO) << "number of wavelet chunks " << num_chunks_ << std::endl;
+
+	Compressor compressor(CompressionAlgorithm::ZSTD);
+	size_t footer[4];
+	footer[0] = ftell(fp_) - base_offset_;
+	std::string compressed = compressor.compress(
+		(char *)offsets_.data(), offsets_.size() * sizeof(size_t));
+	fwrite(compressed.data(), 1, compressed.size(), fp_);
+	footer[1] = ftell(fp_) - base_offset_;
+	compressed = compressor.compress((char *)directory.data(),
+									 directory.size() * sizeof(size_t));
+	fwrite(compressed.data(), 1, compressed.size(), fp_);
+	footer[2] = ftell(fp_) - base_offset_;
+	compressed =
+		compressor.compress((char *)C.data(), C.size() * sizeof(size_t));
+	fwrite(compressed.data(), 1, compressed.size(), fp_);
+	footer[3] = n;
+	fwrite(footer, sizeof(size_t), 4, fp_);
+}
+
+namespace {
+
+struct WaveletFooter {
+	std::vector<size_t> offsets;
+	std::vector<size_t> directory;
+	std::vector<size_t> C;
+};
+
+std::shared_ptr<const WaveletFooter> read_wavelet_footer(VirtualFileRegion *vfr,
+														 size_t &n) {
+	size_t file_size = vfr->size();
+	size_t trailer[4];
+	read_trailer(vfr, file_size - sizeof(trailer), trailer, sizeof(trailer));
+	n = trailer[3];
+	size_t start = trailer[0];
+	return read_decoded<WaveletFooter>(
+		vfr, start, file_size - sizeof(trailer) - start, "wavelet_metadata",
+		[&](const char *buffer, size_t size) {
+			WaveletFooter footer;
+			footer.offsets =
+				decompress_size_t_array(buffer, trailer[1] - start);
+			footer.directory = decompress_size_t_array(
+				buffer + trailer[1] - start, trailer[2] - trailer[1]);
+			footer.C = decompress_size_t_array(buffer + trailer[2] - start,
+											   size - (trailer[2] - start));
+			if (footer.directory.size() < WAVELET_NODES + 1 ||
+				footer.C.size() != ALPHABET) {
+				throw ReadError("malformed wavelet tree footer");
+			}
+			return footer;
+		},
+		[](const WaveletFooter &footer) {
+			return (footer.offsets.size() + footer.directory.size() +
+					footer.C.size()) *
+				   sizeof(size_t);
+		});
+}
+
+} // namespace
+
+std::tuple<size_t, size_t>
+search_wavelet_tree(VirtualFileRegion *vfr, const char *P, size_t Psize,
+					bool early_exit, CompressionAlgorithm chunk_codec) {
+
+	size_t n;
+	auto footer = read_wavelet_footer(vfr, n);
+	const std::vector<size_t> &offsets = footer->offsets;
+	const std::vector<size_t> &directory = footer->directory;
+
+	// rank of bit before pos in node, for start and end at once since they
+	// go down the same nodes. Their chunks are fetched in one batch.
+	auto rank_both = [&](size_t node, bool bit, size_t &start, size_t &end) {
+		size_t positions[2] = {start, end};
+		std::vector<ReadRange> ranges;
+		size_t chunk_of[2];
+		for (int i = 0; i < 2; i++) {
+			if (positions[i] == 0) {
+				continue;
+			}
+			// a position at the end of a chunk ranks in that chunk
+			size_t chunk = (positions[i] - 1) / WAVELET_CHUNK_BITS;
+			size_t index = directory[node] + chunk;
+			if (index >= directory[node + 1]) {
+				throw ReadError("wavelet tree position past its node");
+			}
+			size_t id = directory[WAVELET_NODES + 1 + index];
+			if (ranges.empty() || ranges.back().offset != (long)offsets[id]) {
+				ranges.push_back(
+					{(long)offsets[id], (long)(offsets[id + 1] - offsets[id])});
+			}
+			chunk_of[i] = ranges.size() - 1;
+		}
+		auto chunks = read_decoded_batch<WaveletChunk>(
+			vfr, ranges, "wavelet_chunk",
+			[chunk_codec](const char *data, size_t size) {
+				return WaveletChunk::deserialize(data, size, chunk_codec);
+			},
+			[](const WaveletChunk &chunk) { return chunk.byte_size(); });
+		for (int i = 0; i < 2; i++) {
+			if (positions[i] == 0) {
+				continue;
+			}
+			size_t in_chunk = (positions[i] - 1) % WAVELET_CHUNK_BITS + 1;
+			positions[i] = chunks[chunk_of[i]]->rank(bit, in_chunk);
+		}
+		start = positions[0];
+		end = positions[1];
+	};
+
+	size_t start = 0;
+	size_t end = n + 1;
+
+	size_t previous_range = -1;
+	for (int i = Psize - 1; i >= 0; i--) {
+		unsigned char c = P[i];
+		LOG(INFO) << "c: " << c << std::endl;
+
+		size_t node = 0;
+		for (int level = 0; level < LOG_ALPHABET; level++) {
+			bool bit = (c >> (LOG_ALPHABET - 1 - level)) & 1;
+			rank_both(node, bit, start, end);
+			node = 2 * node + 1 + bit;
+		}
+		start += footer->C[c];
+		end += footer->C[c];
+
+		LOG(INFO) << "start: " << start << std::endl;
+		LOG(INFO) << "end: " << end << std::endl;
+		LOG(INFO) << "range: " << end - start << std::endl;
+		if (start >= end) {
+			LOG(INFO) << "not found" << std::endl;
+			return std::make_tuple(-1, -1);
+		}
+		if (early_exit && (end - start == previous_range)) {
+			LOG(INFO) << "early exit" << std::endl;
+			return std::make_tuple(start, end);
+		}
+		previous_range = end - start;
+	}
+
+	return std::make_tuple(start, end);
+}
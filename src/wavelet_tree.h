@@ -0,0 +1,100 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include "block_writer.h"
+#include "compressor.h"
+#include "fm_index.h"
+#include "vfr.h"
+
+#define LOG_ALPHABET 8
+// one bitvector per inner node of the tree over the 8 bits of a character,
+// root first and the children of node k at 2k + 1 and 2k + 2
+#define WAVELET_NODES (ALPHABET - 1)
+// bits per wavelet chunk, a chunk of every level takes up as much as one FM
+// chunk of FM_IDX_CHUNK_CHARS characters
+#define WAVELET_CHUNK_BITS (1 << 20)
+
+/*
+A chunk of one node's bitvector, with rank9 counts: for every 512 bits the
+ones before them in the chunk, and the ones before each of the next seven 64
+bit words in 9 bit fields of a second word. rank() is those two lookups and a
+popcount.
+
+Serialized it is the zeros and the ones of the node before the chunk as two
+plain size_t, then the bits in little endian 64 bit words through the chunk
+codec. The words decompress straight into the chunk's vector.
+*/
+class WaveletChunk {
+  public:
+	explicit WaveletChunk(std::vector<uint64_t> words, size_t zeros_before = 0,
+						  size_t ones_before = 0);
+
+	static std::string serialize(const std::vector<uint64_t> &words,
+								 size_t zeros_before, size_t ones_before,
+								 Codec codec);
+	// throws ReadError if the chunk is cut short
+	static WaveletChunk deserialize(const char *data, size_t size,
+									CompressionAlgorithm codec);
+
+	// occurrences of bit before pos of the chunk in the whole node
+	size_t rank(bool bit, size_t pos) const;
+	size_t rank1(size_t pos) const;
+
+	size_t byte_size() const;
+
+  private:
+	std::vector<uint64_t> words_;
+	std::vector<uint64_t> counts_; // two per 512 bits
+	size_t zeros_before_;
+	size_t ones_before_;
+};
+
+/*
+Takes the BWT a character at a time, like FMIndexWriter, and writes the node
+bitvectors as chunks of WAVELET_CHUNK_BITS as they fill up. Chunks of
+different nodes end up interleaved, so the footer has a directory of them:
+
+	- chunk offsets: the byte offsets of the chunks in file order
+	- directory: where each node's chunks start in the list that follows,
+	  WAVELET_NODES + 1 entries, then the chunk ids of every node in order
+	- C vector: the C vector for the FM index
+	- 32 bytes: where the three above start, and n
+*/
+class WaveletTreeWriter {
+  public:
+	WaveletTreeWriter(FILE *fp, Codec chunk_codec);
+
+	void push(char c);
+	void finish(const std::vector<size_t> &C, size_t n);
+
+  private:
+	struct Node {
+		std::vector<uint64_t> words;
+		size_t bits = 0;
+		size_t zeros = 0; // before the chunk being filled
+		size_t ones = 0;
+		std::vector<size_t> chunk_ids;
+	};
+
+	FILE *fp_;
+	Codec chunk_codec_;
+	size_t base_offset_;
+	std::vector<size_t> offsets_ = {0};
+	std::vector<Node> nodes_;
+	size_t num_chunks_ = 0;
+	BlockWriter blocks_;
+
+	void flush(size_t node);
+};
+
+// the same (start, end) as search_fm_index, over a file WaveletTreeWriter
+// wrote
+std::tuple<size_t, size_t>
+search_wavelet_tree(VirtualFileRegion *vfr, const char *P, size_t Psize,
+					bool early_exit,
+					CompressionAlgorithm chunk_codec = CompressionAlgorithm::ZSTD);
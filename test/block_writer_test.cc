@@ -0,0 +1,111 @@
+#include "block_writer.h"
+#include "cassert"
+#include <chrono>
+#include <iostream>
+#include <stdexcept>
+
+// the contents of fp from the start
+std::string read_back(FILE *fp)
+{
+    std::string bytes(ftell(fp), '\0');
+    rewind(fp);
+    size_t read = fread(bytes.data(), 1, bytes.size(), fp);
+    assert(read == bytes.size());
+    return bytes;
+}
+
+// blocks handed in first take longest, so the workers finish them out of
+// order, and they still land in the file in order with their offsets
+int test_ordered_writes()
+{
+    FILE *fp = tmpfile();
+    std::vector<size_t> offsets = {0};
+    std::string expected;
+    {
+        BlockWriter writer(fp, 4);
+        for (int i = 0; i < 24; i++)
+        {
+            std::string block(1 + i * 37 % 101, 'a' + i);
+            expected += block;
+            writer.write(
+                [block, i] {
+                    std::this_thread::sleep_for(std::chrono::milliseconds(2 * (8 - i % 8)));
+                    return block;
+                },
+                [&offsets](size_t size) { offsets.push_back(offsets.back() + size); });
+        }
+        writer.finish();
+    }
+    assert(read_back(fp) == expected);
+    assert(offsets.size() == 25 && offsets.back() == expected.size());
+    for (int i = 0; i < 24; i++)
+    {
+        assert(expected[offsets[i]] == 'a' + i);
+        assert(offsets[i + 1] - offsets[i] == (size_t)(1 + i * 37 % 101));
+    }
+    fclose(fp);
+    return 0;
+}
+
+// an encode function that throws reaches the caller from the write() or
+// finish() that gets to its block, everything before it is written and the
+// writer still shuts down
+int test_encode_error()
+{
+    FILE *fp = tmpfile();
+    size_t written = 0;
+    bool caught = false;
+    try
+    {
+        BlockWriter writer(fp, 2);
+        for (int i = 0; i < 64; i++)
+        {
+            writer.write(
+                [i]() -> std::string {
+                    if (i == 5)
+                    {
+                        throw std::runtime_error("block 5");
+                    }
+                    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                    return std::string(10, 'x');
+                },
+                [&written](size_t) { written++; });
+        }
+        writer.finish();
+    }
+    catch (const std::runtime_error &e)
+    {
+        caught = std::string(e.what()) == "block 5";
+    }
+    assert(caught);
+    assert(written == 5);
+    assert(read_back(fp) == std::string(50, 'x'));
+    fclose(fp);
+
+    // and from finish() when it is among the last ones
+    fp = tmpfile();
+    caught = false;
+    try
+    {
+        BlockWriter writer(fp, 2);
+        writer.write([] { return std::string("ok"); });
+        writer.write([]() -> std::string { throw std::runtime_error("last"); });
+        writer.finish();
+    }
+    catch (const std::runtime_error &e)
+    {
+        caught = std::string(e.what()) == "last";
+    }
+    assert(caught);
+    assert(read_back(fp) == "ok");
+    fclose(fp);
+    return 0;
+}
+
+int main()
+{
+    test_ordered_writes();
+    test_encode_error();
+    std::cout << "block writer tests passed" << std::endl;
+    return 0;
+}
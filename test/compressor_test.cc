@@ -1,5 +1,6 @@
 #include "compressor.h"
 #include <cassert>
+#include <thread>
 
 int main() {
   std::string inputData = "This is a test string for compression.";
@@ -23,5 +24,53 @@ int main() {
   std::string decompressedLZ4 = compressorLZ4.decompress(compressedLZ4);
   assert(inputData == decompressedLZ4);
 
+  // decompress_into a caller's buffer, sized up front where the format
+  // records it
+  assert(compressorZstd.decompressed_size(compressedZstd.data(),
+                                          compressedZstd.size()) ==
+         inputData.size());
+  assert(compressorSnappy.decompressed_size(compressedSnappy.data(),
+                                            compressedSnappy.size()) ==
+         inputData.size());
+  assert(compressorLZ4.decompressed_size(compressedLZ4.data(),
+                                         compressedLZ4.size()) ==
+         inputData.size());
+  for (auto [compressor, compressed] :
+       {std::make_pair(&compressorZstd, &compressedZstd),
+        std::make_pair(&compressorSnappy, &compressedSnappy),
+        std::make_pair(&compressorLZ4, &compressedLZ4)}) {
+    std::string buffer(inputData.size() + 16, '\0');
+    size_t written = compressor->decompress_into(
+        compressed->data(), compressed->size(), buffer.data(), buffer.size());
+    assert(buffer.substr(0, written) == inputData);
+
+    bool threw = false;
+    try {
+      compressor->decompress_into(compressed->data(), compressed->size(),
+                                  buffer.data(), inputData.size() - 1);
+    } catch (const std::runtime_error &) {
+      threw = true;
+    }
+    assert(threw);
+  }
+
+  // contexts are reused across calls, on this thread and others
+  std::string longData(1 << 20, 'a');
+
+  // LZ4 used to guess 4x the compressed size for its output
+  for (int level : {0, 9}) {
+    Compressor compressor(Codec{CompressionAlgorithm::LZ4, level});
+    std::string compressed = compressor.compress(longData.data(), longData.size());
+    assert(compressed.size() * 4 < longData.size());
+    assert(compressor.decompress(compressed) == longData);
+  }
+  for (int i = 0; i < 3; i++) {
+    std::thread([&] {
+      std::string compressed =
+          compressorZstd.compress(longData.data(), longData.size());
+      assert(compressorZstd.decompress(compressed) == longData);
+    }).join();
+  }
+
   return 0;
 }
@@ -1,4 +1,5 @@
 #include "index.h"
+#include "wavelet_tree.h"
 
 const std::vector<std::string> queries = {"system", "openstack", "openstack-1", "1bad-44dc-8505", "10036", "T9xqQRK4yyc"};
 const std::vector<size_t> chunk_sizes = {1, 1000};
@@ -36,17 +37,66 @@ int test_hawaii(size_t chunk_size)
 
 	write_hawaii("test", type_input_files, type_uncompressed_lines_in_block);
     VirtualFileRegion * vfr_hawaii = new DiskVirtualFileRegion("test.hawaii");
+    VirtualFileRegion * vfr_hawaii_mmap = new MmapVirtualFileRegion("test.hawaii");
+    VirtualFileRegion * vfr_hawaii_uring = new IoUringVirtualFileRegion("test.hawaii");
+    VirtualFileRegion * vfr_hawaii_uring_direct = new IoUringVirtualFileRegion("test.hawaii", true);
+    BlockCache cache(BLOCK_CACHE_BYTES);
+    VirtualFileRegion * vfr_hawaii_cached = new CachingVirtualFileRegion(new DiskVirtualFileRegion("test.hawaii"), CACHE_RAW | CACHE_DECODED, &cache);
+    std::filesystem::remove_all("test_disk_cache");
+    auto disk_cache = std::make_shared<DiskCache>("test_disk_cache", DISK_CACHE_BYTES);
+    VirtualFileRegion * vfr_hawaii_disk_cached = new DiskCachingVirtualFileRegion(new DiskVirtualFileRegion("test.hawaii"), disk_cache);
+    // the same index with LZ4 FM chunks and log_idx chunks
+    write_hawaii("test_lz4", type_input_files, type_uncompressed_lines_in_block,
+                 Codec{CompressionAlgorithm::LZ4, 0}, Codec{CompressionAlgorithm::LZ4, 0});
+    VirtualFileRegion * vfr_hawaii_lz4 = new DiskVirtualFileRegion("test_lz4.hawaii");
+    // and with wavelet trees instead of FM chunks
+    write_hawaii("test_wavelet", type_input_files, type_uncompressed_lines_in_block,
+                 Codec(), Codec(), FMBackend::WAVELET);
+    VirtualFileRegion * vfr_hawaii_wavelet = new DiskVirtualFileRegion("test_wavelet.hawaii");
 
     for (auto query : queries)
     {
-        std::map<int, std::set<size_t>> result = search_hawaii(vfr_hawaii, types, query, false);
+        IOStats stats;
+        vfr_hawaii->set_stats(&stats);
+        std::map<int, roaring::Roaring> result = search_hawaii(vfr_hawaii, types, query, false);
+        vfr_hawaii->set_stats(nullptr);
+        // every page the search decoded was read from the file
+        assert(stats.requests("hawaii").count > 0);
+        assert(stats.reads("hawaii", "footer").count > 0);
+        assert(stats.reads("hawaii", "fm_chunk").count > 0);
+        // the zero-copy mmap path has to agree with the fread path
+        assert(search_hawaii(vfr_hawaii_mmap, types, query, false) == result);
+        // and the batched io_uring reads, buffered and O_DIRECT
+        assert(search_hawaii(vfr_hawaii_uring, types, query, false) == result);
+        assert(search_hawaii(vfr_hawaii_uring_direct, types, query, false) == result);
+        // and the codecs recorded in the metadata page
+        assert(search_hawaii(vfr_hawaii_lz4, types, query, false) == result);
+        // the wavelet tree finds the same, early exit included
+        assert(search_hawaii(vfr_hawaii_wavelet, types, query, false) == result);
+        assert(search_hawaii(vfr_hawaii_wavelet, types, query, true) ==
+               search_hawaii(vfr_hawaii, types, query, true));
+        // so does the cached one, cold and warm
+        assert(search_hawaii(vfr_hawaii_cached, types, query, false) == result);
+        size_t misses = cache.misses();
+        assert(search_hawaii(vfr_hawaii_cached, types, query, false) == result);
+        assert(cache.misses() == misses && cache.hits() > 0);
+        // and the disk cache, a second pass is served entirely from disk
+        assert(search_hawaii(vfr_hawaii_disk_cached, types, query, false) == result);
+        misses = disk_cache->misses();
+        assert(search_hawaii(vfr_hawaii_disk_cached, types, query, false) == result);
+        assert(disk_cache->misses() == misses && disk_cache->hits() > 0);
 
         for (auto type : types)
         {
             std::set<size_t> type_result = brute_force_search(type_input_files[type], query, chunk_size);
             if (type_result.size() > 0 )
             {
-                assert(result[type] == type_result);
+                std::set<size_t> type_chunks;
+                for (plist_size_t chunk : result[type])
+                {
+                    type_chunks.insert(chunk);
+                }
+                assert(type_chunks == type_result);
                 std::cout << "type: " << type << std::endl;
                 std::cout << "result: ";
                 for (auto i : result[type])
@@ -64,14 +114,340 @@ int test_hawaii(size_t chunk_size)
         }
     }
 
+    delete vfr_hawaii;
+    delete vfr_hawaii_mmap;
+    delete vfr_hawaii_uring;
+    delete vfr_hawaii_uring_direct;
+    delete vfr_hawaii_cached;
+    delete vfr_hawaii_disk_cached;
+    delete vfr_hawaii_lz4;
+    delete vfr_hawaii_wavelet;
+    // a new process picks up what the last one left behind
+    DiskCache reopened("test_disk_cache", DISK_CACHE_BYTES);
+    assert(reopened.used() == disk_cache->used());
+    std::filesystem::remove_all("test_disk_cache");
+    return 0;
+}
+
+// the streaming build writes the same bytes as building in memory first
+int test_streaming_build()
+{
+    // a few copies, to cross FM chunk and log_idx chunk boundaries
+    std::ifstream file("test/data/compacted_type_1");
+    std::string lines(std::istreambuf_iterator<char>(file), {});
+    std::string text = "\n";
+    for (int i = 0; i < 8; i++)
+    {
+        text += lines;
+    }
+
+    FILE *fp = fopen("test_streaming.fm", "wb");
+    size_t log_idx_offset = bwt_and_write_fm_index(text.data(), 1000, fp);
+    fclose(fp);
+
+    auto [fm_index, log_idx, C] = bwt_and_build_fm_index(text.data(), 1000);
+    fp = fopen("test_in_memory.fm", "wb");
+    write_fm_index_to_disk(fm_index, C, text.size(), fp);
+    assert((size_t)ftell(fp) == log_idx_offset);
+    write_log_idx_to_disk(log_idx, fp);
+    fclose(fp);
+
+    std::ifstream streaming("test_streaming.fm", std::ios::binary);
+    std::ifstream in_memory("test_in_memory.fm", std::ios::binary);
+    assert(std::string(std::istreambuf_iterator<char>(streaming), {}) ==
+           std::string(std::istreambuf_iterator<char>(in_memory), {}));
+    std::filesystem::remove("test_streaming.fm");
+    std::filesystem::remove("test_in_memory.fm");
+    return 0;
+}
+
+// a type whose build would go over the budget, or that is too long for
+// divsufsort, fails before anything is written. One just within it builds.
+int test_build_budget()
+{
+    std::filesystem::remove("test_budget.hawaii");
+    std::string path = "test/data/compacted_type_1";
+    // the text is the file with a \n on either side
+    size_t bytes = fm_build_bytes(std::filesystem::file_size(path) + 2, 1000, FMBackend::CHUNKED);
+    assert(bytes < fm_default_build_bytes());
+    bool failed = false;
+    try
+    {
+        write_hawaii("test_budget", {{1, path}}, {{1, 1000}}, Codec(), Codec(),
+                     FMBackend::CHUNKED, bytes - 1);
+    }
+    catch (const std::length_error &)
+    {
+        failed = true;
+    }
+    assert(failed);
+    assert(!std::filesystem::exists("test_budget.hawaii"));
+    write_hawaii("test_budget", {{1, path}}, {{1, 1000}}, Codec(), Codec(),
+                 FMBackend::CHUNKED, bytes);
+    assert(std::filesystem::exists("test_budget.hawaii"));
+    std::filesystem::remove("test_budget.hawaii");
+
+    // a sparse file is enough, nothing is read before the check
+    std::string huge = "test_budget_huge";
+    std::ofstream(huge).close();
+    std::filesystem::resize_file(huge, INT_MAX);
+    failed = false;
+    try
+    {
+        write_hawaii("test_budget", {{1, huge}}, {{1, 1000}}, Codec(), Codec(),
+                     FMBackend::CHUNKED, SIZE_MAX);
+    }
+    catch (const std::length_error &)
+    {
+        failed = true;
+    }
+    assert(failed);
+    assert(!std::filesystem::exists("test_budget.hawaii"));
+    std::filesystem::remove(huge);
+    return 0;
+}
+
+// checkpointed ranks agree with scanning the chunk, on both sides of the
+// checkpoints and for characters the chunk doesn't have, whether the chunk
+// stored its checkpoints or counts them as they are ranked
+int test_ranked_chunk()
+{
+    std::string chars;
+    for (size_t i = 0; i < 3 * FM_CHECKPOINT_CHARS + 1000; i++)
+    {
+        chars += (char)("abc\n\xff"[(i * 7 + i / 5) % 5]);
+    }
+    fm_counts counts = {};
+    counts['a'] = 10;
+    counts['z'] = 3;
+    counts[(unsigned char)'\xff'] = 1;
+    fm_chunk chunk = std::make_tuple(counts, chars);
+    std::string serialized = serializeChunk(chunk);
+    RankedChunk stored = RankedChunk::deserialize(
+        serialized.data(), serialized.size(), CompressionAlgorithm::ZSTD);
+    RankedChunk counted(chunk);
+    std::vector<size_t> positions = {0, 1, FM_CHECKPOINT_CHARS / 2 - 1,
+                                     FM_CHECKPOINT_CHARS / 2 + 1,
+                                     FM_CHECKPOINT_CHARS - 1, FM_CHECKPOINT_CHARS,
+                                     2 * FM_CHECKPOINT_CHARS + 3001,
+                                     3 * FM_CHECKPOINT_CHARS + 999,
+                                     chars.size()};
+    const std::vector<char> ranked_chars = {'a', 'b', '\n', '\xff', 'z', 'q'};
+    // the first ranks of counted race to count its columns
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < 4; t++)
+    {
+        threads.emplace_back([&]() {
+            for (char c : ranked_chars)
+            {
+                for (size_t pos : positions)
+                {
+                    assert(counted.rank(c, pos) == searchChunk(chunk, c, pos));
+                }
+            }
+        });
+    }
+    for (std::thread &thread : threads)
+    {
+        thread.join();
+    }
+    for (char c : ranked_chars)
+    {
+        for (size_t pos : positions)
+        {
+            assert(stored.rank(c, pos) == searchChunk(chunk, c, pos));
+        }
+    }
+    assert(stored.byte_size() < counted.byte_size());
+
+    // checkpoints that don't match the characters
+    std::string truncated = serialized.substr(0, serialized.size() / 2);
+    bool failed = false;
+    try
+    {
+        RankedChunk::deserialize(truncated.data(), truncated.size(),
+                                 CompressionAlgorithm::ZSTD);
+    }
+    catch (const std::exception &)
+    {
+        failed = true;
+    }
+    assert(failed);
+    return 0;
+}
+
+// rank9 ranks agree with counting bit by bit, across blocks, at the end of a
+// chunk that fills its last block and after a round trip
+int test_wavelet_chunk()
+{
+    for (size_t num_words : {(size_t)0, (size_t)5, (size_t)64})
+    {
+        std::vector<uint64_t> words;
+        uint64_t x = 0x9E3779B97F4A7C15ull;
+        for (size_t i = 0; i < num_words; i++)
+        {
+            x ^= x << 13;
+            x ^= x >> 7;
+            x ^= x << 17;
+            words.push_back(i % 7 == 3 ? ~0ull : x);
+        }
+        std::string serialized = WaveletChunk::serialize(words, 100, 7, Codec());
+        WaveletChunk chunk = WaveletChunk::deserialize(
+            serialized.data(), serialized.size(), CompressionAlgorithm::ZSTD);
+        size_t ones = 0;
+        for (size_t pos = 0; pos <= num_words * 64; pos++)
+        {
+            assert(chunk.rank1(pos) == ones);
+            assert(chunk.rank(true, pos) == 7 + ones);
+            assert(chunk.rank(false, pos) == 100 + pos - ones);
+            if (pos < num_words * 64)
+            {
+                ones += (words[pos / 64] >> (pos % 64)) & 1;
+            }
+        }
+    }
+    // a chunk cut off in its header
+    bool failed = false;
+    try
+    {
+        WaveletChunk::deserialize("0123456789", 10, CompressionAlgorithm::ZSTD);
+    }
+    catch (const ReadError &)
+    {
+        failed = true;
+    }
+    assert(failed);
+    return 0;
+}
+
+// count tables round trip, and chunks of older files with text maps still
+// read
+int test_chunk_counts()
+{
+    fm_counts all = {};
+    for (size_t c = 0; c < ALPHABET; c++)
+    {
+        all[c] = c * 1000003 + (c == 7 ? (1ul << 40) : 0);
+    }
+    for (const fm_counts &counts : {fm_counts{}, all})
+    {
+        fm_chunk chunk = std::make_tuple(counts, std::string("ab,:\n c"));
+        fm_chunk decoded = deserializeChunk(serializeChunk(chunk));
+        assert(decoded == chunk);
+    }
+
+    Compressor compressor(CompressionAlgorithm::ZSTD);
+    std::string text_map = " :5,,:12,::7,a:1000000";
+    std::string compressed_map =
+        compressor.compress(text_map.data(), text_map.size());
+    size_t compressed_map_size = compressed_map.size();
+    std::string old_chunk =
+        std::string((char *)&compressed_map_size, sizeof(size_t)) +
+        compressed_map + compressor.compress("xyz", 3);
+    fm_chunk decoded = deserializeChunk(old_chunk);
+    fm_counts expected = {};
+    expected[' '] = 5;
+    expected[','] = 12;
+    expected[':'] = 7;
+    expected['a'] = 1000000;
+    assert(std::get<0>(decoded) == expected && std::get<1>(decoded) == "xyz");
+    return 0;
+}
+
+// a simulated remote over filename whose requests fail if they start in the
+// first half of the file, where the chunks are. The footers at the end read
+// fine.
+VirtualFileRegion *failing_remote(std::string filename)
+{
+    long half = std::filesystem::file_size(filename) / 2;
+    SimulatedRemoteConfig config;
+    config.latency_us = 0;
+    config.jitter_us = 0;
+    config.policy.max_attempts = 2;
+    config.policy.backoff_us = 1000;
+    config.fault = [half](long offset, long) {
+        SimulatedFault fault;
+        fault.fail = offset < half;
+        return fault;
+    };
+    return new SimulatedRemoteVirtualFileRegion(filename, config, std::make_shared<RequestTrace>());
+}
+
+// a range that keeps failing comes out of the searches as a ReadError
+int test_remote_read_errors()
+{
+    std::unique_ptr<VirtualFileRegion> hawaii(failing_remote("test.hawaii"));
+    bool failed = false;
+    try
+    {
+        search_hawaii(hawaii.get(), {1, 53, 63}, "openstack", false);
+    }
+    catch (const ReadError &)
+    {
+        failed = true;
+    }
+    assert(failed);
+
+    // write_oahu reads the types from compressed/ in the working directory
+    std::filesystem::path cwd = std::filesystem::current_path();
+    std::filesystem::path dir = cwd / "test_remote_oahu";
+    std::filesystem::remove_all(dir);
+    std::filesystem::create_directories(dir / "compressed");
+    for (std::string name : {"compacted_type_1", "compacted_type_1_lineno"})
+    {
+        std::filesystem::copy_file(cwd / "test/data" / name, dir / "compressed" / name);
+    }
+    std::filesystem::current_path(dir);
+    write_oahu("test");
+    std::unique_ptr<VirtualFileRegion> oahu(failing_remote("test.oahu"));
+    failed = false;
+    try
+    {
+        search_oahu(oahu.get(), 1, {0}, "openstack");
+    }
+    catch (const ReadError &)
+    {
+        failed = true;
+    }
+    assert(failed);
+    oahu.reset();
+    std::filesystem::current_path(cwd);
+    std::filesystem::remove_all(dir);
+    return 0;
+}
+
+// a split that is not there fails to open with a ReadError, whichever way
+// the session reads local files
+int test_missing_split()
+{
+    for (LocalReads local_reads : {LOCAL_MMAP, LOCAL_IO_URING, LOCAL_IO_URING_DIRECT})
+    {
+        bool failed = false;
+        try
+        {
+            SearchSession session("test_no_such_split", nullptr, local_reads);
+        }
+        catch (const ReadError &e)
+        {
+            failed = std::string(e.what()).find("test_no_such_split") != std::string::npos;
+        }
+        assert(failed);
+    }
     return 0;
 }
 
 int main()
 {
     google::InitGoogleLogging("rottnest");
+    test_ranked_chunk();
+    test_chunk_counts();
+    test_wavelet_chunk();
+    test_streaming_build();
+    test_build_budget();
     for (auto chunk_size : chunk_sizes)
     {
         test_hawaii(chunk_size);
     }
+    test_remote_read_errors();
+    test_missing_split();
 }
\ No newline at end of file
@@ -22,7 +22,7 @@ int main(int argc, char *argv[]) {
   clientConfig.region = "us-west-2";
   clientConfig.connectTimeoutMs = 10000; // 10 seconds
   clientConfig.requestTimeoutMs = 10000; // 10 seconds
-  Aws::S3::S3Client s3_client = Aws::S3::S3Client(clientConfig);
+  auto s3_client = std::make_shared<Aws::S3::S3Client>(clientConfig);
 
   if (mode == "index") {
     size_t num_groups = std::stoul(argv[3]);
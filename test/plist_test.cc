@@ -1,8 +1,10 @@
 #include "cassert"
 #include "plist.h"
+#include <atomic>
 #include <fstream>
 #include <iostream>
 #include <sstream>
+#include <thread>
 
 int main(int argc, char *argv[]) {
 
@@ -16,9 +18,159 @@ int main(int argc, char *argv[]) {
   std::string serialized2 = plist2.serialize();
   assert(serialized == serialized2);
 
-  auto result = plist2.data();
+  auto result = plist2.to_vectors();
   // check that result is the same as data_copy
   assert(result == data_copy);
   assert(plist2.lookup(1) == data_copy[1]);
+
+  // single item lists have no count, lookups are views into one buffer
+  std::vector<std::vector<plist_size_t>> mixed = {
+      {5}, {1, 2}, {9}, {3, 4, 5, 6, 7, 8, 9, 10, 11}, {0}};
+  PListChunk plist3(PListChunk(mixed).serialize());
+  assert(plist3.size() == mixed.size());
+  assert(plist3.to_vectors() == mixed);
+  for (size_t i = 0; i < mixed.size(); ++i) {
+    assert(plist3.lookup(i) == mixed[i]);
+  }
+  assert(plist3.lookup(3).data() + 9 == plist3.lookup(4).data());
+
+  // version 2 marks empty lists too, and lookups past a word of the bit array
+  std::vector<std::vector<plist_size_t>> many;
+  for (plist_size_t i = 0; i < 3 * 32 + 5; ++i) {
+    many.push_back(std::vector<plist_size_t>(i % 4, i));
+  }
+  PListChunk plist4(PListChunk(many).serialize());
+  for (size_t i = 0; i < many.size(); ++i) {
+    assert(plist4.lookup(i) == many[i]);
+  }
+
+  // version 1 chunks from older files still decode: bit array, counts,
+  // lists, number of lists
+  std::vector<plist_size_t> v1 = {2, 5, 1, 2, 2};
+  std::string v1_bytes(1, '\x02');
+  v1_bytes += std::string(reinterpret_cast<const char *>(v1.data()),
+                          v1.size() * sizeof(plist_size_t));
+  Compressor zstd(CompressionAlgorithm::ZSTD);
+  PListChunk plist5(zstd.compress(v1_bytes.data(), v1_bytes.size()));
+  assert(plist5.size() == 2);
+  assert(plist5.lookup(0) == std::vector<plist_size_t>({5}));
+  assert(plist5.lookup(1) == std::vector<plist_size_t>({1, 2}));
+
+  // small chunks serialized against a dictionary trained on their peers
+  std::vector<std::vector<std::vector<plist_size_t>>> chunks;
+  std::vector<std::string> samples;
+  for (plist_size_t c = 0; c < 200; ++c) {
+    std::vector<std::vector<plist_size_t>> chunk;
+    for (plist_size_t i = 0; i < 64; ++i) {
+      chunk.push_back({c * 64 + i, c * 64 + i + 7, c * 64 + i + 1000});
+    }
+    samples.push_back(PListChunk(chunk).encode());
+    chunks.push_back(std::move(chunk));
+  }
+  auto dictionary = ZstdDictionary::train(samples);
+  assert(dictionary != nullptr);
+  size_t plain_bytes = 0, dictionary_bytes = 0;
+  for (const auto &chunk : chunks) {
+    std::string plain = PListChunk(chunk).serialize();
+    Compressor compressor(CompressionAlgorithm::ZSTD, dictionary.get());
+    std::string compressed = PListChunk(chunk).serialize(compressor);
+    plain_bytes += plain.size();
+    dictionary_bytes += compressed.size();
+    PListChunk decoded(compressed.data(), compressed.size(), compressor);
+    assert(decoded.to_vectors() == chunk);
+  }
+  assert(dictionary_bytes < plain_bytes);
+  std::cout << "posting lists " << plain_bytes << " bytes, "
+            << dictionary_bytes << " with a dictionary" << std::endl;
+
+  // bit packed: zero width and full width blocks, partial last block,
+  // unsorted lists and empty lists
+  std::vector<std::vector<plist_size_t>> packed_lists = {
+      std::vector<plist_size_t>(PLIST_PACK_BLOCK, 0),
+      {0xFFFFFFFFu, 0, 0x80000000u, 1},
+      {},
+      {42},
+      {9, 3, 7, 3}};
+  std::vector<plist_size_t> long_list;
+  for (plist_size_t i = 0; i < 3 * PLIST_PACK_BLOCK + 17; ++i) {
+    long_list.push_back(i * 3 + (i % 5));
+  }
+  packed_lists.push_back(long_list);
+  Compressor none(CompressionAlgorithm::NONE);
+  for (const Compressor *compressor : {&none, &zstd}) {
+    PListChunk packed_chunk(packed_lists);
+    std::string packed =
+        packed_chunk.serialize(*compressor, PListEncoding::PACKED);
+    PListChunk unpacked(packed.data(), packed.size(), *compressor);
+    assert(unpacked.to_vectors() == packed_lists);
+    assert(unpacked.encode() == packed_chunk.encode());
+  }
+  // packed blocks unpack on the first lookup that lands in them, whichever
+  // thread and order that comes in
+  std::vector<std::vector<plist_size_t>> spread;
+  for (plist_size_t i = 0; i < 2000; ++i) {
+    spread.push_back(std::vector<plist_size_t>(i % 7, i * 1000));
+    for (plist_size_t j = 0; j < i % 7; ++j) {
+      spread.back()[j] += j * (i % 3);
+    }
+  }
+  std::string packed_spread =
+      PListChunk(spread).serialize(none, PListEncoding::PACKED);
+  PListChunk lazy(packed_spread.data(), packed_spread.size(), none);
+  std::vector<std::thread> threads;
+  std::atomic<bool> mismatch = false;
+  for (size_t t = 0; t < 4; ++t) {
+    threads.emplace_back([&, t] {
+      for (size_t k = 0; k < spread.size(); ++k) {
+        size_t key = (k * 7919 + t * 331) % spread.size();
+        if (!(lazy.lookup(key) == spread[key])) {
+          mismatch = true;
+        }
+      }
+    });
+  }
+  for (std::thread &thread : threads) {
+    thread.join();
+  }
+  assert(!mismatch);
+  assert(lazy.encode() == PListChunk(spread).encode());
+
+  std::string raw_long = PListChunk({long_list}).serialize(none);
+  std::string packed_long =
+      PListChunk({long_list}).serialize(none, PListEncoding::PACKED);
+  assert(packed_long.size() * 4 < raw_long.size());
+
+  // roaring: single items stay as they are, sorted lists become bitmaps and
+  // a chunk with an unsorted list is packed instead
+  std::vector<plist_size_t> sorted_long;
+  for (plist_size_t i = 0; i < 5000; ++i) {
+    sorted_long.push_back(i < 4000 ? i : i * 40);
+  }
+  std::vector<std::vector<plist_size_t>> sorted_lists = {
+      {7}, {}, {1, 2, 3, 70000, 70001}, sorted_long, {0, 0xFFFFFFFFu}};
+  for (const Compressor *compressor : {&none, &zstd}) {
+    std::string roared = PListChunk(sorted_lists)
+                             .serialize(*compressor, PListEncoding::ROARING);
+    PListChunk unroared(roared.data(), roared.size(), *compressor);
+    assert(unroared.to_vectors() == sorted_lists);
+  }
+  std::string roared = PListChunk(sorted_lists).encode(PListEncoding::ROARING);
+  plist_size_t magic;
+  memcpy(&magic, roared.data() + roared.size() - sizeof(magic), sizeof(magic));
+  assert(magic == PLIST_ROARING_MAGIC);
+  std::string fallback = PListChunk(packed_lists).encode(PListEncoding::ROARING);
+  assert(fallback == PListChunk(packed_lists).encode(PListEncoding::PACKED));
+
+  // lists load as bitmaps to combine results
+  PListChunk sorted_chunk(sorted_lists);
+  roaring::Roaring combined = sorted_chunk.lookup(2).bitmap();
+  combined |= sorted_chunk.lookup(0).bitmap();
+  assert(combined.cardinality() == 6 && combined.contains(7));
+  assert((combined & sorted_chunk.lookup(2).bitmap()).cardinality() == 5);
+
+  PListChunk empty_chunk(std::vector<std::vector<plist_size_t>>{});
+  std::string packed_empty = empty_chunk.serialize(none, PListEncoding::PACKED);
+  assert(PListChunk(packed_empty.data(), packed_empty.size(), none).size() ==
+         0);
   return 0;
 }
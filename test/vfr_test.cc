@@ -0,0 +1,397 @@
+#include "cassert"
+#include "vfr.h"
+#include <atomic>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+
+const std::string test_file = "test_vfr.bin";
+const long test_file_size = 1 << 20;
+
+// byte i of the test file, so any range can be checked on its own
+char byte_at(long i)
+{
+    return (char)((i * 131 + i / 256) & 0xFF);
+}
+
+void write_test_file()
+{
+    std::string bytes(test_file_size, '\0');
+    for (long i = 0; i < test_file_size; i++)
+    {
+        bytes[i] = byte_at(i);
+    }
+    std::ofstream file(test_file, std::ios::binary);
+    file.write(bytes.data(), bytes.size());
+}
+
+bool holds_range(const std::string &bytes, const ReadRange &range)
+{
+    if ((long)bytes.size() != range.length)
+    {
+        return false;
+    }
+    for (long i = 0; i < range.length; i++)
+    {
+        if (bytes[i] != byte_at(range.offset + i))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool same_ranges(const std::vector<ReadRange> &a, const std::vector<ReadRange> &b)
+{
+    if (a.size() != b.size())
+    {
+        return false;
+    }
+    for (size_t i = 0; i < a.size(); i++)
+    {
+        if (a[i].offset != b[i].offset || a[i].length != b[i].length)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// merging: adjacent, overlapping, contained and duplicate ranges always, gaps
+// only up to gap and only while the merged range stays under max_length
+int test_coalesce_ranges()
+{
+    assert(coalesce_ranges({}, 100, 1000).empty());
+    // adjacent, given out of order
+    assert(same_ranges(coalesce_ranges({{10, 10}, {0, 10}}, 0, 1000), {{0, 20}}));
+    // overlapping and contained
+    assert(same_ranges(coalesce_ranges({{0, 10}, {5, 10}, {6, 2}}, 0, 1000), {{0, 15}}));
+    // duplicates
+    assert(same_ranges(coalesce_ranges({{40, 8}, {40, 8}}, 0, 1000), {{40, 8}}));
+    // a gap within gap is read through, one beyond it is not
+    assert(same_ranges(coalesce_ranges({{0, 10}, {30, 10}}, 20, 1000), {{0, 40}}));
+    assert(same_ranges(coalesce_ranges({{0, 10}, {31, 10}}, 20, 1000),
+                       {{0, 10}, {31, 10}}));
+    // neither is a merge that would outgrow max_length, but containment is
+    assert(same_ranges(coalesce_ranges({{0, 10}, {20, 10}}, 100, 25),
+                       {{0, 10}, {20, 10}}));
+    assert(same_ranges(coalesce_ranges({{0, 100}, {20, 10}}, 0, 25), {{0, 100}}));
+    return 0;
+}
+
+// every caller of a vectored read gets exactly its own bytes back, in the
+// order it asked, however the ranges were merged underneath
+int test_vectored_reads()
+{
+    std::vector<ReadRange> ranges = {
+        {5000, 100},   // overlaps the next one
+        {5050, 100},
+        {5150, 10},    // adjacent to the one before
+        {0, 16},
+        {5000, 100},   // a duplicate
+        {5010, 20},    // contained in the first
+        {5600, 64},    // within the gap of the ones before
+        {5700, 64},
+        {600000, 4096}, // too far to merge
+        {test_file_size - 7, 7},
+    };
+
+    auto trace = std::make_shared<RequestTrace>();
+    SimulatedRemoteConfig config;
+    config.latency_us = 0;
+    config.jitter_us = 0;
+    config.bytes_per_second = 1e12;
+    config.coalesce_gap = 1024;
+
+    std::vector<std::unique_ptr<VirtualFileRegion>> regions;
+    regions.emplace_back(new DiskVirtualFileRegion(test_file));
+    regions.emplace_back(new MmapVirtualFileRegion(test_file));
+    regions.emplace_back(new IoUringVirtualFileRegion(test_file));
+    regions.emplace_back(new IoUringVirtualFileRegion(test_file, true));
+    regions.emplace_back(new SimulatedRemoteVirtualFileRegion(test_file, config, trace));
+    for (auto &region : regions)
+    {
+        std::vector<std::string> bytes = region->vfreadv(ranges);
+        assert(bytes.size() == ranges.size());
+        for (size_t i = 0; i < ranges.size(); i++)
+        {
+            assert(holds_range(bytes[i], ranges[i]));
+        }
+
+        // and relative to a slice
+        std::unique_ptr<VirtualFileRegion> slice(region->slice(4096, 8192));
+        std::vector<std::string> sliced = slice->vfreadv({{904, 200}, {1000, 8}});
+        assert(holds_range(sliced[0], {5000, 200}));
+        assert(holds_range(sliced[1], {5096, 8}));
+    }
+
+    // the simulated remote merged the ranges around 5000 into one request
+    // and the slice's two into another
+    std::vector<SimulatedRequest> requests = trace->requests();
+    assert(requests.size() == 5);
+    long merged = 0;
+    for (const SimulatedRequest &request : requests)
+    {
+        merged += request.offset == 5000 && request.length == 5764 - 5000;
+    }
+    assert(merged == 1);
+
+    // futures can be waited on in any order, or not at all
+    std::vector<std::future<std::string>> futures = regions.back()->vfreadv_async(ranges);
+    for (size_t i = ranges.size(); i-- > 0;)
+    {
+        if (i % 3 != 1)
+        {
+            assert(holds_range(futures[i].get(), ranges[i]));
+        }
+    }
+    return 0;
+}
+
+// a config for the simulated remote that only costs latency_us, and hands
+// every request to fault
+SimulatedRemoteConfig fault_config(long latency_us, S3ReadPolicy policy,
+                                   std::function<SimulatedFault(long, long)> fault)
+{
+    SimulatedRemoteConfig config;
+    config.latency_us = latency_us;
+    config.jitter_us = 0;
+    config.bytes_per_second = 1e12;
+    config.policy = policy;
+    config.fault = fault;
+    return config;
+}
+
+bool read_fails(VirtualFileRegion *region, long offset, long length)
+{
+    std::string bytes(length, '\0');
+    try
+    {
+        region->read_at(offset, bytes.data(), length);
+    }
+    catch (const ReadError &)
+    {
+        return true;
+    }
+    assert(holds_range(bytes, {offset, length}));
+    return false;
+}
+
+// retryable failures are retried up to max_attempts, others fail the read
+// right away
+int test_retries()
+{
+    S3ReadPolicy policy;
+    policy.hedge = false;
+    policy.max_attempts = 3;
+    policy.backoff_us = 1000;
+    auto trace = std::make_shared<RequestTrace>();
+    std::atomic<int> attempts = 0;
+
+    // the first attempt fails
+    SimulatedRemoteVirtualFileRegion flaky(
+        test_file, fault_config(0, policy, [&](long, long) {
+            SimulatedFault fault;
+            fault.fail = attempts++ == 0;
+            return fault;
+        }),
+        trace);
+    assert(!read_fails(&flaky, 100, 200));
+    assert(attempts == 2);
+
+    // every attempt fails
+    attempts = 0;
+    SimulatedRemoteVirtualFileRegion down(
+        test_file, fault_config(0, policy, [&](long, long) {
+            attempts++;
+            SimulatedFault fault;
+            fault.fail = true;
+            return fault;
+        }),
+        trace);
+    assert(read_fails(&down, 100, 200));
+    assert(attempts == 3);
+
+    // and one that is not worth retrying
+    attempts = 0;
+    SimulatedRemoteVirtualFileRegion denied(
+        test_file, fault_config(0, policy, [&](long, long) {
+            attempts++;
+            SimulatedFault fault;
+            fault.fail = true;
+            fault.retryable = false;
+            return fault;
+        }),
+        trace);
+    assert(read_fails(&denied, 100, 200));
+    assert(attempts == 1);
+    return 0;
+}
+
+// once there are enough latencies to pick a delay from, a request that is
+// much slower than the rest gets a second one, which wins
+int test_hedging()
+{
+    S3ReadPolicy policy;
+    policy.min_hedge_delay_us = 1000;
+    auto trace = std::make_shared<RequestTrace>();
+    std::atomic<int> slow_attempts = 0;
+    SimulatedRemoteVirtualFileRegion region(
+        test_file, fault_config(1000, policy, [&](long offset, long) {
+            SimulatedFault fault;
+            if (offset == 300000 && slow_attempts++ == 0)
+            {
+                fault.extra_us = 10000000;
+            }
+            return fault;
+        }),
+        trace);
+    for (int i = 0; i < S3_LATENCY_SAMPLES / 4; i++)
+    {
+        assert(!read_fails(&region, i * 64, 64));
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    assert(!read_fails(&region, 300000, 4096));
+    assert(slow_attempts == 2);
+    assert(std::chrono::steady_clock::now() - start < std::chrono::seconds(5));
+    return 0;
+}
+
+// closing a region cancels what it still has out, a future of it fails
+// instead of waiting for the request
+int test_close()
+{
+    auto trace = std::make_shared<RequestTrace>();
+    S3ReadPolicy policy;
+    policy.hedge = false;
+    auto start = std::chrono::steady_clock::now();
+    std::future<std::string> future;
+    {
+        SimulatedRemoteVirtualFileRegion region(
+            test_file, fault_config(10000000, policy, nullptr), trace);
+        future = region.read_at_async(0, 100);
+    }
+    bool failed = false;
+    try
+    {
+        future.get();
+    }
+    catch (const ReadError &)
+    {
+        failed = true;
+    }
+    assert(failed);
+    assert(std::chrono::steady_clock::now() - start < std::chrono::seconds(5));
+    assert(trace->requests().empty());
+    return 0;
+}
+
+// a local file that claims a version, like an S3 object's ETag
+class VersionedRegion : public DiskVirtualFileRegion
+{
+  public:
+    VersionedRegion(std::string filename, std::string version)
+        : DiskVirtualFileRegion(filename), version_(version)
+    {
+    }
+    std::string object_version() const override { return version_; }
+
+  private:
+    std::string version_;
+};
+
+// an object overwritten under a shared BlockCache is read anew, raw and
+// decoded, rather than served the pages of the old version
+int test_block_cache_versions()
+{
+    const std::string file = "test_versioned.bin";
+    BlockCache cache(1 << 20);
+    auto decode = [](const char *data, size_t size) { return std::string(data, size); };
+    auto charge = [](const std::string &value) { return value.size(); };
+    std::string bytes(100, '\0');
+    for (char version : {'a', 'b'})
+    {
+        std::ofstream(file, std::ios::binary) << std::string(4096, version);
+        CachingVirtualFileRegion region(new VersionedRegion(file, std::string(1, version)),
+                                        CACHE_RAW | CACHE_DECODED, &cache);
+        region.read_at(100, bytes.data(), 100);
+        assert(bytes == std::string(100, version));
+        assert(*read_decoded<std::string>(&region, 200, 100, "page", decode, charge) ==
+               std::string(100, version));
+    }
+    assert(cache.misses() == 4);
+    std::filesystem::remove(file);
+    return 0;
+}
+
+// two caches over one directory, like two processes sharing it, keep it
+// within the budget between them and see each other's pages
+int test_shared_disk_cache()
+{
+    const std::string directory = "test_shared_disk_cache";
+    std::filesystem::remove_all(directory);
+    const std::string value(1000, 'v');
+    // what one page takes up, the key is two characters
+    const size_t page = sizeof(size_t) + 2 + value.size();
+    const size_t capacity = 10 * page;
+    DiskCache a(directory, capacity);
+    DiskCache b(directory, capacity);
+    for (int i = 0; i < 10; i++)
+    {
+        a.insert("a" + std::to_string(i), value);
+        b.insert("b" + std::to_string(i), value);
+    }
+
+    size_t used = 0;
+    for (const auto &entry : std::filesystem::directory_iterator(directory))
+    {
+        used += entry.file_size();
+    }
+    // each may have added a page or two since it last looked
+    assert(used <= capacity + 4 * page);
+    std::string read;
+    assert(b.lookup("a9", read) && read == value);
+    assert(a.lookup("b9", read) && read == value);
+    // and a third one opened now finds the same
+    DiskCache c(directory, capacity);
+    assert(c.used() == used);
+    std::filesystem::remove_all(directory);
+    return 0;
+}
+
+// reconfiguring the process-wide cache leaves regions opened before it with
+// the cache they had, and a cache whose directory went away just stops
+// keeping pages
+int test_disk_cache_lifetime()
+{
+    DiskCache::configure("test_disk_cache_old", 1 << 20);
+    DiskCachingVirtualFileRegion region(new DiskVirtualFileRegion(test_file),
+                                        DiskCache::instance());
+    DiskCache::configure("test_disk_cache_new", 1 << 20);
+    std::string bytes(100, '\0');
+    region.read_at(0, bytes.data(), 100);
+    assert(holds_range(bytes, {0, 100}));
+
+    std::filesystem::remove_all("test_disk_cache_old");
+    region.read_at(200, bytes.data(), 100);
+    assert(holds_range(bytes, {200, 100}));
+    std::filesystem::remove_all("test_disk_cache_new");
+    return 0;
+}
+
+int main()
+{
+    write_test_file();
+    test_coalesce_ranges();
+    test_vectored_reads();
+    test_retries();
+    test_hedging();
+    test_close();
+    test_block_cache_versions();
+    test_shared_disk_cache();
+    test_disk_cache_lifetime();
+    std::filesystem::remove(test_file);
+    std::cout << "vfr tests passed" << std::endl;
+    return 0;
+}